@@ -0,0 +1,222 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+size_t round_up(size_t n, size_t multiple) {
+    return ((n + multiple - 1) / multiple) * multiple;
+}
+
+void *allocate_slab(size_t size, int huge_pages) {
+    /**
+     * Allocates a zeroed slab of (at least) the given size, aligned on a cache line.
+     * If huge_pages is TRUE, the slab is mapped with huge pages when the system has some reserved,
+     * otherwise transparent huge pages are requested for it.
+     */
+    void *slab = NULL;
+
+    if (huge_pages) {
+#ifdef MAP_HUGETLB
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            return slab;
+        }
+#endif
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(slab, size, MADV_HUGEPAGE);
+#endif
+        return slab;
+    }
+    if (posix_memalign(&slab, ARENA_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    memset(slab, 0, size);
+    return slab;
+}
+
+void free_slab(void *slab, size_t size, int huge_pages) {
+    if (slab == NULL) return;
+    if (huge_pages) {
+        munmap(slab, size);
+    } else {
+        free(slab);
+    }
+}
+
+Arena *allocate_arena(size_t nb_nodes, size_t num_annotations, const AnalysisContext *context) {
+    /**
+     * Allocates the working memory of an analysis (with the model, huge pages option and thread pool of its context):
+     * (0) transition matrices, (1) per-node likelihood vectors (and branch lengths) and (2) per-node state indices,
+     * each of them in one slab, sliced by node id.
+     * Under F81 (and JC) a branch is fully described by exp(-mu t),
+     * so the slab (0) only keeps one value per node instead of a matrix.
+     */
+    size_t doubles_per_line = ARENA_ALIGNMENT / sizeof(double);
+    size_t i;
+    int f81 = context->model == MODEL_JC || context->model == MODEL_F81;
+    int huge_pages = context->huge_pages;
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->nb_nodes = nb_nodes;
+    arena->num_annotations = num_annotations;
+    arena->huge_pages = huge_pages;
+    arena->pool = context->pool;
+    arena->model = context->model;
+    arena->f81 = f81;
+    arena->stride = round_up(num_annotations, doubles_per_line);
+    arena->pij_stride = f81 ? 0 : round_up(num_annotations * num_annotations, doubles_per_line);
+
+    size_t vector_size = nb_nodes * arena->stride;
+    arena->slab_sizes[0] = (f81 ? round_up(nb_nodes, doubles_per_line) : nb_nodes * arena->pij_stride)
+                           * sizeof(double);
+    arena->slab_sizes[1] = (5 * vector_size + round_up(nb_nodes, doubles_per_line)) * sizeof(double);
+    arena->slab_sizes[2] = (2 * vector_size + 3 * round_up(nb_nodes, doubles_per_line)) * sizeof(size_t);
+    for (i = 0; i < 3; i++) {
+        if (huge_pages) {
+            arena->slab_sizes[i] = round_up(arena->slab_sizes[i], HUGE_PAGE_SIZE);
+        }
+        arena->slabs[i] = allocate_slab(arena->slab_sizes[i], huge_pages);
+        if (arena->slabs[i] == NULL) {
+            fprintf(stderr, "Not enough memory to allocate %zd bytes: %s\n", arena->slab_sizes[i], strerror(errno));
+            free_arena(arena);
+            return NULL;
+        }
+    }
+
+    if (f81) {
+        arena->branch_exp = (double *) arena->slabs[0];
+    } else {
+        arena->pij = (double *) arena->slabs[0];
+    }
+
+    arena->bottom_up_likelihood = (double *) arena->slabs[1];
+    arena->top_down_likelihood = arena->bottom_up_likelihood + vector_size;
+    arena->marginal = arena->top_down_likelihood + vector_size;
+    arena->sim_marginal_prob = arena->marginal + vector_size;
+    arena->joint_likelihood = arena->sim_marginal_prob + vector_size;
+    arena->branch_len = arena->joint_likelihood + vector_size;
+
+    arena->best_states = (size_t *) arena->slabs[2];
+    arena->joint_state = arena->best_states + vector_size;
+    arena->best_joint_state = arena->joint_state + vector_size;
+    arena->ma_state = arena->best_joint_state + round_up(nb_nodes, doubles_per_line);
+    arena->tip_state = arena->ma_state + round_up(nb_nodes, doubles_per_line);
+    for (i = 0; i < nb_nodes; i++) {
+        arena->tip_state[i] = NO_TIP_STATE;
+    }
+
+    if (!f81) {
+        for (arena->pij_cache_size = 1; arena->pij_cache_size < 2 * nb_nodes; arena->pij_cache_size *= 2);
+        arena->pij_cache_len = malloc(arena->pij_cache_size * sizeof(double));
+        arena->pij_cache_id = malloc(arena->pij_cache_size * sizeof(int));
+        arena->pij_owner = malloc(nb_nodes * sizeof(int));
+        arena->pij_status = calloc(nb_nodes, sizeof(int));
+        if (arena->pij_cache_len == NULL || arena->pij_cache_id == NULL || arena->pij_owner == NULL
+            || arena->pij_status == NULL) {
+            fprintf(stderr, "Not enough memory to allocate the transition matrix cache: %s\n", strerror(errno));
+            free_arena(arena);
+            return NULL;
+        }
+        for (i = 0; i < nb_nodes; i++) {
+            arena->pij_owner[i] = (int) i;
+        }
+    }
+
+    return arena;
+}
+
+void reset_arena(Arena *arena) {
+    /**
+     * Brings the arena back to its state after allocation, for another analysis with the same model and states,
+     * without giving its memory back.
+     */
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        memset(arena->slabs[i], 0, arena->slab_sizes[i]);
+    }
+    for (i = 0; i < arena->nb_nodes; i++) {
+        arena->tip_state[i] = NO_TIP_STATE;
+    }
+    if (!arena->f81) {
+        for (i = 0; i < arena->nb_nodes; i++) {
+            arena->pij_owner[i] = (int) i;
+            arena->pij_status[i] = PIJ_PENDING;
+        }
+    }
+    arena->pij_computed = 0;
+    arena->pij_reused = 0;
+}
+
+void free_arena(Arena *arena) {
+    size_t i;
+    if (arena == NULL) return;
+    for (i = 0; i < 3; i++) {
+        free_slab(arena->slabs[i], arena->slab_sizes[i], arena->huge_pages);
+    }
+    free(arena->pij_cache_len);
+    free(arena->pij_cache_id);
+    free(arena->pij_owner);
+    free(arena->pij_status);
+    free(arena);
+}
+
+LaneArena *allocate_lane_arena(size_t nb_nodes, size_t num_annotations, size_t nb_lanes,
+                               const AnalysisContext *context) {
+    /**
+     * Allocates the working memory of the bottom-up likelihood evaluated for nb_lanes parameter vectors at once:
+     * (0) transition matrices (or exp(-mu t) under F81) and (1) per-node likelihood vectors, interleaved by lane.
+     */
+    size_t doubles_per_line = ARENA_ALIGNMENT / sizeof(double);
+    size_t i;
+    int f81 = context->model == MODEL_JC || context->model == MODEL_F81;
+    int huge_pages = context->huge_pages;
+    LaneArena *lanes = calloc(1, sizeof(LaneArena));
+    if (lanes == NULL) {
+        return NULL;
+    }
+    lanes->nb_nodes = nb_nodes;
+    lanes->num_annotations = num_annotations;
+    lanes->nb_lanes = nb_lanes;
+    lanes->huge_pages = huge_pages;
+    lanes->model = context->model;
+    lanes->f81 = f81;
+    lanes->stride = round_up(num_annotations * nb_lanes, doubles_per_line);
+    lanes->pij_stride = f81 ? 0 : round_up(num_annotations * num_annotations * nb_lanes, doubles_per_line);
+    lanes->lane_stride = f81 ? round_up(nb_lanes, doubles_per_line) : 0;
+
+    lanes->slab_sizes[0] = nb_nodes * (f81 ? lanes->lane_stride : lanes->pij_stride) * sizeof(double);
+    lanes->slab_sizes[1] = nb_nodes * lanes->stride * sizeof(double);
+    for (i = 0; i < 2; i++) {
+        if (huge_pages) {
+            lanes->slab_sizes[i] = round_up(lanes->slab_sizes[i], HUGE_PAGE_SIZE);
+        }
+        lanes->slabs[i] = allocate_slab(lanes->slab_sizes[i], huge_pages);
+        if (lanes->slabs[i] == NULL) {
+            fprintf(stderr, "Not enough memory to allocate %zd bytes: %s\n", lanes->slab_sizes[i], strerror(errno));
+            free_lane_arena(lanes);
+            return NULL;
+        }
+    }
+
+    if (f81) {
+        lanes->branch_exp = (double *) lanes->slabs[0];
+    } else {
+        lanes->pij = (double *) lanes->slabs[0];
+    }
+    lanes->bottom_up_likelihood = (double *) lanes->slabs[1];
+    return lanes;
+}
+
+void free_lane_arena(LaneArena *lanes) {
+    size_t i;
+    if (lanes == NULL) return;
+    for (i = 0; i < 2; i++) {
+        free_slab(lanes->slabs[i], lanes->slab_sizes[i], lanes->huge_pages);
+    }
+    free(lanes);
+}
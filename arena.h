@@ -0,0 +1,16 @@
+#ifndef PASTML_ARENA_H
+#define PASTML_ARENA_H
+
+#include "pastml.h"
+
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+Arena *allocate_arena(size_t nb_nodes, size_t num_annotations, const AnalysisContext *context);
+void reset_arena(Arena *arena);
+void free_arena(Arena *arena);
+LaneArena *allocate_lane_arena(size_t nb_nodes, size_t num_annotations, size_t nb_lanes,
+                               const AnalysisContext *context);
+void free_lane_arena(LaneArena *lanes);
+
+#endif //PASTML_ARENA_H
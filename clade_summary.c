@@ -0,0 +1,206 @@
+#include <errno.h>
+#include "clade_summary.h"
+#include "name_index.h"
+
+static uint64_t mix_bits(uint64_t x) {
+    /* splitmix64 finaliser */
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t *get_clade_keys(const Tree *s_tree) {
+    /**
+     * Identifies the clade (the set of tips) below each node by the sum of the hashes of its tip names,
+     * calculated in post-order: the same clade gets the same key in all the trees,
+     * whatever its topology and node names.
+     */
+    const TraversalPlan *plan = s_tree->plan;
+    uint64_t *keys = malloc(plan->nb_nodes * sizeof(uint64_t));
+    int n, k, id;
+
+    if (keys == NULL) {
+        return NULL;
+    }
+    for (n = 0; n < plan->nb_nodes; n++) {
+        id = plan->post_order[n];
+        if (plan->child_offset[id] == plan->child_offset[id + 1]) {
+            keys[id] = mix_bits((uint64_t) hash_name(s_tree->nodes[id]->name));
+        } else {
+            keys[id] = 0;
+            for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+                keys[id] += keys[plan->children[k]];
+            }
+        }
+    }
+    return keys;
+}
+
+static int find_clade(const CladeSummary *summary, uint64_t key) {
+    /* returns the summary tree node with the given clade, or -1 */
+    size_t slot = (size_t) mix_bits(key) & summary->mask;
+
+    while (summary->clade_nodes[slot] != -1) {
+        if (summary->clade_keys[slot] == key) {
+            return summary->clade_nodes[slot];
+        }
+        slot = (slot + 1) & summary->mask;
+    }
+    return -1;
+}
+
+CladeSummary *new_clade_summary(const Tree *s_tree) {
+    /**
+     * Prepares a summary on the clades of the given tree, to which the other trees are then added.
+     */
+    size_t nb_slots = 16, slot;
+    int id;
+    uint64_t *keys;
+    CladeSummary *summary = calloc(1, sizeof(CladeSummary));
+
+    if (summary == NULL) {
+        return NULL;
+    }
+    while (nb_slots < 2 * (size_t) s_tree->nb_nodes) {
+        nb_slots *= 2;
+    }
+    summary->s_tree = s_tree;
+    summary->mask = nb_slots - 1;
+    summary->clade_keys = malloc(nb_slots * sizeof(uint64_t));
+    summary->clade_nodes = malloc(nb_slots * sizeof(int));
+    summary->nb_trees_with_clade = calloc(s_tree->nb_nodes, sizeof(size_t));
+    keys = get_clade_keys(s_tree);
+    if (summary->clade_keys == NULL || summary->clade_nodes == NULL || summary->nb_trees_with_clade == NULL
+        || keys == NULL) {
+        free(keys);
+        free_clade_summary(summary);
+        return NULL;
+    }
+    for (slot = 0; slot < nb_slots; slot++) {
+        summary->clade_nodes[slot] = -1;
+    }
+    /* a node with a single child has the same clade as its child: the first one (by id) represents it */
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        if (find_clade(summary, keys[id]) != -1) {
+            continue;
+        }
+        slot = (size_t) mix_bits(keys[id]) & summary->mask;
+        while (summary->clade_nodes[slot] != -1) {
+            slot = (slot + 1) & summary->mask;
+        }
+        summary->clade_keys[slot] = keys[id];
+        summary->clade_nodes[slot] = id;
+    }
+    free(keys);
+    pthread_mutex_init(&summary->mutex, NULL);
+    return summary;
+}
+
+void free_clade_summary(CladeSummary *summary) {
+    if (summary == NULL) return;
+    if (summary->clade_keys != NULL && summary->clade_nodes != NULL && summary->nb_trees_with_clade != NULL) {
+        pthread_mutex_destroy(&summary->mutex);
+    }
+    free(summary->clade_keys);
+    free(summary->clade_nodes);
+    free(summary->nb_trees_with_clade);
+    free(summary->marginal_sum);
+    free(summary->character);
+    free(summary);
+}
+
+int add_to_clade_summary(CladeSummary *summary, const Tree *s_tree, const Arena *arena, size_t num_annotations,
+                         char *const *character) {
+    /**
+     * Adds the marginal probabilities (before the marginal approximation) of the nodes of a tree
+     * to those of the summary tree nodes with the same clades.
+     * The states (num_annotations and their names) must be the same for all the trees.
+     */
+    uint64_t *keys = get_clade_keys(s_tree);
+    const double *marginal;
+    double *marginal_sum;
+    int id, summary_id;
+    size_t i;
+
+    if (keys == NULL) {
+        return ENOMEM;
+    }
+    pthread_mutex_lock(&summary->mutex);
+    if (summary->marginal_sum == NULL) {
+        summary->num_annotations = num_annotations;
+        summary->marginal_sum = calloc(summary->s_tree->nb_nodes * num_annotations, sizeof(double));
+        summary->character = malloc(num_annotations * sizeof(char *));
+        if (summary->marginal_sum == NULL || summary->character == NULL) {
+            pthread_mutex_unlock(&summary->mutex);
+            free(keys);
+            return ENOMEM;
+        }
+        memcpy(summary->character, character, num_annotations * sizeof(char *));
+    }
+    summary->nb_trees++;
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        summary_id = find_clade(summary, keys[id]);
+        /* a clade is counted once per tree, even below single-child nodes */
+        if (summary_id == -1 || (id > 0 && keys[s_tree->plan->parent[id]] == keys[id])) {
+            continue;
+        }
+        summary->nb_trees_with_clade[summary_id]++;
+        marginal = NODE_VECTOR(arena, marginal, id);
+        marginal_sum = summary->marginal_sum + summary_id * num_annotations;
+        for (i = 0; i < num_annotations; i++) {
+            marginal_sum[i] += marginal[i];
+        }
+    }
+    pthread_mutex_unlock(&summary->mutex);
+    free(keys);
+    return EXIT_SUCCESS;
+}
+
+int write_clade_summary(const CladeSummary *summary, const char *output_file_path) {
+    /**
+     * Writes, for each node of the summary tree, the fraction of the trees that contain its clade
+     * and the mean marginal probabilities of the states of this clade over these trees.
+     */
+    const double *marginal_sum;
+    size_t i, nb_trees;
+    int id, summary_id;
+    uint64_t *keys;
+
+    if (summary->nb_trees == 0) {
+        fprintf(stderr, "No tree was analysed, there is nothing to summarise.\n");
+        return EXIT_FAILURE;
+    }
+    FILE *outfile = fopen(output_file_path, "w");
+    if (!outfile) {
+        fprintf(stderr, "Output annotation file %s is impossible to access.", output_file_path);
+        fprintf(stderr, "Value of errno: %d\n", errno);
+        fprintf(stderr, "Error opening the file: %s\n", strerror(errno));
+        return ENOENT;
+    }
+    keys = get_clade_keys(summary->s_tree);
+    if (keys == NULL) {
+        fclose(outfile);
+        return ENOMEM;
+    }
+
+    fprintf(outfile, "node ID,clade support");
+    for (i = 0; i < summary->num_annotations; i++) {
+        fprintf(outfile, ",%s", summary->character[i]);
+    }
+    fprintf(outfile, "\n");
+
+    for (id = 0; id < summary->s_tree->nb_nodes; id++) {
+        summary_id = find_clade(summary, keys[id]);
+        nb_trees = summary->nb_trees_with_clade[summary_id];
+        marginal_sum = summary->marginal_sum + summary_id * summary->num_annotations;
+        fprintf(outfile, "%s,%.5f", summary->s_tree->nodes[id]->name, (double) nb_trees / (double) summary->nb_trees);
+        for (i = 0; i < summary->num_annotations; i++) {
+            fprintf(outfile, ",%.5f", marginal_sum[i] / (double) MAX(nb_trees, 1));
+        }
+        fprintf(outfile, "\n");
+    }
+
+    free(keys);
+    fclose(outfile);
+    return EXIT_SUCCESS;
+}
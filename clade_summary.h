@@ -0,0 +1,29 @@
+#ifndef PASTML_CLADE_SUMMARY_H
+#define PASTML_CLADE_SUMMARY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "pastml.h"
+
+/* The marginal probabilities of a character over a collection of trees, summarised on the clades of one of them:
+ * the trees can be added from several threads at once. */
+typedef struct __CladeSummary {
+    const Tree *s_tree;             /* the summary tree */
+    uint64_t *clade_keys;           /* hash table from the clades (see get_clade_keys) to the summary tree nodes */
+    int *clade_nodes;
+    size_t mask;
+    size_t nb_trees;                /* number of trees added */
+    size_t num_annotations;         /* set by the first tree added */
+    char **character;
+    size_t *nb_trees_with_clade;    /* per summary tree node */
+    double *marginal_sum;           /* per summary tree node, num_annotations values each */
+    pthread_mutex_t mutex;
+} CladeSummary;
+
+CladeSummary *new_clade_summary(const Tree *s_tree);
+void free_clade_summary(CladeSummary *summary);
+int add_to_clade_summary(CladeSummary *summary, const Tree *s_tree, const Arena *arena, size_t num_annotations,
+                         char *const *character);
+int write_clade_summary(const CladeSummary *summary, const char *output_file_path);
+
+#endif //PASTML_CLADE_SUMMARY_H
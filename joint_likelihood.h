@@ -7,6 +7,7 @@
 
 #include "pastml.h"
 
-void calculate_joint_probabilities(Tree *s_tree, size_t num_annotations, double *frequency);
+void calculate_joint_probabilities(const Tree *s_tree, const Arena *arena, size_t num_annotations,
+                                   const double *frequency, const AnalysisContext *context);
 
 #endif //PASTML_JOINT_LIK_H_H
@@ -0,0 +1,375 @@
+#include <pthread.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PASTML_X86 1
+#endif
+
+static void multiply_by_child_scalar(const double *pij, const double *child_likelihood, double *likelihood,
+                                     size_t n, int first) {
+    size_t i, j;
+    for (i = 0; i < n; i++) {
+        /* Calculate the probability of having a branch from the node to its child node,
+         * given that the node is in state i: p_child_branch_from_i = sum_j(p_ij * p_child_j)
+         */
+        double p_child_branch_from_i = 0.;
+        for (j = 0; j < n; j++) {
+            p_child_branch_from_i += pij[i * n + j] * child_likelihood[j];
+        }
+        if (first) {
+            likelihood[i] = p_child_branch_from_i;
+        } else {
+            likelihood[i] *= p_child_branch_from_i;
+        }
+    }
+}
+
+static void multiply_by_child_lanes_scalar(const double *pij, const double *child_likelihood, double *likelihood,
+                                           size_t n, size_t nb_lanes, int first) {
+    size_t i, j, l;
+    double p_child_branch_from_i[nb_lanes];
+    for (i = 0; i < n; i++) {
+        for (l = 0; l < nb_lanes; l++) {
+            p_child_branch_from_i[l] = 0.;
+        }
+        for (j = 0; j < n; j++) {
+            const double *p = pij + (i * n + j) * nb_lanes;
+            const double *c = child_likelihood + j * nb_lanes;
+            for (l = 0; l < nb_lanes; l++) {
+                p_child_branch_from_i[l] += p[l] * c[l];
+            }
+        }
+        for (l = 0; l < nb_lanes; l++) {
+            if (first) {
+                likelihood[i * nb_lanes + l] = p_child_branch_from_i[l];
+            } else {
+                likelihood[i * nb_lanes + l] *= p_child_branch_from_i[l];
+            }
+        }
+    }
+}
+
+#ifdef PASTML_X86
+
+__attribute__((target("avx2,fma")))
+static void multiply_by_child_lanes_avx2(const double *pij, const double *child_likelihood, double *likelihood,
+                                         size_t n, size_t nb_lanes, int first) {
+    /**
+     * As the data is interleaved by lane, the same cells of four lanes are next to each other,
+     * so each instruction works on four lanes, without any reduction.
+     * The remaining lanes (if nb_lanes is not a multiple of four) are processed one by one.
+     */
+    size_t i, j, l;
+    size_t full = nb_lanes & ~(size_t) 3;
+    __m256d acc;
+
+    for (i = 0; i < n; i++) {
+        double *lk = likelihood + i * nb_lanes;
+        for (l = 0; l < full; l += 4) {
+            acc = _mm256_setzero_pd();
+            for (j = 0; j < n; j++) {
+                acc = _mm256_fmadd_pd(_mm256_loadu_pd(pij + (i * n + j) * nb_lanes + l),
+                                      _mm256_loadu_pd(child_likelihood + j * nb_lanes + l), acc);
+            }
+            if (first) {
+                _mm256_storeu_pd(lk + l, acc);
+            } else {
+                _mm256_storeu_pd(lk + l, _mm256_mul_pd(_mm256_loadu_pd(lk + l), acc));
+            }
+        }
+        for (; l < nb_lanes; l++) {
+            double p_child_branch_from_i = 0.;
+            for (j = 0; j < n; j++) {
+                p_child_branch_from_i += pij[(i * n + j) * nb_lanes + l] * child_likelihood[j * nb_lanes + l];
+            }
+            if (first) {
+                lk[l] = p_child_branch_from_i;
+            } else {
+                lk[l] *= p_child_branch_from_i;
+            }
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void multiply_by_child_avx2(const double *pij, const double *child_likelihood, double *likelihood,
+                                   size_t n, int first) {
+    /**
+     * Processes four rows of pij at a time: each row is accumulated in its own register,
+     * the last (incomplete) group of columns is read with a mask,
+     * and the four sums are reduced together, so that the four results come out in one register.
+     */
+    size_t i, j, r;
+    size_t full = n & ~(size_t) 3, rest = n - full;
+    __m256i tail = _mm256_set_epi64x(0, rest > 2 ? -1 : 0, rest > 1 ? -1 : 0, rest > 0 ? -1 : 0);
+    __m256d l, acc0, acc1, acc2, acc3, t0, t1, dots;
+    double sums[4];
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        const double *p = pij + i * n;
+        acc0 = acc1 = acc2 = acc3 = _mm256_setzero_pd();
+        for (j = 0; j < full; j += 4) {
+            l = _mm256_loadu_pd(child_likelihood + j);
+            acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(p + j), l, acc0);
+            acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(p + n + j), l, acc1);
+            acc2 = _mm256_fmadd_pd(_mm256_loadu_pd(p + 2 * n + j), l, acc2);
+            acc3 = _mm256_fmadd_pd(_mm256_loadu_pd(p + 3 * n + j), l, acc3);
+        }
+        if (rest) {
+            l = _mm256_maskload_pd(child_likelihood + full, tail);
+            acc0 = _mm256_fmadd_pd(_mm256_maskload_pd(p + full, tail), l, acc0);
+            acc1 = _mm256_fmadd_pd(_mm256_maskload_pd(p + n + full, tail), l, acc1);
+            acc2 = _mm256_fmadd_pd(_mm256_maskload_pd(p + 2 * n + full, tail), l, acc2);
+            acc3 = _mm256_fmadd_pd(_mm256_maskload_pd(p + 3 * n + full, tail), l, acc3);
+        }
+        t0 = _mm256_hadd_pd(acc0, acc1);
+        t1 = _mm256_hadd_pd(acc2, acc3);
+        dots = _mm256_add_pd(_mm256_permute2f128_pd(t0, t1, 0x20), _mm256_permute2f128_pd(t0, t1, 0x31));
+        if (first) {
+            _mm256_storeu_pd(likelihood + i, dots);
+        } else {
+            _mm256_storeu_pd(likelihood + i, _mm256_mul_pd(_mm256_loadu_pd(likelihood + i), dots));
+        }
+    }
+    /* the remaining rows, one by one */
+    for (; i < n; i++) {
+        const double *p = pij + i * n;
+        acc0 = _mm256_setzero_pd();
+        for (j = 0; j < full; j += 4) {
+            acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(p + j), _mm256_loadu_pd(child_likelihood + j), acc0);
+        }
+        if (rest) {
+            acc0 = _mm256_fmadd_pd(_mm256_maskload_pd(p + full, tail),
+                                   _mm256_maskload_pd(child_likelihood + full, tail), acc0);
+        }
+        _mm256_storeu_pd(sums, acc0);
+        double p_child_branch_from_i = 0.;
+        for (r = 0; r < 4; r++) {
+            p_child_branch_from_i += sums[r];
+        }
+        if (first) {
+            likelihood[i] = p_child_branch_from_i;
+        } else {
+            likelihood[i] *= p_child_branch_from_i;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void multiply_by_child_avx512(const double *pij, const double *child_likelihood, double *likelihood,
+                                     size_t n, int first) {
+    /**
+     * Processes one row of pij at a time, eight columns per instruction,
+     * reading the last (incomplete) group of columns with a mask.
+     * Small matrices do not fill the registers, so they are passed on to the AVX2 kernel.
+     */
+    size_t i, j;
+    size_t full = n & ~(size_t) 7, rest = n - full;
+    __mmask8 tail = (__mmask8) ((1u << rest) - 1u);
+    __m512d acc, l_tail;
+
+    if (n < 8) {
+        multiply_by_child_avx2(pij, child_likelihood, likelihood, n, first);
+        return;
+    }
+    l_tail = _mm512_maskz_loadu_pd(tail, child_likelihood + full);
+    for (i = 0; i < n; i++) {
+        const double *p = pij + i * n;
+        acc = _mm512_setzero_pd();
+        for (j = 0; j < full; j += 8) {
+            acc = _mm512_fmadd_pd(_mm512_loadu_pd(p + j), _mm512_loadu_pd(child_likelihood + j), acc);
+        }
+        if (rest) {
+            acc = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(tail, p + full), l_tail, acc);
+        }
+        double p_child_branch_from_i = _mm512_reduce_add_pd(acc);
+        if (first) {
+            likelihood[i] = p_child_branch_from_i;
+        } else {
+            likelihood[i] *= p_child_branch_from_i;
+        }
+    }
+}
+
+#endif
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const char *kernel_name;
+
+static void multiply_by_child_dispatch(const double *pij, const double *child_likelihood, double *likelihood,
+                                       size_t n, int first) {
+    init_kernels();
+    multiply_by_child(pij, child_likelihood, likelihood, n, first);
+}
+
+child_product_kernel multiply_by_child = multiply_by_child_dispatch;
+
+static void multiply_by_child_lanes_dispatch(const double *pij, const double *child_likelihood, double *likelihood,
+                                             size_t n, size_t nb_lanes, int first) {
+    init_kernels();
+    multiply_by_child_lanes(pij, child_likelihood, likelihood, n, nb_lanes, first);
+}
+
+lane_product_kernel multiply_by_child_lanes = multiply_by_child_lanes_dispatch;
+
+void multiply_by_f81_child(double exp_mu_t, const double *frequencies, const double *child_likelihood,
+                           double *likelihood, size_t n, int first) {
+    /**
+     * Same as multiply_by_child, but for F81 (and JC), where
+     * pij = \pi_j (1 - exp(-mu t)) + exp(-mu t), if i == j, \pi_j (1 - exp(-mu t)), otherwise,
+     * hence sum_j(p_ij * p_child_j) = exp(-mu t) p_child_i + (1 - exp(-mu t)) sum_j(\pi_j p_child_j),
+     * which takes O(n) instead of O(n^2).
+     */
+    size_t i;
+    double weighted_sum = 0.;
+    for (i = 0; i < n; i++) {
+        weighted_sum += frequencies[i] * child_likelihood[i];
+    }
+    weighted_sum *= 1.0 - exp_mu_t;
+    if (first) {
+        for (i = 0; i < n; i++) {
+            likelihood[i] = exp_mu_t * child_likelihood[i] + weighted_sum;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            likelihood[i] *= exp_mu_t * child_likelihood[i] + weighted_sum;
+        }
+    }
+}
+
+void multiply_by_tip(const double *pij, size_t state, double *likelihood, size_t n, int first) {
+    /**
+     * Same as multiply_by_child, for a tip observed in the given state (its likelihood is 1 for it and 0 otherwise),
+     * hence sum_j(p_ij * p_child_j) = p_i,state: a column of pij, which takes O(n) instead of O(n^2).
+     */
+    size_t i;
+    if (first) {
+        for (i = 0; i < n; i++) {
+            likelihood[i] = pij[i * n + state];
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            likelihood[i] *= pij[i * n + state];
+        }
+    }
+}
+
+void multiply_by_f81_tip(double exp_mu_t, const double *frequencies, size_t state, double *likelihood, size_t n,
+                         int first) {
+    /**
+     * Same as multiply_by_tip, but for F81 (and JC):
+     * p_i,state = \pi_state (1 - exp(-mu t)) (+ exp(-mu t) if i == state).
+     */
+    size_t i;
+    double p_change = frequencies[state] * (1.0 - exp_mu_t);
+    double at_state = first ? 1.0 : likelihood[state];
+    if (first) {
+        for (i = 0; i < n; i++) {
+            likelihood[i] = p_change;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            likelihood[i] *= p_change;
+        }
+    }
+    likelihood[state] = at_state * (p_change + exp_mu_t);
+}
+
+void set_cherry_likelihood(const double *pij_1, size_t state_1, const double *pij_2, size_t state_2,
+                           double *likelihood, size_t n) {
+    /**
+     * Sets the likelihood of a node whose two children are tips observed in the given states:
+     * likelihood_i = p1_i,state_1 * p2_i,state_2, in one pass over the two columns.
+     */
+    size_t i;
+    for (i = 0; i < n; i++) {
+        likelihood[i] = pij_1[i * n + state_1] * pij_2[i * n + state_2];
+    }
+}
+
+void set_f81_cherry_likelihood(double exp_mu_t_1, size_t state_1, double exp_mu_t_2, size_t state_2,
+                               const double *frequencies, double *likelihood, size_t n) {
+    /**
+     * Same as set_cherry_likelihood, but for F81 (and JC), see multiply_by_f81_tip.
+     */
+    size_t i;
+    double p_change_1 = frequencies[state_1] * (1.0 - exp_mu_t_1);
+    double p_change_2 = frequencies[state_2] * (1.0 - exp_mu_t_2);
+    for (i = 0; i < n; i++) {
+        likelihood[i] = p_change_1 * p_change_2;
+    }
+    likelihood[state_1] = (p_change_1 + exp_mu_t_1) * p_change_2;
+    likelihood[state_2] = (state_1 == state_2 ? p_change_1 + exp_mu_t_1 : p_change_1) * (p_change_2 + exp_mu_t_2);
+}
+
+void multiply_by_f81_child_lanes(const double *exp_mu_t, const double *frequencies, const double *child_likelihood,
+                                 double *likelihood, size_t n, size_t nb_lanes, int first) {
+    /**
+     * Same as multiply_by_f81_child, for nb_lanes parameter vectors at once,
+     * with exp_mu_t given per lane, and the frequencies and likelihoods interleaved by lane.
+     */
+    size_t i, l;
+    double weighted_sum[nb_lanes];
+    for (l = 0; l < nb_lanes; l++) {
+        weighted_sum[l] = 0.;
+    }
+    for (i = 0; i < n; i++) {
+        for (l = 0; l < nb_lanes; l++) {
+            weighted_sum[l] += frequencies[i * nb_lanes + l] * child_likelihood[i * nb_lanes + l];
+        }
+    }
+    for (l = 0; l < nb_lanes; l++) {
+        weighted_sum[l] *= 1.0 - exp_mu_t[l];
+    }
+    for (i = 0; i < n; i++) {
+        double *lk = likelihood + i * nb_lanes;
+        const double *c = child_likelihood + i * nb_lanes;
+        if (first) {
+            for (l = 0; l < nb_lanes; l++) {
+                lk[l] = exp_mu_t[l] * c[l] + weighted_sum[l];
+            }
+        } else {
+            for (l = 0; l < nb_lanes; l++) {
+                lk[l] *= exp_mu_t[l] * c[l] + weighted_sum[l];
+            }
+        }
+    }
+}
+
+static void choose_kernels(void) {
+    /**
+     * Picks the widest child product kernels the CPU supports, and keeps the name of the single-lane one.
+     */
+#ifdef PASTML_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        multiply_by_child_lanes = multiply_by_child_lanes_avx2;
+    } else {
+        multiply_by_child_lanes = multiply_by_child_lanes_scalar;
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        multiply_by_child = multiply_by_child_avx512;
+        kernel_name = "AVX-512";
+        return;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        multiply_by_child = multiply_by_child_avx2;
+        kernel_name = "AVX2";
+        return;
+    }
+#else
+    multiply_by_child_lanes = multiply_by_child_lanes_scalar;
+#endif
+    multiply_by_child = multiply_by_child_scalar;
+    kernel_name = "scalar";
+}
+
+const char *init_kernels(void) {
+    /**
+     * Picks the kernels once per process (whatever the number of analyses running),
+     * and returns the name of the single-lane one.
+     */
+    pthread_once(&kernels_once, choose_kernels);
+    return kernel_name;
+}
@@ -0,0 +1,35 @@
+#ifndef PASTML_KERNELS_H
+#define PASTML_KERNELS_H
+
+#include "pastml.h"
+
+/* Multiplies the parent likelihood by the child message:
+ * likelihood_i (*)= sum_j pij[i * n + j] * child_likelihood_j,
+ * assigning instead of multiplying if first is TRUE. */
+typedef void (*child_product_kernel)(const double *pij, const double *child_likelihood, double *likelihood,
+                                     size_t n, int first);
+
+extern child_product_kernel multiply_by_child;
+
+/* Same as child_product_kernel, for nb_lanes parameter vectors at once, the data being interleaved by lane
+ * (see LaneArena). */
+typedef void (*lane_product_kernel)(const double *pij, const double *child_likelihood, double *likelihood,
+                                    size_t n, size_t nb_lanes, int first);
+
+extern lane_product_kernel multiply_by_child_lanes;
+
+const char *init_kernels(void);
+
+void multiply_by_f81_child(double exp_mu_t, const double *frequencies, const double *child_likelihood,
+                           double *likelihood, size_t n, int first);
+void multiply_by_tip(const double *pij, size_t state, double *likelihood, size_t n, int first);
+void multiply_by_f81_tip(double exp_mu_t, const double *frequencies, size_t state, double *likelihood, size_t n,
+                         int first);
+void set_cherry_likelihood(const double *pij_1, size_t state_1, const double *pij_2, size_t state_2,
+                           double *likelihood, size_t n);
+void set_f81_cherry_likelihood(double exp_mu_t_1, size_t state_1, double exp_mu_t_2, size_t state_2,
+                               const double *frequencies, double *likelihood, size_t n);
+void multiply_by_f81_child_lanes(const double *exp_mu_t, const double *frequencies, const double *child_likelihood,
+                                 double *likelihood, size_t n, size_t nb_lanes, int first);
+
+#endif //PASTML_KERNELS_H
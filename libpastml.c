@@ -0,0 +1,412 @@
+#include <errno.h>
+#include "pastml.h"
+#include "libpastml.h"
+#include "runpastml.h"
+#include "make_tree.h"
+#include "models.h"
+#include "arena.h"
+#include "likelihood.h"
+#include "marginal_likelihood.h"
+#include "marginal_approximation.h"
+#include "joint_likelihood.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "logger.h"
+
+/* The steps of an analysis done so far, each one needing the previous ones */
+typedef enum __AnalysisStage {
+    STAGE_NEW,
+    STAGE_TIP_STATES,
+    STAGE_OPTIMISED
+} AnalysisStage;
+
+/* One character analysed on a tree (that it does not own), with its own context and working memory */
+struct __PastmlAnalysis {
+    Tree *s_tree;
+    AnalysisContext context;
+    size_t num_annotations;
+    char **character;           /* the state names, followed by a spot for the missing data one */
+    double *parameters;         /* the frequencies, the scaling factor and the epsilon */
+    Arena *arena;               /* allocated when the tip states are set */
+    AnalysisStage stage;
+    int marginal_done;
+    int joint_done;
+};
+
+static int is_tip(const Tree *s_tree, int id) {
+    /* a root with a single child is not a tip */
+    return s_tree->nodes[id]->nb_neigh == 1 && s_tree->nodes[id] != s_tree->root;
+}
+
+static const AnalysisContext *quiet_context(AnalysisContext *context) {
+    init_context(context);
+    context->log = NULL;
+    return context;
+}
+
+PastmlTree *pastml_new_tree_from_newick(const char *newick, size_t length) {
+    AnalysisContext context;
+    return complete_parse_nh(newick, length, quiet_context(&context));
+}
+
+PastmlTree *pastml_new_tree_from_parents(int nb_nodes, const int *parents, const double *branch_lengths,
+                                         const char *const *names) {
+    AnalysisContext context;
+    return make_tree_from_parents(nb_nodes, parents, branch_lengths, names, quiet_context(&context));
+}
+
+void pastml_free_tree(PastmlTree *tree) {
+    free_tree(tree);
+}
+
+int pastml_get_nb_nodes(const PastmlTree *tree) {
+    return tree->nb_nodes;
+}
+
+int pastml_get_nb_tips(const PastmlTree *tree) {
+    return (int) tree->nb_taxa;
+}
+
+const char *pastml_get_node_name(const PastmlTree *tree, int id) {
+    if (id < 0 || id >= tree->nb_nodes) {
+        return NULL;
+    }
+    return tree->nodes[id]->name;
+}
+
+void pastml_get_parents(const PastmlTree *tree, int *parents) {
+    memcpy(parents, tree->plan->parent, tree->nb_nodes * sizeof(int));
+}
+
+void pastml_get_branch_lengths(const PastmlTree *tree, double *branch_lengths) {
+    int id;
+    for (id = 0; id < tree->nb_nodes; id++) {
+        branch_lengths[id] = tree->nodes[id]->branch_len;
+    }
+}
+
+static void free_character(char **character, size_t num_annotations) {
+    size_t i;
+    if (character == NULL) return;
+    /* the missing data spot is a literal */
+    for (i = 0; i < num_annotations; i++) {
+        free(character[i]);
+    }
+    free(character);
+}
+
+PastmlAnalysis *pastml_new_analysis(PastmlTree *tree, const char *model, int nb_states,
+                                    const char *const *state_names, int threads, FILE *log) {
+    /**
+     * Sets up the analysis with its thread pool, and the likelihood kernels.
+     * The working memory is allocated once the tip states are known (see pastml_set_tip_states).
+     */
+    PastmlAnalysis *analysis;
+
+    analysis = calloc(1, sizeof(PastmlAnalysis));
+    if (analysis == NULL) {
+        fprintf(stderr, "Memory problems: %s\n", strerror(errno));
+        return NULL;
+    }
+    init_context(&analysis->context);
+    analysis->context.threads = MAX(threads, 1);
+    analysis->context.log = log;
+    analysis->s_tree = tree;
+    if (analysis->context.threads > 1) {
+        analysis->context.pool = new_thread_pool(analysis->context.threads);
+        if (analysis->context.pool == NULL) {
+            fprintf(stderr, "Memory problems: %s\n", strerror(ENOMEM));
+            free(analysis);
+            return NULL;
+        }
+    }
+    if (EXIT_SUCCESS != pastml_reset_analysis(analysis, model, nb_states, state_names)) {
+        pastml_free_analysis(analysis);
+        return NULL;
+    }
+    log_info(&analysis->context, "LIKELIHOOD KERNELS:\t%s\n\n", init_kernels());
+    log_info(&analysis->context, "THREADS:\t%d\n\n", analysis->context.threads);
+    return analysis;
+}
+
+int pastml_reset_analysis(PastmlAnalysis *analysis, const char *model, int nb_states,
+                          const char *const *state_names) {
+    /**
+     * Discards the character of the analysis (and its results) to analyse another one.
+     * The working memory is kept for the next tip states if the model and the number of states stay the same,
+     * it is only cleared then (see reset_arena).
+     */
+    Model new_model;
+    char **character;
+    double *parameters;
+    size_t i, num_annotations;
+    int exit_val = EXIT_SUCCESS;
+
+    if (EXIT_SUCCESS != parse_model(model, &new_model)) {
+        fprintf(stderr, "Unknown model: %s\n", model);
+        return EINVAL;
+    }
+    if (nb_states < 2 || (new_model == MODEL_HKY && nb_states != 4) || (new_model == MODEL_JTT && nb_states != 20)) {
+        fprintf(stderr, "The model %s does not allow for %d states.\n", model, nb_states);
+        return EINVAL;
+    }
+    num_annotations = (size_t) nb_states;
+    character = calloc(num_annotations + 1, sizeof(char *));
+    parameters = calloc(num_annotations + 2, sizeof(double));
+    if (character == NULL || parameters == NULL) {
+        exit_val = ENOMEM;
+    }
+    for (i = 0; i < num_annotations && EXIT_SUCCESS == exit_val; i++) {
+        if (state_names != NULL) {
+            character[i] = strdup(state_names[i]);
+        } else {
+            character[i] = malloc(GENERATED_NAME_LENGTH * sizeof(char));
+            if (character[i] != NULL) {
+                sprintf(character[i], "%zd", i);
+            }
+        }
+        if (character[i] == NULL) {
+            exit_val = ENOMEM;
+        }
+    }
+    if (EXIT_SUCCESS != exit_val) {
+        fprintf(stderr, "Memory problems: %s\n", strerror(exit_val));
+        free_character(character, num_annotations);
+        free(parameters);
+        return exit_val;
+    }
+
+    free_character(analysis->character, analysis->num_annotations);
+    free(analysis->parameters);
+    if (analysis->arena != NULL && (analysis->arena->model != new_model || analysis->num_annotations != num_annotations)) {
+        free_arena(analysis->arena);
+        analysis->arena = NULL;
+    }
+    analysis->character = character;
+    analysis->parameters = parameters;
+    analysis->num_annotations = num_annotations;
+    analysis->context.model = new_model;
+    analysis->stage = STAGE_NEW;
+    analysis->marginal_done = FALSE;
+    analysis->joint_done = FALSE;
+    if (new_model == MODEL_JTT) {
+        SetupJTTMatrix();
+    }
+    return EXIT_SUCCESS;
+}
+
+void pastml_free_analysis(PastmlAnalysis *analysis) {
+    if (analysis == NULL) return;
+    free_character(analysis->character, analysis->num_annotations);
+    free(analysis->parameters);
+    free_arena(analysis->arena);
+    free_thread_pool(analysis->context.pool);
+    free(analysis);
+}
+
+int pastml_set_tip_states(PastmlAnalysis *analysis, const int *states) {
+    /**
+     * Sets the tip probabilities in the (new or cleared) arena, and the initial frequencies:
+     * estimated from the tip states (the missing ones excluded) for F81, fixed by the other models.
+     */
+    Tree *s_tree = analysis->s_tree;
+    size_t num_annotations = analysis->num_annotations;
+    int *tip_states;
+    size_t num_tips = 0;
+    int id, exit_val = EXIT_SUCCESS;
+
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        if (is_tip(s_tree, id) && (states[id] < -1 || states[id] >= (int) num_annotations)) {
+            fprintf(stderr, "Tip %s has an invalid state %d.\n", s_tree->nodes[id]->name, states[id]);
+            return EINVAL;
+        }
+    }
+
+    analysis->stage = STAGE_NEW;
+    analysis->marginal_done = FALSE;
+    analysis->joint_done = FALSE;
+    if (analysis->arena != NULL) {
+        reset_arena(analysis->arena);
+    } else {
+        analysis->arena = allocate_arena((size_t) s_tree->nb_nodes, num_annotations, &analysis->context);
+    }
+    tip_states = malloc(s_tree->nb_taxa * sizeof(int));
+    if (analysis->arena == NULL || tip_states == NULL) {
+        free(tip_states);
+        return ENOMEM;
+    }
+
+    /* the tip states in id order, calculate_frequencies turning the missing ones into num_annotations */
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        if (is_tip(s_tree, id)) {
+            tip_states[num_tips++] = states[id];
+        }
+    }
+    if ((analysis->context.model == MODEL_JC) || (analysis->context.model == MODEL_F81)) {
+        exit_val = calculate_frequencies(num_annotations, num_tips, tip_states, analysis->character,
+                                         analysis->parameters, &analysis->context);
+    } else {
+        set_model_frequencies(analysis->context.model, analysis->parameters);
+        analysis->character[num_annotations] = "?";
+        for (num_tips = 0; num_tips < s_tree->nb_taxa; num_tips++) {
+            if (tip_states[num_tips] == -1) {
+                tip_states[num_tips] = (int) num_annotations;
+            }
+        }
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        num_tips = 0;
+        for (id = 0; id < s_tree->nb_nodes; id++) {
+            if (is_tip(s_tree, id)) {
+                set_tip_probabilities(analysis->arena, id, (size_t) tip_states[num_tips++], num_annotations);
+            }
+        }
+        analysis->stage = STAGE_TIP_STATES;
+    }
+    free(tip_states);
+    return exit_val;
+}
+
+int pastml_optimise(PastmlAnalysis *analysis, double *log_likelihood) {
+    int exit_val;
+    if (analysis->stage != STAGE_TIP_STATES) {
+        fprintf(stderr, "The tip states must be set (once) before optimising the parameters.\n");
+        return EINVAL;
+    }
+    exit_val = optimise_parameters(analysis->s_tree, analysis->arena, analysis->num_annotations,
+                                   analysis->parameters, analysis->character, log_likelihood, &analysis->context);
+    if (EXIT_SUCCESS == exit_val) {
+        analysis->stage = STAGE_OPTIMISED;
+    }
+    return exit_val;
+}
+
+static int check_stage(const PastmlAnalysis *analysis, int done, const char *what) {
+    if (analysis->stage != STAGE_OPTIMISED) {
+        fprintf(stderr, "The parameters must be optimised before getting the %s.\n", what);
+        return EINVAL;
+    }
+    if (!done) {
+        fprintf(stderr, "The %s must be reconstructed first.\n", what);
+        return EINVAL;
+    }
+    return EXIT_SUCCESS;
+}
+
+int pastml_reconstruct_marginal(PastmlAnalysis *analysis) {
+    /**
+     * Calculates the marginal probabilities, kept in sim_marginal_prob,
+     * and chooses the most likely states from them (which reorders the ones in marginal, see choose_likely_states).
+     */
+    int exit_val = check_stage(analysis, TRUE, "marginal probabilities");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    log_info(&analysis->context, "CALCULATING MARGINAL PROBABILITIES...\n\n");
+    exit_val = calculate_marginal_probabilities(analysis->s_tree, analysis->arena, analysis->num_annotations,
+                                                analysis->parameters);
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    memcpy(analysis->arena->sim_marginal_prob, analysis->arena->marginal,
+           analysis->arena->nb_nodes * analysis->arena->stride * sizeof(double));
+    log_info(&analysis->context, "PREDICTING MOST LIKELY ANCESTRAL STATES...\n\n");
+    choose_likely_states(analysis->s_tree, analysis->arena, analysis->num_annotations);
+    analysis->marginal_done = TRUE;
+    return EXIT_SUCCESS;
+}
+
+int pastml_reconstruct_joint(PastmlAnalysis *analysis) {
+    int exit_val = check_stage(analysis, TRUE, "joint states");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    log_info(&analysis->context, "CALCULATING JOINT PROBABILITIES...\n\n");
+    calculate_joint_probabilities(analysis->s_tree, analysis->arena, analysis->num_annotations,
+                                  analysis->parameters, &analysis->context);
+    analysis->joint_done = TRUE;
+    return EXIT_SUCCESS;
+}
+
+int pastml_get_parameters(const PastmlAnalysis *analysis, double *frequencies, double *scaling_factor,
+                          double *epsilon) {
+    int exit_val = check_stage(analysis, TRUE, "parameters");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    if (frequencies != NULL) {
+        memcpy(frequencies, analysis->parameters, analysis->num_annotations * sizeof(double));
+    }
+    if (scaling_factor != NULL) {
+        *scaling_factor = analysis->parameters[analysis->num_annotations];
+    }
+    if (epsilon != NULL) {
+        *epsilon = analysis->parameters[analysis->num_annotations + 1];
+    }
+    return EXIT_SUCCESS;
+}
+
+int pastml_get_rescaled_branch_lengths(const PastmlAnalysis *analysis, double *branch_lengths) {
+    int exit_val = check_stage(analysis, TRUE, "rescaled branch lengths");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    memcpy(branch_lengths, analysis->arena->branch_len, analysis->arena->nb_nodes * sizeof(double));
+    return EXIT_SUCCESS;
+}
+
+int pastml_get_marginal_probabilities(const PastmlAnalysis *analysis, double *probabilities) {
+    size_t k, n = analysis->num_annotations;
+    int exit_val = check_stage(analysis, analysis->marginal_done, "marginal probabilities");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    for (k = 0; k < analysis->arena->nb_nodes; k++) {
+        memcpy(probabilities + k * n, NODE_VECTOR(analysis->arena, sim_marginal_prob, k), n * sizeof(double));
+    }
+    return EXIT_SUCCESS;
+}
+
+int pastml_get_predicted_states(const PastmlAnalysis *analysis, double *probabilities, int *nb_predicted) {
+    /**
+     * The probabilities chosen by choose_likely_states are in decreasing order,
+     * the states they correspond to being given by best_states.
+     */
+    size_t j, k, n = analysis->num_annotations;
+    const double *marginal;
+    const size_t *best_states;
+    int exit_val = check_stage(analysis, analysis->marginal_done, "marginal probabilities");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    for (k = 0; k < analysis->arena->nb_nodes; k++) {
+        marginal = NODE_VECTOR(analysis->arena, marginal, k);
+        best_states = NODE_VECTOR(analysis->arena, best_states, k);
+        for (j = 0; j < n; j++) {
+            probabilities[k * n + best_states[j]] = marginal[j];
+        }
+        if (nb_predicted != NULL) {
+            nb_predicted[k] = (int) analysis->arena->ma_state[k];
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int pastml_get_joint_states(const PastmlAnalysis *analysis, int *states) {
+    /**
+     * The tips keep their observed states, -1 for the missing ones.
+     */
+    int id;
+    int exit_val = check_stage(analysis, analysis->joint_done, "joint states");
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    for (id = 0; id < analysis->s_tree->nb_nodes; id++) {
+        if (is_tip(analysis->s_tree, id) && analysis->arena->tip_state[id] == analysis->num_annotations) {
+            states[id] = -1;
+        } else {
+            states[id] = (int) analysis->arena->best_joint_state[id];
+        }
+    }
+    return EXIT_SUCCESS;
+}
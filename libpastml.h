@@ -0,0 +1,85 @@
+#ifndef PASTML_LIBPASTML_H
+#define PASTML_LIBPASTML_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* The C API of the PASTML library (libpastml.a, libpastml.so): builds trees from memory, sets the tip states
+ * of a character from arrays, optimises the model parameters, reconstructs the ancestral states,
+ * and copies the results into buffers given by the caller. Nothing is read from or written to files.
+ *
+ * The nodes of a tree are numbered 0, .., nb_nodes - 1, the root being 0: the per-node inputs and outputs are
+ * arrays indexed by node id, and the per-node per-state ones are nb_nodes rows of nb_states values.
+ * The functions returning an int return 0 (EXIT_SUCCESS) on success, or an error code (e.g. EINVAL, ENOMEM)
+ * after printing the reason to the standard error. */
+
+typedef struct __Tree PastmlTree;
+typedef struct __PastmlAnalysis PastmlAnalysis;
+
+/* Parses the first tree of a newick string, which does not need to be null-terminated. NULL if it is not valid. */
+PastmlTree *pastml_new_tree_from_newick(const char *newick, size_t length);
+
+/* Builds a tree from the parent of each node (-1 for the root, which must be the node 0) and the lengths
+ * of the branches above the nodes. The names can be NULL (some or all of them), the unnamed inner nodes
+ * are then named as when parsing newick. The children of each node are ordered by id.
+ * NULL if the parents do not make a tree. */
+PastmlTree *pastml_new_tree_from_parents(int nb_nodes, const int *parents, const double *branch_lengths,
+                                         const char *const *names);
+
+void pastml_free_tree(PastmlTree *tree);
+
+int pastml_get_nb_nodes(const PastmlTree *tree);
+int pastml_get_nb_tips(const PastmlTree *tree);
+/* The name of a node (the root is called ROOT), owned by the tree. */
+const char *pastml_get_node_name(const PastmlTree *tree, int id);
+void pastml_get_parents(const PastmlTree *tree, int *parents);
+/* The branch lengths as given, not rescaled (see pastml_get_rescaled_branch_lengths). */
+void pastml_get_branch_lengths(const PastmlTree *tree, double *branch_lengths);
+
+/* Sets up the analysis of a character with nb_states states on a tree, which must outlive the analysis.
+ * The model is JC, F81, HKY (4 states, in the order T, C, A, G) or JTT (20 states, in the order
+ * A, R, N, D, C, Q, E, G, H, I, L, K, M, F, P, S, T, W, Y, V). The state names can be NULL,
+ * the states are then named by their indices. The analysis uses up to threads threads,
+ * and prints its progress to log, unless it is NULL.
+ * The analyses only read their tree, so that one tree can be analysed in several threads at once,
+ * each with its own analysis. */
+PastmlAnalysis *pastml_new_analysis(PastmlTree *tree, const char *model, int nb_states,
+                                    const char *const *state_names, int threads, FILE *log);
+
+/* Sets up the analysis for another character (with the same or another model), on the same tree
+ * and with the same threads. Its working memory is reused if the model and the number of states do not change. */
+int pastml_reset_analysis(PastmlAnalysis *analysis, const char *model, int nb_states,
+                          const char *const *state_names);
+
+void pastml_free_analysis(PastmlAnalysis *analysis);
+
+/* Sets the observed states of the tips, indexed by node id (the values of the inner nodes are ignored),
+ * -1 standing for a missing state. The frequencies are estimated from them for JC and F81.
+ * Any previous results of the analysis are discarded, its working memory being reused. */
+int pastml_set_tip_states(PastmlAnalysis *analysis, const int *states);
+
+/* Optimises the model parameters for the tip states, and sets the optimised log likelihood. */
+int pastml_optimise(PastmlAnalysis *analysis, double *log_likelihood);
+
+/* Reconstructs the ancestral states with the optimised parameters: from the marginal probabilities
+ * (see pastml_get_marginal_probabilities and pastml_get_predicted_states), or the joint most likely ones
+ * (see pastml_get_joint_states). */
+int pastml_reconstruct_marginal(PastmlAnalysis *analysis);
+int pastml_reconstruct_joint(PastmlAnalysis *analysis);
+
+/* The optimised parameters: the state frequencies (nb_states values), the scaling factor and the epsilon
+ * of the branch lengths. Any of the buffers can be NULL. */
+int pastml_get_parameters(const PastmlAnalysis *analysis, double *frequencies, double *scaling_factor,
+                          double *epsilon);
+/* The branch lengths rescaled with the optimised parameters. */
+int pastml_get_rescaled_branch_lengths(const PastmlAnalysis *analysis, double *branch_lengths);
+/* The marginal probabilities of the states of each node. */
+int pastml_get_marginal_probabilities(const PastmlAnalysis *analysis, double *probabilities);
+/* The states predicted for each node from its marginal probabilities: the chosen ones have equal probabilities,
+ * and the others 0 (as in the output of the command line tool), and nb_predicted (which can be NULL)
+ * is set to their number per node. */
+int pastml_get_predicted_states(const PastmlAnalysis *analysis, double *probabilities, int *nb_predicted);
+/* The joint most likely state of each node. */
+int pastml_get_joint_states(const PastmlAnalysis *analysis, int *states);
+
+#endif //PASTML_LIBPASTML_H
@@ -1,20 +1,14 @@
+#include <stdint.h>
+#include <sched.h>
 #include "pastml.h"
 #include "scaling.h"
 #include "logger.h"
+#include "models.h"
+#include "traversal.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "name_index.h"
 
-extern char *global_model;
-
-void *CAllocMem(long n, char *name, char *func, int showInfo)
-{
-	void *P;
-	
-	if ( (P=calloc(n, 1))==NULL ) {
-		fprintf(stderr, "Out of memory allocating '%s': %s()\n", name, func);
-		exit(0);
-	}
-	
-	return P;
-}
 
 int get_max(const int *array, size_t n) {
     /**
@@ -91,7 +85,7 @@ double get_rescaled_branch_len(const Node *nd, double avg_br_len, double scaling
     return bl * scaling_factor;
 }
 
-void set_p_ij(const Node *nd, double avg_br_len, size_t num_frequencies, const double *parameters) {
+void set_p_ij(Arena *arena, const Node *nd, double avg_br_len, size_t num_frequencies, const double *parameters) {
     /**
      * Sets node probabilities of substitution: p[i][j]:
      *
@@ -101,66 +95,152 @@ void set_p_ij(const Node *nd, double avg_br_len, size_t num_frequencies, const d
      *
      * parameters = [frequency_1, .., frequency_n, scaling_factor, epsilon]
      */
-    int i, j;
-
     double scaling_factor = parameters[num_frequencies];
     double epsilon = parameters[num_frequencies + 1];
     double t = get_rescaled_branch_len(nd, avg_br_len, scaling_factor, epsilon);
     // TODO: do we need to recalculate mu each time
     // or we fix it in the beginning and play with the scaling factor instead?
     double mu = get_mu(parameters, num_frequencies);
-    double *P, *matrix[1];
+    double *pij = NODE_PIJ(arena, nd->id);
 
-    if ((strcmp(global_model, "JC") == 0) || (strcmp(global_model, "F81") == 0)) {
-      for (i = 0; i < num_frequencies; i++) {
-        for (j = 0; j < num_frequencies; j++) {
-            nd->pij[i][j] = get_pij(parameters, mu, t, i, j);
-        }
-      }
+    if (arena->f81) {
+      /* the whole matrix follows from exp(-mu t), see get_pij */
+      arena->branch_exp[nd->id] = exp(-mu * t);
+      return;
     }
    
-    if (strcmp(global_model, "HKY") == 0) {
-      get_pij_hky(nd, num_frequencies, parameters, t);
-    }
-
-    if (strcmp(global_model, "JTT") == 0) {
-      matrix[0] = CAllocMem(num_frequencies*num_frequencies*sizeof(double), "matrix", "CreateRates", 0);
-      SetJTTMatrix(matrix[0], t);
-      P=matrix[0];
-      for(i=0;i<num_frequencies;i++){
-        for(j=0;j<num_frequencies;j++){
-          nd->pij[i][j] = (*P);
-          P++;
+    if (arena->model == MODEL_HKY) {
+      get_pij_hky(pij, num_frequencies, parameters, t);
+    }
+
+    if (arena->model == MODEL_JTT) {
+      get_pij_jtt(pij, t);
+    }
+}
+
+static void share_p_ij(Arena *arena, const Tree *s_tree, size_t num_frequencies, const double *parameters,
+                       int missing_data) {
+    /**
+     * Chooses which matrix of probabilities of substitution each branch uses, for the branches above the nodes outside
+     * of (or, if missing_data is TRUE, inside of) the subtrees with missing data only (see mark_missing_data):
+     * the branches of the same rescaled length (e.g. zero-length ones, or rounded ones) share the matrix
+     * of the first branch that had it, found via a hash table keyed by the length (see BRANCH_PIJ).
+     * Only the lengths are hashed here, the matrices are calculated by set_branch_p_ij when they are first needed,
+     * i.e. in the (parallel) post-order passes.
+     */
+    double scaling_factor = parameters[num_frequencies];
+    double epsilon = parameters[num_frequencies + 1];
+    size_t mask = arena->pij_cache_size - 1, slot, i;
+    uint64_t bits;
+    double t;
+    Node *nd;
+
+    for (slot = 0; slot < arena->pij_cache_size; slot++) {
+        arena->pij_cache_id[slot] = -1;
+    }
+    for (i = 0; i < s_tree->nb_nodes; i++) {
+        nd = s_tree->nodes[i];
+        if (nd == s_tree->root || (arena->tip_state[nd->id] == num_frequencies) != missing_data) {
+            continue;
+        }
+        t = get_rescaled_branch_len(nd, s_tree->avg_tip_branch_len, scaling_factor, epsilon);
+        memcpy(&bits, &t, sizeof(double));
+        slot = (size_t) ((bits * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+        while (arena->pij_cache_id[slot] != -1 && arena->pij_cache_len[slot] != t) {
+            slot = (slot + 1) & mask;
+        }
+        if (arena->pij_cache_id[slot] != -1) {
+            arena->pij_owner[nd->id] = arena->pij_cache_id[slot];
+            arena->pij_reused++;
+        } else {
+            arena->pij_cache_len[slot] = t;
+            arena->pij_cache_id[slot] = nd->id;
+            arena->pij_owner[nd->id] = nd->id;
+            arena->pij_status[nd->id] = PIJ_PENDING;
+            arena->pij_computed++;
         }
-      }
     }
 }
 
-int calculate_node_probabilities(const Node *nd, size_t num_annotations, size_t first_child_index) {
+static void set_branch_p_ij(Arena *arena, const Tree *s_tree, int id, size_t num_frequencies,
+                            const double *parameters) {
+    /**
+     * Makes sure that the matrix used by the branch above the node (see share_p_ij) is calculated.
+     * The branches sharing it can be processed by several threads at once: the first one calculates it,
+     * and the others wait for it to be ready, which takes as long as one matrix calculation at most.
+     */
+    int owner = arena->pij_owner[id];
+    int status = PIJ_PENDING;
+
+    if (__atomic_compare_exchange_n(&arena->pij_status[owner], &status, PIJ_COMPUTING, FALSE,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        set_p_ij(arena, s_tree->nodes[owner], s_tree->avg_tip_branch_len, num_frequencies, parameters);
+        __atomic_store_n(&arena->pij_status[owner], PIJ_READY, __ATOMIC_RELEASE);
+        return;
+    }
+    while (__atomic_load_n(&arena->pij_status[owner], __ATOMIC_ACQUIRE) != PIJ_READY) {
+        sched_yield();
+    }
+}
+
+int calculate_node_probabilities(Arena *arena, const TraversalPlan *plan, int id, size_t num_annotations,
+                                 const double *frequencies) {
+    /**
+     * Calculates the likelihoods of an inner node from those of its children.
+     * The observed tips are multiplied in by the tip kernels (a column of pij instead of a matrix-vector product),
+     * and the cherries (two observed tips) are set in one go.
+     * The tips with missing data are skipped, as their message is sum_j(p_ij) = 1.
+     */
     int factors = 0;
-    size_t i, j, k;
-    for (k = first_child_index; k < nd->nb_neigh; k++) {
-        Node *child = nd->neigh[k];
-        for (i = 0; i < num_annotations; i++) {
-            /* Calculate the probability of having a branch from the node to its child node,
-             * given that the node is in state i: p_child_branch_from_i = sum_j(p_ij * p_child_j)
-             */
-            double p_child_branch_from_i = 0.;
-            for (j = 0; j < num_annotations; j++) {
-                p_child_branch_from_i += child->pij[i][j] * child->bottom_up_likelihood[j];
-            }
+    int k, first = TRUE;
+    size_t state;
+    int first_child = plan->children[plan->child_offset[id]];
+    int last_child = plan->children[plan->child_offset[id + 1] - 1];
+    double *bottom_up_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, id);
 
-            /* The probability of having the node in state i is a multiplication of
-             * the probabilities of p_child_branch_from_i for all child branches:
-             * condlike_i = mult_ii(p_child_ii_branch_from_i)
-             */
-            if (k == first_child_index) {
-                nd->bottom_up_likelihood[i] = p_child_branch_from_i;
+    if (plan->child_offset[id + 1] - plan->child_offset[id] == 2
+        && arena->tip_state[first_child] < num_annotations && arena->tip_state[last_child] < num_annotations) {
+        if (arena->f81) {
+            set_f81_cherry_likelihood(arena->branch_exp[first_child], arena->tip_state[first_child],
+                                      arena->branch_exp[last_child], arena->tip_state[last_child],
+                                      frequencies, bottom_up_likelihood, num_annotations);
+        } else {
+            set_cherry_likelihood(BRANCH_PIJ(arena, first_child), arena->tip_state[first_child],
+                                  BRANCH_PIJ(arena, last_child), arena->tip_state[last_child],
+                                  bottom_up_likelihood, num_annotations);
+        }
+        return upscale_node_probs(bottom_up_likelihood, num_annotations);
+    }
+
+    for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+        int child_id = plan->children[k];
+        state = arena->tip_state[child_id];
+        if (state == num_annotations) {
+            continue;
+        }
+        /* Calculate the probability of having a branch from the node to its child node,
+         * given that the node is in state i: p_child_branch_from_i = sum_j(p_ij * p_child_j).
+         * The probability of having the node in state i is a multiplication of
+         * the probabilities of p_child_branch_from_i for all child branches:
+         * condlike_i = mult_ii(p_child_ii_branch_from_i)
+         */
+        if (state != NO_TIP_STATE) {
+            if (arena->f81) {
+                multiply_by_f81_tip(arena->branch_exp[child_id], frequencies, state, bottom_up_likelihood,
+                                    num_annotations, first);
             } else {
-                nd->bottom_up_likelihood[i] *= p_child_branch_from_i;
+                multiply_by_tip(BRANCH_PIJ(arena, child_id), state, bottom_up_likelihood, num_annotations, first);
             }
+        } else if (arena->f81) {
+            multiply_by_f81_child(arena->branch_exp[child_id], frequencies,
+                                  NODE_VECTOR(arena, bottom_up_likelihood, child_id),
+                                  bottom_up_likelihood, num_annotations, first);
+        } else {
+            multiply_by_child(BRANCH_PIJ(arena, child_id), NODE_VECTOR(arena, bottom_up_likelihood, child_id),
+                              bottom_up_likelihood, num_annotations, first);
         }
-        int add_factors = upscale_node_probs(nd->bottom_up_likelihood, num_annotations);
+        first = FALSE;
+        int add_factors = upscale_node_probs(bottom_up_likelihood, num_annotations);
 
         /* if all the probabilities are zero (shown by add_factors == -1),
          * there is no point to go any further
@@ -170,47 +250,70 @@ int calculate_node_probabilities(const Node *nd, size_t num_annotations, size_t
         }
         factors += add_factors;
     }
+    /* all the children are tips with missing data */
+    if (first) {
+        for (state = 0; state < num_annotations; state++) {
+            bottom_up_likelihood[state] = 1.0;
+        }
+    }
     return factors;
 }
 
-int process_node(Node *nd, Tree *s_tree, size_t num_annotations, double *parameters) {
+typedef struct __BottomUpData {
+    Arena *arena;
+    Tree *s_tree;
+    size_t num_annotations;
+    double *parameters;
+} BottomUpData;
+
+int process_node(int id, void *data) {
     /**
-     * Calculates node probabilities.
-     * parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon].
+     * Sets the probabilities of substitution on the branch above the node (F81 and JC),
+     * and, if the node is not a tip, calculates its probabilities (its children are already processed).
+     * Returns the scaling factors of the node, or -1 if all its probabilities are zero.
      */
-    int factors = 0, add_factors;
-    size_t i, first_child_index;
+    BottomUpData *bottom_up = (BottomUpData *) data;
+    const TraversalPlan *plan = bottom_up->s_tree->plan;
+    Node *nd = bottom_up->s_tree->nodes[id];
 
-    /* set probabilities of substitution */
-    if (nd != s_tree->root) {
-      set_p_ij(nd, s_tree->avg_tip_branch_len, num_annotations, parameters);
+    /* the subtrees with missing data only contribute 1 whatever the parameters, see mark_missing_data */
+    if (bottom_up->arena->tip_state[id] == bottom_up->num_annotations) {
+        return 0;
     }
 
-    /* not a tip */
-    if (nd->nb_neigh != 1) {
-        first_child_index = (nd == s_tree->root) ? 0 : 1;
-        /* recursively calculate probabilities for children */
-        for (i = first_child_index; i < nd->nb_neigh; i++) {
-	  add_factors = process_node(nd->neigh[i], s_tree, num_annotations, parameters);
-            /* if all the probabilities are zero (shown by add_factors == -1),
-             * there is no point to go any further
-             */
-            if (add_factors == -1) {
-                return -1;
-            }
-            factors += add_factors;
-        }
-        /* calculate own probabilities */
-        add_factors = calculate_node_probabilities(nd, num_annotations, first_child_index);
-        /* if all the probabilities are zero (shown by add_factors == -1),
-         * there is no point to go any further
-         */
-        if (add_factors == -1) {
-            return -1;
+    /* set probabilities of substitution (the matrices of the other models can be shared, see share_p_ij) */
+    if (nd != bottom_up->s_tree->root) {
+        if (bottom_up->arena->f81) {
+            set_p_ij(bottom_up->arena, nd, bottom_up->s_tree->avg_tip_branch_len, bottom_up->num_annotations,
+                     bottom_up->parameters);
+        } else {
+            set_branch_p_ij(bottom_up->arena, bottom_up->s_tree, id, bottom_up->num_annotations,
+                            bottom_up->parameters);
         }
-        factors += add_factors;
     }
-    return factors;
+
+    /* not a tip */
+    if (plan->child_offset[id] != plan->child_offset[id + 1]) {
+        return calculate_node_probabilities(bottom_up->arena, plan, id, bottom_up->num_annotations,
+                                            bottom_up->parameters);
+    }
+    return 0;
+}
+
+int process_nodes(Arena *arena, Tree *s_tree, size_t num_annotations, double *parameters) {
+    /**
+     * Calculates node probabilities, visiting the nodes in post-order, so that children come before their parents
+     * (independent subtrees are processed in parallel by the thread pool of the arena, if any).
+     * parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon].
+     */
+    BottomUpData data = {arena, s_tree, num_annotations, parameters};
+    if (!arena->f81) {
+        share_p_ij(arena, s_tree, num_annotations, parameters, FALSE);
+    }
+    /* if all the probabilities of a node are zero (shown by -1),
+     * there is no point to go any further
+     */
+    return process_post_order(arena->pool, s_tree->plan, process_node, &data);
 }
 
 
@@ -231,74 +334,412 @@ double remove_upscaling_factors(double log_likelihood, int factors) {
     return log_likelihood;
 }
 
-double calculate_bottom_up_likelihood(Tree *s_tree, size_t num_annotations, double *parameters) {
+double calculate_bottom_up_likelihood(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters) {
     /**
      * Calculates tree log likelihood.
      * parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon].
      */
     double scaled_lk = 0;
     size_t i;
+    double *root_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, s_tree->root->id);
 
-    int factors = process_node(s_tree->root, s_tree, num_annotations, parameters);
+    int factors = process_nodes(arena, s_tree, num_annotations, parameters);
 
     /* if factors == -1, it means that the bottom_up_likelihood is 0 */
     if (factors != -1) {
         for (i = 0; i < num_annotations; i++) {
             /* multiply the probability by character frequency */
-            s_tree->root->bottom_up_likelihood[i] = s_tree->root->bottom_up_likelihood[i] * parameters[i];
-            scaled_lk += s_tree->root->bottom_up_likelihood[i];
+            root_likelihood[i] = root_likelihood[i] * parameters[i];
+            scaled_lk += root_likelihood[i];
         }
     }
     return remove_upscaling_factors(log(scaled_lk), factors);
 }
 
 
+void set_lane_p_ij(LaneArena *lanes, const Node *nd, double avg_br_len, size_t num_frequencies,
+                   double *const *parameters) {
+    /**
+     * Sets node probabilities of substitution for each lane, as set_p_ij does for one parameter vector,
+     * interleaving them by lane.
+     */
+    size_t i, l, nb_lanes = lanes->nb_lanes;
+    double pij[lanes->f81 ? 1 : num_frequencies * num_frequencies];
+
+    for (l = 0; l < nb_lanes; l++) {
+        double t = get_rescaled_branch_len(nd, avg_br_len, parameters[l][num_frequencies],
+                                           parameters[l][num_frequencies + 1]);
+        if (lanes->f81) {
+            NODE_LANE_EXP(lanes, nd->id)[l] = exp(-get_mu(parameters[l], num_frequencies) * t);
+            continue;
+        }
+        if (lanes->model == MODEL_HKY) {
+            get_pij_hky(pij, num_frequencies, parameters[l], t);
+        }
+        if (lanes->model == MODEL_JTT) {
+            get_pij_jtt(pij, t);
+        }
+        for (i = 0; i < num_frequencies * num_frequencies; i++) {
+            NODE_LANE_PIJ(lanes, nd->id)[i * nb_lanes + l] = pij[i];
+        }
+    }
+}
+
+void calculate_bottom_up_likelihoods(Tree *s_tree, const Arena *arena, LaneArena *lanes, size_t num_annotations,
+                                     double *const *parameters, double *log_likelihoods) {
+    /**
+     * Calculates tree log likelihoods for lanes->nb_lanes parameter vectors in one post-order traversal,
+     * filling one lane of the likelihood vectors per parameter vector (see LaneArena),
+     * so that the traversal and memory accesses are shared and the products vectorise across the lanes.
+     * parameters[lane] = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon].
+     * The tip likelihoods are taken from the (initialised) arena.
+     */
+    const TraversalPlan *plan = s_tree->plan;
+    size_t i, l, nb_lanes = lanes->nb_lanes;
+    int k, n, id, child_id;
+    int factors[nb_lanes];
+    double frequencies[num_annotations * nb_lanes];
+    double *likelihood;
+    const double *tip_likelihood;
+    Node *nd;
+
+    for (l = 0; l < nb_lanes; l++) {
+        factors[l] = 0;
+        for (i = 0; i < num_annotations; i++) {
+            frequencies[i * nb_lanes + l] = parameters[l][i];
+        }
+    }
+
+    for (n = 0; n < plan->nb_nodes; n++) {
+        id = plan->post_order[n];
+        nd = s_tree->nodes[id];
+        likelihood = NODE_LANE_VECTOR(lanes, id);
+
+        /* set probabilities of substitution */
+        if (nd != s_tree->root) {
+            set_lane_p_ij(lanes, nd, s_tree->avg_tip_branch_len, num_annotations, parameters);
+        }
+
+        /* a tip: the same likelihoods in all the lanes */
+        if (plan->child_offset[id] == plan->child_offset[id + 1]) {
+            tip_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, id);
+            for (i = 0; i < num_annotations; i++) {
+                for (l = 0; l < nb_lanes; l++) {
+                    likelihood[i * nb_lanes + l] = tip_likelihood[i];
+                }
+            }
+            continue;
+        }
+
+        for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+            child_id = plan->children[k];
+            if (lanes->f81) {
+                multiply_by_f81_child_lanes(NODE_LANE_EXP(lanes, child_id), frequencies,
+                                            NODE_LANE_VECTOR(lanes, child_id), likelihood, num_annotations,
+                                            nb_lanes, k == plan->child_offset[id]);
+            } else {
+                multiply_by_child_lanes(NODE_LANE_PIJ(lanes, child_id), NODE_LANE_VECTOR(lanes, child_id),
+                                        likelihood, num_annotations, nb_lanes, k == plan->child_offset[id]);
+            }
+            upscale_lane_probs(likelihood, num_annotations, nb_lanes, factors);
+        }
+    }
+
+    likelihood = NODE_LANE_VECTOR(lanes, s_tree->root->id);
+    for (l = 0; l < nb_lanes; l++) {
+        double scaled_lk = 0.0;
+        /* if factors == -1, it means that the bottom_up_likelihood is 0 */
+        if (factors[l] != -1) {
+            for (i = 0; i < num_annotations; i++) {
+                /* multiply the probability by character frequency */
+                scaled_lk += likelihood[i * nb_lanes + l] * parameters[l][i];
+            }
+        }
+        log_likelihoods[l] = remove_upscaling_factors(log(scaled_lk), factors[l]);
+    }
+}
+
+void calculate_log_likelihood_gradient(Tree *s_tree, Arena *arena, size_t num_annotations, const double *parameters,
+                                       double *gradient) {
+    /**
+     * Calculates the derivatives of the F81 (and JC) tree log likelihood
+     * with respect to each of the parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon]
+     * (the frequencies are differentiated as independent values, including their effect on mu),
+     * and puts them into the gradient array.
+     * The bottom-up likelihoods must be already calculated for these parameters.
+     *
+     * For a branch v (from node u to its child v) the likelihood is
+     * L = \sum_i O_v(i) \sum_j P_v(i->j) L_down(v=j),
+     * where O_v(i) is the likelihood of everything outside of the subtree of v given u in state i:
+     * O_v(i) = L_up(u=i) \prod_{siblings w of v}( \sum_j P_w(i->j) L_down(w=j) ).
+     * As P_v(i->j) = \pi_j (1 - exp(-mu t_v)) + \delta_ij exp(-mu t_v),
+     * dL/d(exp(-mu t_v)) = \sum_i O_v(i) (L_down(v=i) - \sum_j \pi_j L_down(v=j)),
+     * dL/d\pi_k (with exp(-mu t_v) fixed) = (1 - exp(-mu t_v)) L_down(v=k) \sum_i O_v(i),
+     * and the derivatives of the log likelihood are the sums of these over the branches
+     * (plus the root term L_down(root=k) / L for \pi_k), each divided by L.
+     * All the O_v are obtained in one top-down pass, and L is recalculated from the same (scaled) vectors
+     * for each branch, so that the scaling factors cancel out.
+     * The product over the siblings of v is combined from the product of the messages before it (prefix)
+     * and after it (suffix), as in calculate_top_down_likelihoods, so that a polytomy of d children
+     * takes O(d) vector products instead of O(d^2). The suffixes are kept in the up-likelihoods of the children,
+     * each one being overwritten by the child's own up-likelihood once its suffix is used.
+     */
+    const TraversalPlan *plan = s_tree->plan;
+    double scaling_factor = parameters[num_annotations];
+    double epsilon = parameters[num_annotations + 1];
+    double avg_tip_len = s_tree->avg_tip_branch_len;
+    double mu = get_mu(parameters, num_annotations);
+    double outside[num_annotations], prefix[num_annotations];
+    double d_t = 0.0, d_epsilon = 0.0, root_lk = 0.0;
+    double exp_mu_t, t, child_sum, outside_sum, outside_child, d_exp, branch_lk;
+    const double *child_likelihood;
+    double *up_likelihood, *suffix, *next_suffix;
+    size_t i;
+    int k, n, id, child_id, next_id = 0;
+    Node *nd;
+
+    for (i = 0; i < num_annotations + 2; i++) {
+        gradient[i] = 0.0;
+    }
+
+    /* the root: L = \sum_i \pi_i L_down(root=i), its bottom-up likelihood is already multiplied by \pi_i */
+    id = s_tree->root->id;
+    child_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, id);
+    up_likelihood = NODE_VECTOR(arena, top_down_likelihood, id);
+    for (i = 0; i < num_annotations; i++) {
+        root_lk += child_likelihood[i];
+        up_likelihood[i] = parameters[i];
+    }
+    for (i = 0; i < num_annotations; i++) {
+        if (parameters[i] > 0.0 && root_lk > 0.0) {
+            gradient[i] += child_likelihood[i] / parameters[i] / root_lk;
+        }
+    }
+
+    for (n = 0; n < plan->nb_nodes; n++) {
+        id = plan->pre_order[n];
+        if (plan->child_offset[id] == plan->child_offset[id + 1]) {
+            continue;
+        }
+        up_likelihood = NODE_VECTOR(arena, top_down_likelihood, id);
+
+        /* the suffixes, from the last child to the first one, upscaled if needed
+         * (the subtrees with missing data only do not depend on the parameters, their message is 1,
+         * see mark_missing_data) */
+        next_suffix = NULL;
+        for (k = plan->child_offset[id + 1] - 1; k >= plan->child_offset[id]; k--) {
+            child_id = plan->children[k];
+            if (arena->tip_state[child_id] == num_annotations) {
+                continue;
+            }
+            suffix = NODE_VECTOR(arena, top_down_likelihood, child_id);
+            if (next_suffix == NULL) {
+                for (i = 0; i < num_annotations; i++) {
+                    suffix[i] = 1.0;
+                }
+            } else {
+                memcpy((void *) suffix, (void *) next_suffix, num_annotations * sizeof(double));
+                multiply_by_f81_child(arena->branch_exp[next_id], parameters,
+                                      NODE_VECTOR(arena, bottom_up_likelihood, next_id),
+                                      suffix, num_annotations, FALSE);
+                upscale_node_probs(suffix, num_annotations);
+            }
+            next_suffix = suffix;
+            next_id = child_id;
+        }
+
+        memcpy((void *) prefix, (void *) up_likelihood, num_annotations * sizeof(double));
+        for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+            child_id = plan->children[k];
+            if (arena->tip_state[child_id] == num_annotations) {
+                continue;
+            }
+            nd = s_tree->nodes[child_id];
+            child_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, child_id);
+            exp_mu_t = arena->branch_exp[child_id];
+
+            /* O_v = prefix * suffix, the prefix then taking in the message of v for the next children */
+            suffix = NODE_VECTOR(arena, top_down_likelihood, child_id);
+            for (i = 0; i < num_annotations; i++) {
+                outside[i] = prefix[i] * suffix[i];
+            }
+            multiply_by_f81_child(exp_mu_t, parameters, child_likelihood, prefix, num_annotations, FALSE);
+            upscale_node_probs(prefix, num_annotations);
+            /* if all the probabilities are zero (shown by -1), the likelihood is zero:
+             * there is nothing to differentiate */
+            if (upscale_node_probs(outside, num_annotations) == -1) {
+                continue;
+            }
+
+            child_sum = 0.0;
+            outside_sum = 0.0;
+            outside_child = 0.0;
+            for (i = 0; i < num_annotations; i++) {
+                child_sum += parameters[i] * child_likelihood[i];
+                outside_sum += outside[i];
+                outside_child += outside[i] * child_likelihood[i];
+            }
+            branch_lk = exp_mu_t * outside_child + (1.0 - exp_mu_t) * child_sum * outside_sum;
+            if (branch_lk <= 0.0) {
+                continue;
+            }
+            d_exp = (outside_child - child_sum * outside_sum) / branch_lk;
+
+            /* d exp(-mu t) = -exp(-mu t) (t d mu + mu d t), where t = scaling_factor * bl(epsilon) */
+            t = get_rescaled_branch_len(nd, avg_tip_len, scaling_factor, epsilon);
+            d_t -= d_exp * exp_mu_t * t;
+            if (nd->nb_neigh == 1) {
+                d_epsilon -= d_exp * exp_mu_t * mu * scaling_factor
+                             * avg_tip_len * (avg_tip_len - nd->branch_len) / pow(avg_tip_len + epsilon, 2);
+            }
+            for (i = 0; i < num_annotations; i++) {
+                gradient[i] += (1.0 - exp_mu_t) * child_likelihood[i] * outside_sum / branch_lk;
+            }
+
+            /* L_up(v=i) = \sum_j O_v(j) P_v(j->i) */
+            if (plan->child_offset[child_id] != plan->child_offset[child_id + 1]) {
+                double *child_up_likelihood = NODE_VECTOR(arena, top_down_likelihood, child_id);
+                for (i = 0; i < num_annotations; i++) {
+                    child_up_likelihood[i] = exp_mu_t * outside[i] + (1.0 - exp_mu_t) * parameters[i] * outside_sum;
+                }
+                upscale_node_probs(child_up_likelihood, num_annotations);
+            }
+        }
+    }
+
+    /* d_t is the derivative by mu (times mu it is the derivative by log of the scaling factor),
+     * and d mu / d \pi_k = 2 \pi_k mu^2 */
+    for (i = 0; i < num_annotations; i++) {
+        gradient[i] += d_t * 2.0 * parameters[i] * mu * mu;
+    }
+    gradient[num_annotations] = d_t * mu / scaling_factor;
+    gradient[num_annotations + 1] = d_epsilon;
+}
+
+void set_tip_probabilities(Arena *arena, int id, size_t state, size_t num_annotations) {
+    /**
+     * Sets the state and likelihoods for a tip
+     * by setting the likelihood of its real state to 1
+     * and the other to 0 (the arena vectors are zeroed at allocation).
+     * The state itself is kept as well, for the tip kernels of the bottom-up pass.
+     */
+    size_t j;
+    double *bottom_up_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, id);
+    double *joint_likelihood = NODE_VECTOR(arena, joint_likelihood, id);
+
+    arena->tip_state[id] = state;
+    // state == num_annotations means that the annotation is missing
+    if (state == num_annotations) {
+        // and therefore any state is possible
+        for (j = 0; j < num_annotations; j++) {
+            bottom_up_likelihood[j] = 1.0;
+            joint_likelihood[j] = 1.0;
+        }
+    } else {
+        bottom_up_likelihood[state] = 1.0;
+        joint_likelihood[state] = 1.0;
+        arena->best_joint_state[id] = state;
+    }
+}
+
 void
-initialise_tip_probabilities(Tree *s_tree, char *const *tip_names, const int *states, size_t num_tips,
+initialise_tip_probabilities(Tree *s_tree, Arena *arena, const NameIndex *tip_index, const int *states,
                              size_t num_annotations) {
     /**
-     * Sets the state and likelihoods for a tip
-     * by setting the likelihood of its real state (given in the metadata file) to 1
-     * and the other to 0.
+     * Sets the states and likelihoods of the tips (see set_tip_probabilities) given in the metadata file,
+     * the annotation row of each tip being looked up by its name in tip_index.
      */
     Node *nd;
-    size_t j, i, k;
+    size_t i, k;
 
     for (k = 0; k < s_tree->nb_nodes; k++) {
         nd = s_tree->nodes[k];
         /* if a tip, process it */
         if (nd->nb_neigh == 1) {
-            for (i = 0; i < num_tips; i++) {
-                if (strcmp(nd->name, tip_names[i]) == 0) {
-                    // states[i] == num_annotations means that the annotation is missing
-                    if (states[i] == num_annotations) {
-                        // and therefore any state is possible
-                        for (j = 0; j < num_annotations; j++) {
-                            nd->bottom_up_likelihood[j] = 1.0;
-                            nd->joint_likelihood[j] = 1.0;
-                        }
-                    } else {
-                        nd->bottom_up_likelihood[states[i]] = 1.0;
-                        nd->joint_likelihood[states[i]] = 1.0;
-			nd->best_joint_state = states[i];
-                    }
+            i = find_name(tip_index, nd->name);
+            if (i == NOT_INDEXED) {
+                continue;
+            }
+            set_tip_probabilities(arena, nd->id, (size_t) states[i], num_annotations);
+        }
+    }
+}
+
+int mark_missing_data(Tree *s_tree, Arena *arena, size_t num_annotations) {
+    /**
+     * Marks the inner nodes whose tips all have missing data (as the missing tips are already marked),
+     * visiting the nodes in post-order, and sets their likelihoods to 1.
+     * As sum_j(p_ij) = 1, such a subtree contributes 1 to the likelihood of its parent whatever the parameters,
+     * so that the likelihood calculations skip it altogether.
+     * The root is never marked: its likelihoods are multiplied by the frequencies in place
+     * (see calculate_bottom_up_likelihood), so they are recalculated (as 1 if all its children are marked)
+     * by each evaluation.
+     * Returns the number of nodes in such subtrees.
+     */
+    const TraversalPlan *plan = s_tree->plan;
+    int n, k, id, nb_missing = 0;
+    size_t i;
+    double *bottom_up_likelihood;
+
+    for (n = 0; n < plan->nb_nodes; n++) {
+        id = plan->post_order[n];
+        if (plan->child_offset[id] != plan->child_offset[id + 1] && id != s_tree->root->id) {
+            for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+                if (arena->tip_state[plan->children[k]] != num_annotations) {
                     break;
                 }
             }
+            if (k < plan->child_offset[id + 1]) {
+                continue;
+            }
+            arena->tip_state[id] = num_annotations;
+            bottom_up_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, id);
+            for (i = 0; i < num_annotations; i++) {
+                bottom_up_likelihood[i] = 1.0;
+            }
+        }
+        if (arena->tip_state[id] == num_annotations) {
+            nb_missing++;
+        }
+    }
+    return nb_missing;
+}
+
+void set_missing_data_p_ij(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters) {
+    /**
+     * Sets the probabilities of substitution in the subtrees with missing data only, skipped by the likelihood
+     * calculations, but needed for the reconstruction of their states.
+     */
+    size_t i;
+    Node *nd;
+    if (!arena->f81) {
+        share_p_ij(arena, s_tree, num_annotations, parameters, TRUE);
+        for (i = 0; i < s_tree->nb_nodes; i++) {
+            nd = s_tree->nodes[i];
+            if (nd != s_tree->root && arena->tip_state[nd->id] == num_annotations) {
+                set_branch_p_ij(arena, s_tree, nd->id, num_annotations, parameters);
+            }
+        }
+        return;
+    }
+    for (i = 0; i < s_tree->nb_nodes; i++) {
+        nd = s_tree->nodes[i];
+        if (nd != s_tree->root && arena->tip_state[nd->id] == num_annotations) {
+            set_p_ij(arena, nd, s_tree->avg_tip_branch_len, num_annotations, parameters);
         }
     }
 }
 
-void rescale_branch_lengths(Tree *s_tree, double scaling_factor, double epsilon) {
+void rescale_branch_lengths(Tree *s_tree, Arena *arena, double scaling_factor, double epsilon) {
     /**
-     * Rescales all the branches in the tree.
+     * Rescales all the branches in the tree, keeping the result in the arena,
+     * so that the tree itself can be shared by several analyses.
      */
     Node *nd;
     size_t i;
     for (i = 0; i < s_tree->nb_nodes; i++) {
         nd = s_tree->nodes[i];
-        nd->original_len = nd->branch_len;
-        nd->branch_len = get_rescaled_branch_len(nd, s_tree->avg_tip_branch_len, scaling_factor, epsilon);
+        arena->branch_len[nd->id] = get_rescaled_branch_len(nd, s_tree->avg_tip_branch_len, scaling_factor, epsilon);
     }
 }
 
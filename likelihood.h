@@ -7,13 +7,21 @@
 #define PASTML_LIK_H
 
 double
-calculate_bottom_up_likelihood(Tree *s_tree, size_t num_annotations, double *parameters);
+calculate_bottom_up_likelihood(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters);
 
-void rescale_branch_lengths(Tree *s_tree, double scaling_factor, double epsilon);
+void calculate_bottom_up_likelihoods(Tree *s_tree, const Arena *arena, LaneArena *lanes, size_t num_annotations,
+                                     double *const *parameters, double *log_likelihoods);
+void calculate_log_likelihood_gradient(Tree *s_tree, Arena *arena, size_t num_annotations, const double *parameters,
+                                       double *gradient);
+
+void rescale_branch_lengths(Tree *s_tree, Arena *arena, double scaling_factor, double epsilon);
+int mark_missing_data(Tree *s_tree, Arena *arena, size_t num_annotations);
+void set_missing_data_p_ij(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters);
 double get_mu(const double* frequencies, size_t n);
+void set_tip_probabilities(Arena *arena, int id, size_t state, size_t num_annotations);
 void
-initialise_tip_probabilities(Tree *s_tree, char *const *tip_names, const int *states,
-                             size_t num_tips, size_t num_annotations);
+initialise_tip_probabilities(Tree *s_tree, Arena *arena, const NameIndex *tip_index, const int *states,
+                             size_t num_annotations);
 double get_pij(const double *frequencies, double mu, double t, int i, int j);
 void normalize(double *array, size_t n);
 int get_max(const int *array, size_t n);
@@ -6,13 +6,11 @@
 #include <stdarg.h>
 #include "pastml.h"
 
-int* QUIET = FALSE;
-
-void log_info(const char* message, ...) {
-    if (QUIET == FALSE) {
+void log_info(const AnalysisContext *context, const char* message, ...) {
+    if (context->log != NULL) {
         va_list args;
         va_start(args, message);
-        vprintf(message, args);
+        vfprintf(context->log, message, args);
         va_end(args);
     }
 }
@@ -5,6 +5,8 @@
 #ifndef PASTML_LOGGER_H
 #define PASTML_LOGGER_H
 
-void log_info(const char* message, ...);
+#include "pastml.h"
+
+void log_info(const AnalysisContext *context, const char* message, ...);
 
 #endif //PASTML_LOGGER_H
@@ -1,107 +1,168 @@
-#include "pastml.h"
-#include "runpastml.h"
-#include <getopt.h>
-#include <errno.h>
-
-int* SIMULATION = FALSE;
-extern QUIET;
-
-int main(int argc, char **argv) {
-    char *model = "JC";
-    char *annotation_name = NULL;
-    char *tree_name = NULL;
-    char *out_annotation_name = NULL;
-    char *out_tree_name = NULL;
-    struct timespec;
-    int opt;
-    char *arg_error_string = malloc(sizeof(char) * 1024);
-
-    opterr = 0;
-
-    const char *help_string = "usage: PASTML -a ANNOTATION_FILE -t TREE_NWK [-m MODEL] "
-            "[-o OUTPUT_ANNOTATION_FILE] [-n OUTPUT_TREE_NWK] [-q]\n"
-            "\n"
-            "required arguments:\n"
-            "   -a ANNOTATION_FILE                  path to the annotation csv file containing tip states\n"
-            "   -t TREE_NWK                         path to the tree file (in newick format)\n"
-            "\n"
-            "optional arguments:\n"
-            "   -o OUTPUT_ANNOTATION_FILE           path where the output annotation csv file containing node states will be created\n"
-            "   -n OUTPUT_TREE_NWK                  path where the output tree file will be created (in newick format)\n"
-            "   -m MODEL                            state evolution model (JC or F81)\n"
-            "   -q                                  quiet, do not print progress information\n";
-
-    opt = getopt(argc, argv, "a:t:o:m:n:q:s");
-    do {
-        switch (opt) {
-            case -1:
-                printf(help_string);
-                return EINVAL;
-
-            case 'a':
-                annotation_name = optarg;
-                break;
-
-            case 'o':
-                out_annotation_name = optarg;
-                break;
-
-            case 'n':
-                out_tree_name = optarg;
-                break;
-
-            case 't':
-                tree_name = optarg;
-                break;
-
-            case 'm':
-                model = optarg;
-                break;
-
-            case 'q':
-                QUIET = TRUE;
-                break;
-
-	    case 's':
-	        SIMULATION = TRUE;
-                break;
-
-            default: /* '?' */
-                snprintf(arg_error_string, 1024, "%s%s", "Unknown arguments...\n\n", help_string);
-                printf(arg_error_string);
-                free(arg_error_string);
-                return EINVAL;
-        }
-    } while ((opt = getopt(argc, argv, "a:t:o:m:n:q:s")) != -1);
-    /* Make sure that the required arguments are set correctly */
-    if (annotation_name == NULL) {
-        snprintf(arg_error_string, 1024, "%s%s", "Annotation file (-a) must be specified.\n\n", help_string);
-        printf(arg_error_string);
-        free(arg_error_string);
-        return EINVAL;
-    }
-    if (tree_name == NULL) {
-        snprintf(arg_error_string, 1024, "%s%s", "Tree file (-t) must be specified.\n\n", help_string);
-        printf(arg_error_string);
-        free(arg_error_string);
-        return EINVAL;
-    }
-    if ((strcmp(model, "JC") != 0) && (strcmp(model, "F81") != 0) && (strcmp(model, "HKY") != 0) && (strcmp(model, "JTT") != 0)) {
-        snprintf(arg_error_string, 1024, "%s%s", "Model (-m) must be either JC or F81.\n\n", help_string);
-        printf(arg_error_string);
-        free(arg_error_string);
-        return EINVAL;
-    }
-    /* No error in arguments */
-    free(arg_error_string);
-
-    if (out_annotation_name == NULL) {
-        out_annotation_name = calloc(256, sizeof(char));
-        sprintf(out_annotation_name, "%s.pastml.out.csv", annotation_name);
-    }
-    if (out_tree_name == NULL) {
-        out_tree_name = calloc(256, sizeof(char));
-        sprintf(out_tree_name, "%s.pastml.out.nwk", tree_name);
-    }
-    return runpastml(annotation_name, tree_name, out_annotation_name, out_tree_name, model);
-}
+#include "pastml.h"
+#include "runpastml.h"
+#include "models.h"
+#include "server.h"
+#include <getopt.h>
+#include <errno.h>
+
+/* the argument error messages hold the whole help */
+#define ARG_ERROR_LENGTH 4096
+
+int main(int argc, char **argv) {
+    char *model = "JC";
+    char *annotation_name = NULL;
+    char *tree_name = NULL;
+    char *out_annotation_name = NULL;
+    char *out_tree_name = NULL;
+    char *socket_path = NULL;
+    struct timespec;
+    int opt;
+    char *arg_error_string = malloc(sizeof(char) * ARG_ERROR_LENGTH);
+    AnalysisContext context;
+    const struct option long_options[] = {
+            {"serve", required_argument, NULL, 'S'},
+            {NULL, 0, NULL, 0}
+    };
+
+    init_context(&context);
+    opterr = 0;
+
+    const char *help_string = "usage: PASTML -a ANNOTATION_FILE -t TREE_NWK [-m MODEL] "
+            "[-o OUTPUT_ANNOTATION_FILE] [-n OUTPUT_TREE_NWK] [-q] [-H] [-T THREADS] [-b TREE_SNAPSHOT]\n"
+            "       PASTML --serve SOCKET [-t TREE_NWK] [-m MODEL] [-q] [-H] [-T WORKERS]\n"
+            "\n"
+            "required arguments:\n"
+            "   -a ANNOTATION_FILE                  path to the annotation csv file containing tip states\n"
+            "                                       (one or several columns, each column is analysed separately)\n"
+            "   -t TREE_NWK                         path to the tree file (in newick format, or a tree snapshot, see -b);\n"
+            "                                       for several trees (e.g. bootstrap trees), each is analysed, and the\n"
+            "                                       marginal probabilities are summarised on the clades of the first one\n"
+            "\n"
+            "optional arguments:\n"
+            "   -o OUTPUT_ANNOTATION_FILE           path where the output annotation csv file containing node states will be created\n"
+            "                                       (for several columns, .column_<i> is added before its extension);\n"
+            "                                       for several trees, the clade supports and mean marginal probabilities instead\n"
+            "   -n OUTPUT_TREE_NWK                  path where the output tree file will be created (in newick format);\n"
+            "                                       for several trees, the first one with its original branch lengths\n"
+            "   -m MODEL                            state evolution model (JC or F81)\n"
+            "   -q                                  quiet, do not print progress information\n"
+            "   -H                                  back the likelihood arrays with huge pages\n"
+            "   -T THREADS                          number of threads for the likelihood calculation,\n"
+            "                                       several annotation columns are analysed in parallel (default 1)\n"
+            "   -b TREE_SNAPSHOT                    path where the parsed tree will be saved in binary,\n"
+            "                                       to be given as -t to the later analyses of the same tree (loads instantly)\n"
+            "\n"
+            "daemon mode:\n"
+            "   --serve SOCKET                      keep the trees in memory and reconstruct the ancestral states on them\n"
+            "                                       on request, over the Unix domain socket SOCKET (see server.h),\n"
+            "                                       until interrupted; -t gives a tree to keep from the start\n"
+            "                                       (its id being its path), -m the default model, -T the number\n"
+            "                                       of requests processed at once (and of threads of a request)\n";
+
+    opt = getopt_long(argc, argv, "a:t:o:m:n:q:sHT:b:", long_options, NULL);
+    do {
+        switch (opt) {
+            case -1:
+                printf(help_string);
+                return EINVAL;
+
+            case 'a':
+                annotation_name = optarg;
+                break;
+
+            case 'o':
+                out_annotation_name = optarg;
+                break;
+
+            case 'n':
+                out_tree_name = optarg;
+                break;
+
+            case 't':
+                tree_name = optarg;
+                break;
+
+            case 'm':
+                model = optarg;
+                break;
+
+            case 'q':
+                context.log = NULL;
+                break;
+
+	    case 's':
+	        context.simulation = TRUE;
+                break;
+
+            case 'H':
+                context.huge_pages = TRUE;
+                break;
+
+            case 'T':
+                context.threads = atoi(optarg);
+                if (context.threads < 1) {
+                    snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Number of threads (-T) must be positive.\n\n", help_string);
+                    printf(arg_error_string);
+                    free(arg_error_string);
+                    return EINVAL;
+                }
+                break;
+
+            case 'b':
+                context.tree_snapshot = optarg;
+                break;
+
+            case 'S':
+                socket_path = optarg;
+                break;
+
+            default: /* '?' */
+                snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Unknown arguments...\n\n", help_string);
+                printf(arg_error_string);
+                free(arg_error_string);
+                return EINVAL;
+        }
+    } while ((opt = getopt_long(argc, argv, "a:t:o:m:n:q:sHT:b:", long_options, NULL)) != -1);
+    /* Make sure that the required arguments are set correctly */
+    if (socket_path != NULL) {
+        if (EXIT_SUCCESS != parse_model(model, &context.model)) {
+            snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Model (-m) must be either JC or F81.\n\n", help_string);
+            printf(arg_error_string);
+            free(arg_error_string);
+            return EINVAL;
+        }
+        free(arg_error_string);
+        /* the threads serve the requests, each of which is analysed with one thread unless it asks for more */
+        return serve(socket_path, tree_name, context.threads, &context);
+    }
+    if (annotation_name == NULL) {
+        snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Annotation file (-a) must be specified.\n\n", help_string);
+        printf(arg_error_string);
+        free(arg_error_string);
+        return EINVAL;
+    }
+    if (tree_name == NULL) {
+        snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Tree file (-t) must be specified.\n\n", help_string);
+        printf(arg_error_string);
+        free(arg_error_string);
+        return EINVAL;
+    }
+    if (EXIT_SUCCESS != parse_model(model, &context.model)) {
+        snprintf(arg_error_string, ARG_ERROR_LENGTH, "%s%s", "Model (-m) must be either JC or F81.\n\n", help_string);
+        printf(arg_error_string);
+        free(arg_error_string);
+        return EINVAL;
+    }
+    /* No error in arguments */
+    free(arg_error_string);
+
+    if (out_annotation_name == NULL) {
+        out_annotation_name = calloc(256, sizeof(char));
+        sprintf(out_annotation_name, "%s.pastml.out.csv", annotation_name);
+    }
+    if (out_tree_name == NULL) {
+        out_tree_name = calloc(256, sizeof(char));
+        sprintf(out_tree_name, "%s.pastml.out.nwk", tree_name);
+    }
+    return runpastml(annotation_name, tree_name, out_annotation_name, out_tree_name, &context);
+}
@@ -1,353 +1,359 @@
-#include "pastml.h"
+#include "make_tree.h"
 #include "logger.h"
-
-int index_toplevel_colon(const char *in_str, int begin, int end) {
-    /* returns the index of the (first) toplevel colon only, -1 if not found */
-    int level = 0, i;
-    for (i = end; i >= begin; i--) {/* more efficient to proceed from the end in this case */
-        switch (in_str[i]) {
-            case ')':
-                level++;
-                break;
-            case '(':
-                level--;
-                break;
-            case ':':
-                if (level == 0) return i;
-        } /* endswitch */
-    } /* endfor */
-    return -1;
-} /* end index_toplevel_colon */
-
-int parse_double(char *in_str, int begin, int end, double *location) {
-    /* this function parses a numerical value and puts it into location. Meant to be used for branch lengths. */
-    if (end < begin) {
-        fprintf(stderr, "Missing branch length at offset %d in the New Hampshire string. Branch length set to 0.\n",
-                begin);
-        sscanf("0.0", "%lg", location);
-        return EXIT_FAILURE;
+#include "traversal.h"
+#include <sys/mman.h>
+
+static void free_node(Node *node, int count) {
+    if (node == NULL) return;
+    if (count != 0) {
+        free(node->name);
+        free(node->sim_name);
     }
-    char numerical_string[52] = {'\0'};
-    strncpy(numerical_string, in_str + begin, end - begin + 1);
-    int n_matches = sscanf(numerical_string, "%lg", location);
-    if (n_matches != 1) {
-        fprintf(stderr, "Fatal error in parse_double: unable to parse a number out of \"%s\". Aborting.\n",
-                numerical_string);
-        return EXIT_FAILURE;
-    }
-    return EXIT_SUCCESS;
-} /* end parse_double */
-
-int strip_toplevel_parentheses(const char *in_str, int begin, int end, int *pair) {
-    /* returns the new (begin,end) pair comprising all chars found strictly inside the toplevel parentheses.
-       The input "pair" is an array of two integers, we are passing the output values through it.
-       It is intended that here, in_str[pair[0]-1] == '(' and in_str[pair[1]+1] == ')'.
-       In case no matching parentheses are simply return begin and end in pair[0] and pair[1]. It is NOT an error. */
-    /* This function also tests the correctness of the NH syntax: if no balanced pars, then return an error and abort. */
-    int i, found_par = 0;
-
-    pair[0] = end + 1;
-    pair[1] = -1; /* to ensure termination if no parentheses are found */
-
-    /* first seach opening par from the beginning of the string */
-    for (i = begin; i <= end; i++)
-        if (in_str[i] == '(') {
-            pair[0] = i + 1;
-            found_par += 1;
-            break;
-        }
-
-    /* and then search the closing par from the end of the string */
-    for (i = end; i >= begin; i--)
-        if (in_str[i] == ')') {
-            pair[1] = i - 1;
-            found_par += 1;
-            break;
-        }
-
-    switch (found_par) {
-        case 0:
-            pair[0] = begin;
-            pair[1] = end;
-            break;
-        case 1:
-            fprintf(stderr,
-                    "Syntax error in NH tree: unbalanced parentheses between string indices %d and %d. Aborting.\n",
-                    begin, end);
-            return EXIT_FAILURE;
-    } /* end of switch: nothing to do in case 2 (as pair[0] and pair[1] correctly set), and found_par can never be > 2 */
-    return EXIT_SUCCESS;
+    free(node->neigh);
 }
 
-int count_outer_commas(const char *in_str, int begin, int end) {
-    /* returns the number of toplevel commas found, from position begin included, up to position end. */
-    int count = 0, level = 0, i;
-    for (i = begin; i <= end; i++) {
-        switch (in_str[i]) {
-            case '(':
-                level++;
-                break;
-            case ')':
-                level--;
-                break;
-            case ',':
-                if (level == 0) count++;
-        } /* endswitch */
-    } /* endfor */
-    return count;
-} /* end count_outer_commas */
-
-int process_name_and_brlen(Node *son_node, char *in_str, int begin, int end) {
-    /* looks into in_str[begin..end] for the branch length of the "father" edge
-       and updates the edge and node structures accordingly */
-    int colon = index_toplevel_colon(in_str, begin, end);
-    int closing_par = -1, opening_bracket = -1;
-    int i, ignore_mode, name_begin, name_end, name_length, effective_length;
-    double brlen = .0;
-
-    /* processing the optional BRANCH LENGTH... */
-    if (colon == -1) {
-        son_node->branch_len = 0.0;
+void free_tree(Tree *tree) {
+    int i;
+    if (tree == NULL) return;
+    if (tree->snapshot != NULL) {
+        /* the names are in the snapshot, the neighbours and sim names in one slab */
+        free(tree->snapshot_slab);
+        munmap(tree->snapshot, tree->snapshot_size);
     } else {
-        if (EXIT_SUCCESS != parse_double(in_str, colon + 1, end, &brlen)) {
-            return EXIT_FAILURE;
+        for (i = 0; i < tree->nb_nodes; i++) {
+            free_node(tree->nodes[i], i);
         }
-        son_node->branch_len = brlen;
     }
+    free_traversal_plan(tree->plan);
+    free(tree->node_slab);
+    free(tree->nodes);
+    free(tree);
+}
 
-    /* then scan backwards from the colon (or from the end if no branch length) to get the NODE NAME,
-       not going further than the first closing par */
-    /* we ignore the NHX-style comments for the moment, hence the detection of the brackets, which can contain anything but nested brackets */
-    ignore_mode = 0;
-    for (i = (colon == -1 ? end : colon - 1); i >= begin; i--) {
-        if (in_str[i] == ']' && ignore_mode == 0) { ignore_mode = 1; }
-        else if (in_str[i] == ')' && ignore_mode == 0) {
-            closing_par = i;
+static const char *skip_blanks_and_comments(const char *pos, const char *end) {
+    /* returns the position of the next character that is neither a blank nor inside an (NHX-style) comment in brackets,
+       which can contain anything but nested brackets */
+    while (pos < end) {
+        if (*pos == '[') {
+            while (pos < end && *pos != ']') pos++;
+            if (pos < end) pos++;
+        } else if (isspace(*pos)) {
+            pos++;
+        } else {
             break;
         }
-        else if (in_str[i] == '[' && ignore_mode) {
-            ignore_mode = 0;
-            opening_bracket = i;
+    }
+    return pos;
+} /* end skip_blanks_and_comments */
+
+static const char *parse_name(const char *pos, const char *end, char *name) {
+    /* reads the (optional) node name starting at pos into name (if not NULL, truncated to MAX_NAMELENGTH - 1 chars),
+       and returns the position right after it. The name can be quoted (with single or double quotes),
+       otherwise it ends at the first parenthesis, comma, colon, semicolon or bracket, the blanks being ignored. */
+    size_t length = 0;
+    char quote;
+
+    if (pos < end && (*pos == '\'' || *pos == '"')) {
+        quote = *pos++;
+        for (; pos < end && *pos != quote; pos++) {
+            if (name != NULL && length < MAX_NAMELENGTH - 1) name[length++] = *pos;
+        }
+        if (pos < end) pos++; /* the closing quote */
+    } else {
+        for (; pos < end && strchr("(),:;[", *pos) == NULL; pos++) {
+            if (name != NULL && length < MAX_NAMELENGTH - 1 && !isspace(*pos)) name[length++] = *pos;
         }
-    } /* endfor */
-
-    name_begin = (closing_par == -1 ? begin : closing_par + 1);
-    name_end = (opening_bracket != -1) ? (opening_bracket - 1): (colon == -1 ? end : colon - 1);
-    /* but now if the name starts and ends with single or double quotes, remove them */
-    if (in_str[name_begin] == in_str[name_end] && (in_str[name_begin] == '"' || in_str[name_begin] == '\'')) {
-        name_begin++;
-        name_end--;
-    }
-    name_length = name_end - name_begin + 1;
-    effective_length = (name_length > MAX_NAMELENGTH ? MAX_NAMELENGTH : name_length);
-    son_node->name = (char *) malloc((MAX_NAMELENGTH) * sizeof(char));
-    son_node->sim_name = (char *) malloc((MAX_NAMELENGTH) * sizeof(char));
-    if (name_length >= 1) {
-        strncpy(son_node->name, in_str + name_begin, (size_t) effective_length);
-        son_node->name[effective_length] = '\0'; /* terminating the string */
     }
-    return EXIT_SUCCESS;
-} /* end of process_name_and_brlen */
-
-
-Node *create_son_and_connect_to_father(Node *current_node, Tree *current_tree, int direction, char *in_str, int begin,
-                                       int end) {
-    /* This function creates (allocates) the son node in the given direction from the current node.
-       It also creates a new branch to connect the son to the father.
-       The array structures in the tree (nodes) are updated accordingly.
-       Branch length and node name are processed.
-       The input string given between the begin and end indices (included) is of the type:
-       (...)node_name:length
-       OR
-       leaf_name:length
-       OR
-       a:1,b:0.31,c:1.03
-       In both cases the length is optional, and replaced by MIN_BR_LENGTH if absent.
-       In case of a failure the function returns NULL*/
-
-    if (direction < 0) {
-        fprintf(stderr, "Error in the direction given to create a son! Aborting.\n");
+    if (name != NULL) name[length] = '\0';
+    return pos;
+} /* end parse_name */
+
+static const char *count_nodes(const char *pos, const char *end, int *nb_nodes) {
+    /* counts the nodes of the tree starting at pos, reading it token by token as read_subtrees does,
+       so that the parentheses and commas inside quoted names or comments are ignored:
+       every node but the root starts either right after an opening parenthesis or after a comma.
+       Returns the position of the semicolon that ends the tree, or end if there is none. */
+    *nb_nodes = 1;
+    while (TRUE) {
+        pos = skip_blanks_and_comments(pos, end);
+        if (pos == end || *pos == ';') {
+            return pos;
+        }
+        if (*pos == '(' || *pos == ',') {
+            (*nb_nodes)++;
+            pos++;
+        } else if (*pos == ')' || *pos == ':') {
+            pos++;
+        } else {
+            /* a name or a branch length */
+            pos = parse_name(pos, end, NULL);
+        }
+    }
+} /* end count_nodes */
+
+const char *find_nh_tree_end(const char *pos, const char *end) {
+    /* returns the position of the semicolon that ends the newick tree starting at pos, the semicolons inside
+       quoted names or comments being ignored, or end if there is none */
+    int nb_nodes;
+    return count_nodes(pos, end, &nb_nodes);
+} /* end find_nh_tree_end */
+
+static const char *parse_name_and_brlen(const char *pos, const char *end, const char *in_str, Node *node) {
+    /* reads the optional name and branch length of the node (or skips them if node is NULL, e.g. for the root)
+       that follow the node's subtree (or that form the whole tip), and returns the position right after them,
+       or NULL in case of a syntax error. The branch length is 0 if absent, and the name NULL (named after parsing). */
+    char *number_end;
+    char name[MAX_NAMELENGTH];
+    double brlen = 0.0;
+
+    pos = parse_name(skip_blanks_and_comments(pos, end), end, name);
+    if (node != NULL && name[0] != '\0') {
+        node->name = strdup(name);
+        if (node->name == NULL) {
+            fprintf(stderr, "Not enough memory to parse the tree.\n");
+            return NULL;
+        }
+    }
+    pos = skip_blanks_and_comments(pos, end);
+    if (pos < end && *pos == ':') {
+        pos = skip_blanks_and_comments(pos + 1, end);
+        /* the number is read in place, it cannot go past the semicolon of the tree (see parse_nh_string) */
+        brlen = strtod(pos, &number_end);
+        if (number_end == pos) {
+            fprintf(stderr, "Missing branch length at offset %ld in the New Hampshire string.\n", (long) (pos - in_str));
+            return NULL;
+        }
+        pos = skip_blanks_and_comments(number_end, end);
+    }
+    if (node != NULL) node->branch_len = brlen;
+    return pos;
+} /* end parse_name_and_brlen */
+
+static Node *create_node(Tree *current_tree, int max_nodes) {
+    /* takes the next node from the tree slab, its neighbours are set once its subtree is read.
+       Returns NULL if the slab (of max_nodes nodes) is full. */
+    Node *node;
+    if (current_tree->next_avail_node_id >= max_nodes) {
+        fprintf(stderr, "Syntax error in NH tree: more nodes than counted. Aborting.\n");
         return NULL;
     }
-
-    Node *son = (Node *) malloc(sizeof(Node));
-    son->id = current_tree->next_avail_node_id++;
-    current_tree->nodes[son->id] = son;
+    node = current_tree->node_slab + current_tree->next_avail_node_id;
+    node->id = current_tree->next_avail_node_id++;
+    current_tree->nodes[node->id] = node;
     current_tree->nb_nodes++;
-
-    son->name = NULL;
-
     current_tree->nb_edges++;
-    current_node->neigh[direction] = son;
-
-    /* process node name (of the son) and branch length (of the edge we just created)... */
-    if (EXIT_SUCCESS != process_name_and_brlen(son, in_str, begin, end)) {
-        return NULL;
-    };
-
-    return son;
-} /* end of create_son_and_connect_to_father */
-
-
-
-int index_next_toplevel_comma(const char *in_str, int begin, int end) {
-    /* returns the index of the next toplevel comma, from position begin included, up to position end.
-       the result is -1 if none is found. */
-    int level = 0, i;
-    for (i = begin; i <= end; i++) {
-        switch (in_str[i]) {
-            case '(':
-                level++;
-                break;
-            case ')':
-                level--;
-                break;
-            case ',':
-                if (level == 0) return i;
-        } /* endswitch */
-    } /* endfor */
-    return -1; /* reached if no outer comma found */
-} /* end index_next_toplevel_comma */
-
-
-
-int parse_substring_into_node(char *in_str, int begin, int end, Node *current_node, int has_father, Tree *current_tree,
-                               size_t nbanno) {
-    /* this function supposes that current_node is already allocated, but not the data structures in there.
-       It reads starting from character of in_str at index begin and stops at character at index end.
-       It is supposed that the input to this function is what has been seen immediately within a set of parentheses.
-       The outer parentheses themselves are not included in the range [begin, end].
-       So we expect in_str[begin, end] to contain something like:
-       MyTaxa:1.2e-3
-       OR
-       (A:4,B:6)Archae:0.45,Ctax:0.004
-       OR
-       MyTaxa
-       OR
-       (A:4,B:6),Ctax
-       OR
-       A,B,C,D,E,etc (we allow large multifurcations, with no limit on the number of sons)
-     */
-
-    /* When called, the current node has just been created but doesn't know yet its number of neighbours. We are going to discover
-       this when counting the number of outer commas in the substring. This function:
-       (1) checks how many outer commas are here: this is the number of "sons" of this node. Add one to it if the node has a father.
-       (2) creates the stuctures (array of node pointers and array of edge pointers) accordingly (+1 for the father)
-       (3) fills them. index 0 corresponds to the "father", the other to the "sons". */
-
-    if (begin > end) {
-        fprintf(stderr, "Error in parse_substring_into_node: begin > end. Aborting.\n");
+    node->branch_len = 0.0;
+    node->name = NULL; /* unnamed, will be named after parsing */
+    node->sim_name = NULL; /* only needed for the inner nodes, see connect_to_children */
+    return node;
+} /* end create_node */
+
+static int connect_to_children(Node *node, Node *father, Node *const *children, int nb_children) {
+    /* sets the neighbours of the node: index 0 corresponds to the father (unless the node is the root),
+       the others to the children */
+    int i, has_father = (father != NULL);
+    node->nb_neigh = nb_children + has_father;
+    node->neigh = malloc(node->nb_neigh * sizeof(Node *));
+    if (nb_children > 0 && has_father) {
+        node->sim_name = malloc(GENERATED_NAME_LENGTH * sizeof(char));
+    }
+    if (node->neigh == NULL || (nb_children > 0 && has_father && node->sim_name == NULL)) {
+        fprintf(stderr, "Not enough memory to parse the tree.\n");
         return EXIT_FAILURE;
     }
-
-    int i;
-    int pair[2]; /* to be the beginning and end points of the substrings describing the various nodes */
-    int inner_pair[2]; /* to be the beginning and end points of the substrings after removing the name and branch length */
-    int nb_commas = count_outer_commas(in_str, begin, end);
-    int comma_index = begin - 1;
-    int direction;
-    Node *son;
-
-    /* allocating the data structures for the current node */
-    /* FIXME: in case the tree has an inner node with just one child, nb_neigh will become 1 instead of 2.*/
-    current_node->nb_neigh = (nb_commas == 0 ? 1 : nb_commas + 1 + has_father);
-    current_node->neigh = malloc(current_node->nb_neigh * sizeof(Node *));
-
-    size_t nbanno_size_t = (size_t) nbanno;
-    current_node->bottom_up_likelihood = calloc(nbanno_size_t, sizeof(double));
-    current_node->marginal = calloc(nbanno_size_t, sizeof(double));
-    current_node->sim_marginal_prob = calloc(nbanno_size_t, sizeof(double));
-    current_node->pij = calloc(nbanno_size_t, sizeof(double *));
-    for (i = 0; i < nbanno; i++) {
-        current_node->pij[i] = calloc(nbanno_size_t, sizeof(double));
-    }
-    current_node->best_states = calloc(nbanno_size_t, sizeof(size_t));
-    current_node->top_down_likelihood = calloc(nbanno_size_t, sizeof(double));
-    current_node->joint_state = calloc(nbanno_size_t, sizeof(size_t));
-    current_node->joint_likelihood = calloc(nbanno_size_t, sizeof(double));
-
-    if (nb_commas != 0) { /* at least one comma, so at least two sons: */
-        for (i = 0; i <= nb_commas; i++) { /* e.g. three iterations for two commas */
-            direction = i + has_father;
-            pair[0] = comma_index + 1; /* == begin at first iteration */
-            comma_index = (i == nb_commas ? end + 1 : index_next_toplevel_comma(in_str, pair[0], end));
-            pair[1] = comma_index - 1;
-
-            son = create_son_and_connect_to_father(current_node, current_tree, direction /* dir from current */,
-                                                   in_str, pair[0], pair[1]);
-            if (son == NULL) {
+    if (has_father) node->neigh[0] = father;
+    for (i = 0; i < nb_children; i++) {
+        node->neigh[i + has_father] = children[i];
+    }
+    return EXIT_SUCCESS;
+} /* end connect_to_children */
+
+static int read_subtrees(const char *in_str, const char *pos, const char *end, Tree *current_tree, int max_nodes,
+                         Node **open, Node **done, int *first_done) {
+    /* reads the tree in one left-to-right pass, starting right after the opening parenthesis of the root.
+       The nodes whose subtrees are being read are kept on a stack (open), and the nodes whose subtrees are read
+       on another one (done), until their father's closing parenthesis, where they become its children
+       (first_done keeps where the children of each open node start in done).
+       The nodes are numbered in pre-order, by their first character in the string.
+       The tree slab and the stacks hold max_nodes nodes. */
+    int nb_open = 1, nb_done = 0, expect_child = TRUE;
+    Node *node, *father;
+
+    open[0] = current_tree->root;
+    first_done[0] = 0;
+
+    while (TRUE) {
+        pos = skip_blanks_and_comments(pos, end);
+        if (pos == end || *pos == ';') {
+            fprintf(stderr, "Syntax error in NH tree: unbalanced parentheses at offset %ld. Aborting.\n",
+                    (long) (pos - in_str));
+            return EXIT_FAILURE;
+        }
+        if (expect_child) {
+            father = open[nb_open - 1];
+            node = create_node(current_tree, max_nodes);
+            if (node == NULL) {
+                return EXIT_FAILURE;
+            }
+            done[nb_done++] = node;
+            if (*pos == '(') {
+                first_done[nb_open] = nb_done;
+                open[nb_open++] = node;
+                pos++;
+                continue;
+            }
+            /* a tip */
+            if (EXIT_SUCCESS != connect_to_children(node, father, NULL, 0)) {
                 return EXIT_FAILURE;
             }
-            /* RECURSIVE TREATMENT OF THE SON */
-            if (EXIT_SUCCESS != strip_toplevel_parentheses(in_str, pair[0], pair[1],
-                                       inner_pair)) {
+            current_tree->nb_taxa++;
+            pos = parse_name_and_brlen(pos, end, in_str, node);
+            if (pos == NULL) {
                 return EXIT_FAILURE;
-            } /* because name and branch_len already processed by create_son */
-            if (EXIT_SUCCESS != parse_substring_into_node(in_str, inner_pair[0], inner_pair[1], son, 1, current_tree,
-                                      nbanno)){
+            }
+            expect_child = FALSE;
+        } else if (*pos == ',') {
+            expect_child = TRUE;
+            pos++;
+        } else if (*pos == ')') {
+            /* the subtree of the top open node is read: its children are on the top of the done stack */
+            node = open[--nb_open];
+            father = (nb_open > 0) ? open[nb_open - 1] : NULL;
+            if (EXIT_SUCCESS != connect_to_children(node, father, done + first_done[nb_open],
+                                                    nb_done - first_done[nb_open])) {
                 return EXIT_FAILURE;
-            } /* recursive treatment */
-            /* after the recursive treatment of the son, the data structures of the son have been created, so now we can write
-               in it the data corresponding to its direction0 (father) */
-            son->neigh[0] = current_node;
-        } /* end for i (treatment of the various sons) */
-    } /* end if/else on the number of commas */
+            }
+            nb_done = first_done[nb_open];
+            /* the name and branch length of the root are ignored */
+            pos = parse_name_and_brlen(pos + 1, end, in_str, father == NULL ? NULL : node);
+            if (pos == NULL) {
+                return EXIT_FAILURE;
+            }
+            if (father == NULL) {
+                if (pos == end || *pos != ';') {
+                    fprintf(stderr, "Error: tree doesn't end with a semicolon.\n");
+                    return EXIT_FAILURE;
+                }
+                return EXIT_SUCCESS;
+            }
+        } else {
+            fprintf(stderr, "Syntax error in NH tree: unexpected character '%c' at offset %ld. Aborting.\n",
+                    *pos, (long) (pos - in_str));
+            return EXIT_FAILURE;
+        }
+    }
+} /* end read_subtrees */
+
 
+static int name_tree_nodes(Tree *t) {
+    /* names the inner nodes that have no name (but the root), and gives the unnamed tips an empty one */
+    int i, nodecount = 0;
+    Node *cur_node;
+    for (i = 1; i < t->nb_nodes; i++) {
+        cur_node = t->nodes[i];
+        if (cur_node->nb_neigh > 1) {
+            nodecount++;
+            if (!cur_node->name) {
+                cur_node->name = malloc(GENERATED_NAME_LENGTH * sizeof(char));
+                if (cur_node->name == NULL) {
+                    fprintf(stderr, "Not enough memory to name the tree nodes.\n");
+                    return EXIT_FAILURE;
+                }
+                sprintf(cur_node->name, "Pastml_Node_%d", nodecount);
+            }
+        } else if (!cur_node->name) {
+            cur_node->name = strdup(""); /* an unnamed tip */
+            if (cur_node->name == NULL) {
+                fprintf(stderr, "Not enough memory to name the tree nodes.\n");
+                return EXIT_FAILURE;
+            }
+        }
+    }
     return EXIT_SUCCESS;
-} /* end parse_substring_into_node */
+} /* end name_tree_nodes */
 
 
-Tree *parse_nh_string(char *in_str, size_t nbanno) {
+static int set_branch_statistics(Tree *t) {
+    /* sets the average and minimal (positive) branch lengths of the tree,
+       and returns the maximal number of children per node */
+    int i, nb_children, max_children = 0;
+    double tip_branch_len_sum = 0.0;
+    Node *cur_node;
+
+    t->min_branch_len = -1.0;
+
+    double branch_len_sum = 0.;
+    for (i = 0; i < t->nb_nodes; i++) {
+        cur_node = t->nodes[i];
+        if(cur_node->nb_neigh == 1){ //tips
+          tip_branch_len_sum += cur_node->branch_len;
+        }
+        /* the root has no father among its neighbours */
+        nb_children = cur_node->nb_neigh - (cur_node != t->root);
+        if (max_children < nb_children) {
+            max_children = nb_children;
+        }
+        if (cur_node != t->root) {
+            if ((t->min_branch_len < 0 || t->min_branch_len > cur_node->branch_len) && cur_node->branch_len > 0.0) {
+                t->min_branch_len = cur_node->branch_len;
+            }
+            branch_len_sum += cur_node->branch_len;
+        }
+    }
+    t->avg_tip_branch_len = tip_branch_len_sum / (double) t->nb_taxa;
+    t->avg_branch_len = branch_len_sum / (double) t->nb_edges;
+    return max_children;
+} /* end set_branch_statistics */
+
+
+Tree *parse_nh_string(const char *in_str, size_t in_length, const AnalysisContext *context) {
     /* this function allocates, populates and returns a new tree. */
     /* returns NULL if the file doesn't correspond to NH format */
-    int in_length = (int) strlen(in_str);
-    int i; /* loop counter */
-    int begin, end; /* to delimitate the string to further process */
-    int nodecount = 0;
-    size_t n_otu = 0;
-    int maxpoly;
-    double tip_branch_len_sum=0.0;
-    Node *cur_node;
+    const char *pos = in_str, *end = in_str + in_length;
+    int max_nodes, exit_val;
+    Node **open, **done;
+    int *first_done;
 
     /* SYNTACTIC CHECKS on the input string */
-    i = 0;
-    while (isspace(in_str[i])) i++;
-    if (in_str[i] != '(') {
+    pos = skip_blanks_and_comments(pos, end);
+    if (pos == end || *pos != '(') {
         fprintf(stderr, "Error: tree doesn't start with an opening parenthesis.\n");
         return NULL;
     }
-    else begin = i + 1;
-    /* begin: AFTER the very first parenthesis */
 
-    i = in_length - 1;
-    while (isspace(in_str[i])) i--;
-    if (in_str[i] != ';') {
+    /* the string does not need to be null-terminated, but the semicolon must be there to stop the reading */
+    if (count_nodes(pos, end, &max_nodes) == end) {
         fprintf(stderr, "Error: tree doesn't end with a semicolon.\n");
         return NULL;
     }
-    while (in_str[--i] != ')');
-    end = i - 1;
-    /* end: BEFORE the very last parenthesis, discarding optional name for the root and uncanny branch length for its "father" branch */
-
-    /* we make a first pass on the string to discover the number of taxa. */
-    /* there are as many OTUs as commas plus 1 in the nh string */
-    for (i = 0; i < in_length; i++) if (in_str[i] == ',') n_otu++;
-    n_otu++;
 
     /************************************
     initialisation of the tree structure
     *************************************/
-    Tree *t = (Tree *) malloc(sizeof(Tree));
-    /* in a rooted binary tree with n taxa, (2n-2) branches and (2n-1) nodes in total.
-      this is the maximum we can have. multifurcations will reduce the number of nodes and branches, so set the data structures to the max size */
-    t->nb_taxa = n_otu;
-
-    t->nodes = (Node **) calloc(2 * n_otu - 1, sizeof(Node *));
+    Tree *t = (Tree *) calloc(1, sizeof(Tree));
+    if (t == NULL) {
+        fprintf(stderr, "Not enough memory to parse the tree.\n");
+        return NULL;
+    }
+    t->nb_taxa = 0; /* counted while reading */
+    t->snapshot = NULL;
+    t->snapshot_size = 0;
+    t->snapshot_slab = NULL;
+
+    t->nodes = (Node **) calloc(max_nodes, sizeof(Node *));
+    t->node_slab = (Node *) calloc(max_nodes, sizeof(Node));
+    if (t->nodes == NULL || t->node_slab == NULL) {
+        fprintf(stderr, "Not enough memory to parse the tree.\n");
+        free(t->nodes);
+        free(t->node_slab);
+        free(t);
+        return NULL;
+    }
     t->nb_nodes = 1; /* for the moment we only have the root node. */
 
     t->nb_edges = 0; /* none at the moment */
 
-    t->root = (Node *) malloc(sizeof(Node));
+    t->root = t->node_slab;
     t->nodes[0] = t->root;
 
     t->root->id = 0;
@@ -358,69 +364,208 @@ Tree *parse_nh_string(char *in_str, size_t nbanno) {
     t->next_avail_node_id = 1; /* root node has id 0 */
 
     /* ACTUALLY READING THE TREE... */
-    if (EXIT_SUCCESS != parse_substring_into_node(in_str, begin, end, t->root, 0 /* no father node */, t, nbanno)) {
-        return NULL;
+    open = malloc(max_nodes * sizeof(Node *));
+    done = malloc(max_nodes * sizeof(Node *));
+    first_done = malloc(max_nodes * sizeof(int));
+    if (open == NULL || done == NULL || first_done == NULL) {
+        fprintf(stderr, "Not enough memory to parse the tree.\n");
+        exit_val = EXIT_FAILURE;
+    } else {
+        exit_val = read_subtrees(in_str, pos + 1, end, t, max_nodes, open, done, first_done);
     }
+    free(open);
+    free(done);
+    free(first_done);
 
     /* SANITY CHECKS AFTER READING THE TREE */
+    if (EXIT_SUCCESS == exit_val) {
+        exit_val = name_tree_nodes(t);
+    }
+    if (EXIT_SUCCESS != exit_val) {
+        /* the nodes read so far, with the names and neighbours they already have */
+        free_tree(t);
+        return NULL;
+    }
+    log_tree_statistics(t, set_branch_statistics(t), context);
 
-    /* name tree nodes if needed */
-    for (i = 0; i < t->nb_nodes; i++) {
-        cur_node = t->nodes[i];
-        if (cur_node->nb_neigh > 1 && i > 0) {
-            nodecount++;
-            if (!cur_node->name || strcmp(cur_node->name, "") == 0 || strcmp(cur_node->name, "\0") == 0) {
-                sprintf(cur_node->name, "Pastml_Node_%d", nodecount);
-            }
+    return t;
+
+} /* end parse_nh_string */
+
+
+void log_tree_statistics(const Tree *t, int max_children, const AnalysisContext *context) {
+    log_info(context, "BASIC TREE STATISTICS:\n\n");
+    log_info(context, "\tNumber of taxa:\t%zd\n", t->nb_taxa);
+    log_info(context, "\tNumber of nodes:\t%zd\n", t->nb_nodes - t->nb_taxa);
+    log_info(context, "\tNumber of edges:\t%d\n", t->nb_edges);
+    log_info(context, "\tAvg branch length:\t%e\n", t->avg_branch_len);
+    log_info(context, "\tAvg tip branch length:\t%e\n", t->avg_tip_branch_len);
+    log_info(context, "\tMin branch length:\t%e\n", t->min_branch_len);
+    log_info(context, "\tMax number of children per node:\t%d\n", max_children);
+    log_info(context, "\n");
+} /* end log_tree_statistics */
+
+
+Tree *make_tree_from_parents(int nb_nodes, const int *parents, const double *branch_lengths,
+                             const char *const *names, const AnalysisContext *context) {
+    /* builds a tree from the parent of each node (-1 for the root, which must be the node 0)
+       and the lengths of the branches above them (the root one is ignored), the node ids being their indices.
+       The names (the root one is ignored) may be NULL, either all of them or some, the nodes are then named as
+       when parsing. The children of each node are ordered by id.
+       Returns NULL if the parents do not make a tree. */
+    int i, id, top, nb_visited = 0;
+    int *nb_children, *stack;
+    Node *node;
+    Tree *t;
+
+    if (nb_nodes < 2 || parents[0] != -1) {
+        fprintf(stderr, "Error: the tree must have at least two nodes, the first one being its root.\n");
+        return NULL;
+    }
+    for (i = 1; i < nb_nodes; i++) {
+        if (parents[i] < 0 || parents[i] >= nb_nodes || parents[i] == i) {
+            fprintf(stderr, "Error: node %d has an invalid parent %d.\n", i, parents[i]);
+            return NULL;
         }
     }
-    t->min_branch_len = -1.0;
-    maxpoly=0;
 
-    double branch_len_sum = 0.;
-    for (i = 0; i < t->nb_nodes; i++) {
-        cur_node = t->nodes[i];
-        if(cur_node->nb_neigh == 1){ //tips
-          tip_branch_len_sum += cur_node->branch_len;
-        }
-        if(maxpoly < cur_node->nb_neigh)  {
-            maxpoly = cur_node->nb_neigh;
+    t = (Tree *) calloc(1, sizeof(Tree));
+    nb_children = calloc(nb_nodes, sizeof(int));
+    stack = malloc(nb_nodes * sizeof(int));
+    if (t == NULL || nb_children == NULL || stack == NULL) {
+        fprintf(stderr, "Not enough memory to build the tree.\n");
+        free(t);
+        free(nb_children);
+        free(stack);
+        return NULL;
+    }
+    t->nodes = (Node **) calloc(nb_nodes, sizeof(Node *));
+    t->node_slab = (Node *) calloc(nb_nodes, sizeof(Node));
+    if (t->nodes == NULL || t->node_slab == NULL) {
+        fprintf(stderr, "Not enough memory to build the tree.\n");
+        free(nb_children);
+        free(stack);
+        free(t->nodes);
+        free(t->node_slab);
+        free(t);
+        return NULL;
+    }
+    t->nb_nodes = nb_nodes;
+    t->nb_edges = nb_nodes - 1;
+    t->next_avail_node_id = nb_nodes;
+    t->root = t->node_slab;
+    for (i = 0; i < nb_nodes; i++) {
+        t->nodes[i] = t->node_slab + i;
+        t->nodes[i]->id = i;
+    }
+    t->root->name = "ROOT";
+    t->root->sim_name = "Node0";
+
+    /* neighbours: index 0 corresponds to the father (unless the node is the root), the others to the children */
+    for (i = 1; i < nb_nodes; i++) {
+        nb_children[parents[i]]++;
+    }
+    for (i = 0; i < nb_nodes && t != NULL; i++) {
+        node = t->nodes[i];
+        node->nb_neigh = (i > 0);
+        /* at least one, so that a root without children (the other nodes being in a cycle) is reported as such */
+        node->neigh = malloc(MAX(1, nb_children[i] + (i > 0)) * sizeof(Node *));
+        if (node->neigh == NULL) {
+            fprintf(stderr, "Not enough memory to build the tree.\n");
+            free_tree(t);
+            t = NULL;
+            break;
         }
-        if (cur_node != t->root) {
-            if ((t->min_branch_len < 0 || t->min_branch_len > cur_node->branch_len) && cur_node->branch_len > 0.0) {
-                t->min_branch_len = cur_node->branch_len;
+        if (i > 0) {
+            node->neigh[0] = t->nodes[parents[i]];
+            node->branch_len = branch_lengths[i];
+            if (nb_children[i] > 0) {
+                node->sim_name = malloc(GENERATED_NAME_LENGTH * sizeof(char));
+            } else {
+                t->nb_taxa++;
+            }
+            if (names != NULL && names[i] != NULL) {
+                node->name = strdup(names[i]);
             }
-            branch_len_sum += cur_node->branch_len;
+        }
+        if ((i > 0 && nb_children[i] > 0 && node->sim_name == NULL)
+            || (i > 0 && names != NULL && names[i] != NULL && node->name == NULL)) {
+            fprintf(stderr, "Not enough memory to build the tree.\n");
+            free_tree(t);
+            t = NULL;
         }
     }
-    t->avg_tip_branch_len = tip_branch_len_sum / (double) t->nb_taxa;
-    t->avg_branch_len = branch_len_sum / (double) t->nb_edges;
+    free(nb_children);
+    if (t == NULL) {
+        free(stack);
+        return NULL;
+    }
+    for (i = 1; i < nb_nodes; i++) {
+        node = t->nodes[parents[i]];
+        node->neigh[node->nb_neigh++] = t->nodes[i];
+    }
 
-    log_info("BASIC TREE STATISTICS:\n\n");
-    log_info("\tNumber of taxa:\t%zd\n", t->nb_taxa);
-    if (t->nb_taxa > MAXNSP) {
-        fprintf(stderr, "Fatal error: too many taxa: more than %d.\n", MAXNSP);
+    /* every node must descend from the root, otherwise some of them are in a cycle */
+    top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        node = t->nodes[stack[--top]];
+        nb_visited++;
+        for (id = (node != t->root); id < node->nb_neigh; id++) {
+            stack[top++] = node->neigh[id]->id;
+        }
+    }
+    free(stack);
+    if (nb_visited != nb_nodes) {
+        fprintf(stderr, "Error: the parents contain a cycle.\n");
+        free_tree(t);
         return NULL;
     }
-    log_info("\tNumber of nodes:\t%zd\n", t->nb_nodes - t->nb_taxa);
-    log_info("\tNumber of edges:\t%d\n", t->nb_edges);
-    log_info("\tAvg branch length:\t%e\n", t->avg_branch_len);
-    log_info("\tAvg tip branch length:\t%e\n", t->avg_tip_branch_len);
-    log_info("\tMin branch length:\t%e\n", t->min_branch_len);
-    log_info("\tMax number of children per node:\t%d\n", maxpoly-1);
-    log_info("\n");
 
+    if (EXIT_SUCCESS != name_tree_nodes(t)) {
+        free_tree(t);
+        return NULL;
+    }
+    log_tree_statistics(t, set_branch_statistics(t), context);
+    t->plan = build_traversal_plan(t);
+    if (t->plan == NULL) {
+        fprintf(stderr, "Not enough memory to store the tree traversal.\n");
+        free_tree(t);
+        return NULL;
+    }
+    name_simulation_nodes(t);
     return t;
-
-} /* end parse_nh_string */
+} /* end make_tree_from_parents */
+
+
+void name_simulation_nodes(Tree *t) {
+    /* names the inner nodes (but the root) of the simulation outputs, in post-order,
+       once per tree, so that the analyses only read the tree */
+    int i, count = 0;
+    Node *nd;
+    for (i = 0; i < t->plan->nb_nodes; i++) {
+        nd = t->nodes[t->plan->post_order[i]];
+        if (nd->nb_neigh != 1 && nd != t->root) {
+            count++;
+            sprintf(nd->sim_name, "Node%d", count);
+        }
+    }
+} /* end name_simulation_nodes */
 
 
-Tree *complete_parse_nh(char *big_string, size_t nbanno) {
-    Tree *mytree = parse_nh_string(big_string, nbanno);
+Tree *complete_parse_nh(const char *nh_string, size_t length, const AnalysisContext *context) {
+    Tree *mytree = parse_nh_string(nh_string, length, context);
     if (mytree == NULL) {
         fprintf(stderr, "Not a syntactically correct NH tree.\n");
         return NULL;
     }
+    mytree->plan = build_traversal_plan(mytree);
+    if (mytree->plan == NULL) {
+        fprintf(stderr, "Not enough memory to store the tree traversal.\n");
+        free_tree(mytree);
+        return NULL;
+    }
+    name_simulation_nodes(mytree);
 
     return mytree;
 }
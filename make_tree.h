@@ -7,6 +7,12 @@
 
 #include "pastml.h"
 
-Tree *complete_parse_nh(char *big_string, size_t nbanno);
+void free_tree(Tree *tree);
+void name_simulation_nodes(Tree *t);
+Tree *complete_parse_nh(const char *nh_string, size_t length, const AnalysisContext *context);
+const char *find_nh_tree_end(const char *pos, const char *end);
+Tree *make_tree_from_parents(int nb_nodes, const int *parents, const double *branch_lengths,
+                             const char *const *names, const AnalysisContext *context);
+void log_tree_statistics(const Tree *t, int max_children, const AnalysisContext *context);
 
 #endif //PASTML_MAKE_TREE_H
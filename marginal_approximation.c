@@ -4,42 +4,44 @@
 
 
 void
-order_marginal(Tree* tree, size_t num_annotations)
+order_marginal(Tree* tree, Arena *arena, size_t num_annotations)
 {
     /**
      * Recursively sets node's marginal field to marginal state probabilities in decreasing order,
      * and node's tmp_best field to the corresponding state indices.
      */
     size_t i, k;
-    Node* nd;
+    double *marginal;
+    size_t *best_states;
     size_t * indices = malloc(num_annotations * sizeof(size_t));
     for (i = 0; i < num_annotations; i++) {
         indices[i] = i;
     }
 
     for (k = 0; k < tree->nb_nodes; k++) {
-        nd = tree->nodes[k];
-        /* put index array in the nd->best_states
+        marginal = NODE_VECTOR(arena, marginal, tree->nodes[k]->id);
+        best_states = NODE_VECTOR(arena, best_states, tree->nodes[k]->id);
+        /* put index array in the best_states
          * and sort it by marginal probabilities in marginal array, in decreasing order */
-        memcpy(nd->best_states, indices, num_annotations * sizeof(size_t));
+        memcpy(best_states, indices, num_annotations * sizeof(size_t));
         int cmp_index(const void *a, const void *b) {
             size_t ia = *(size_t *) a;
             size_t ib = *(size_t *) b;
-            return -(nd->marginal[ia] < nd->marginal[ib] ? -1 : nd->marginal[ia] > nd->marginal[ib]);
+            return -(marginal[ia] < marginal[ib] ? -1 : marginal[ia] > marginal[ib]);
         }
-        qsort(nd->best_states, num_annotations, sizeof(size_t), cmp_index);
+        qsort(best_states, num_annotations, sizeof(size_t), cmp_index);
 
         int cmp_value(const void *a, const void *b) {
             double da = *(double *) a;
             double db = *(double *) b;
             return -(da < db ? -1 : da > db);
         }
-        qsort(nd->marginal, num_annotations, sizeof(double), cmp_value);
+        qsort(marginal, num_annotations, sizeof(double), cmp_value);
     }
     free(indices);
 }
 
-void calc_correct(Tree *tree, size_t n) {
+void calc_correct(Tree *tree, Arena *arena, size_t n) {
     /**
      * Chooses an optimal number of non-zero probabilities to keep, and sets all of them to be equal.
      */
@@ -47,9 +49,11 @@ void calc_correct(Tree *tree, size_t n) {
     size_t i, j, k, best_num_states;
     double smallest_correction, correction_i, equal_p_i;
     Node* nd;
+    double *marginal;
 
     for (k = 0; k < tree->nb_nodes; k++) {
         nd = tree->nodes[k];
+        marginal = NODE_VECTOR(arena, marginal, nd->id);
         smallest_correction = INFINITY;
         best_num_states = n;
         /* local fraction optimisation */
@@ -61,32 +65,32 @@ void calc_correct(Tree *tree, size_t n) {
             equal_p_i = 1.0 / ((double) i + 1.0);
             for (j = 0; j < n; j++) {
                 if (j <= i) {
-                    correction_i += pow(nd->marginal[j] - equal_p_i, 2);
+                    correction_i += pow(marginal[j] - equal_p_i, 2);
                 } else {
-                    correction_i += pow(nd->marginal[j], 2);
+                    correction_i += pow(marginal[j], 2);
                 }
             }
             if (smallest_correction > correction_i) {
                 smallest_correction = correction_i;
                 best_num_states = i + 1;
-                nd->ma_state = best_num_states;
+                arena->ma_state[nd->id] = best_num_states;
             }
         }
         equal_p_i = 1.0 / ((double) best_num_states);
         for (i = 0; i < n; i++) {
-            nd->marginal[i] = (i < best_num_states) ? equal_p_i : 0.0;
+            marginal[i] = (i < best_num_states) ? equal_p_i : 0.0;
         }
     }
 }
 
-void choose_likely_states(Tree *tree, size_t n) {
+void choose_likely_states(Tree *tree, Arena *arena, size_t n) {
     /**
      * Chooses an optimal number of non-zero probabilities to keep, and sets all of them to be equal.
      */
 
     // order marginal probabilities
-    order_marginal(tree, n);
+    order_marginal(tree, arena, n);
 
     //choose the most likely states to keep among those with non-zero probabilities
-    calc_correct(tree, n);
+    calc_correct(tree, arena, n);
 }
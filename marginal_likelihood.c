@@ -1,11 +1,43 @@
+#include <errno.h>
 #include "pastml.h"
 #include "scaling.h"
 #include "likelihood.h"
+#include "kernels.h"
 
-extern SIMULATION;
+static void multiply_vectors(const double *left, const double *right, double *product, size_t num_annotations) {
+    /**
+     * product = left * right (element-wise), upscaled if needed.
+     * The scaling factors are the same for all the states, and are not kept,
+     * as only the relative values of the up-likelihoods matter for the marginal probabilities.
+     */
+    size_t j;
+    for (j = 0; j < num_annotations; j++) {
+        product[j] = left[j] * right[j];
+    }
+    upscale_node_probs(product, num_annotations);
+}
+
+static void multiply_suffixes(const double *messages, double *suffixes, int nb_children, size_t stride,
+                              size_t num_annotations) {
+    /**
+     * suffixes[c] = the product of the messages of the children c + 1, .., nb_children - 1, upscaled if needed.
+     */
+    int c;
+    size_t j;
+    for (j = 0; j < num_annotations; j++) {
+        suffixes[(nb_children - 1) * stride + j] = 1.0;
+    }
+    for (c = nb_children - 2; c >= 0; c--) {
+        multiply_vectors(suffixes + (c + 1) * stride, messages + (c + 1) * stride, suffixes + c * stride,
+                         num_annotations);
+    }
+}
 
-int *calculate_top_down_likelihoods(const Node *nd, const Node *root, size_t num_annotations, double *frequencies) {
+void calculate_top_down_likelihoods(Arena *arena, const TraversalPlan *plan, int father_id, int root_id,
+                                    size_t num_annotations, const double *frequencies, double *workspace) {
     /**
+     * Calculates the up-likelihoods of all the children of the given (already processed) node.
+     *
      * The up-likelihood of a given node is computed based on the information
      * coming from all the tips that are not descending from the studied node
      * and contained in the “up-subtree” of that node.
@@ -26,152 +58,187 @@ int *calculate_top_down_likelihoods(const Node *nd, const Node *root, size_t num
      * and N1 and N2 (y → x, in branch(N2)).
      *
      * We calculate up-likelihoods for N3 in same manner.
+     *
+     * The message of each child to the father, \sum_k( P(j->k, dist(child)) Ldown(child=k) ),
+     * is calculated once, in workspace, and reused for all its siblings:
+     * this takes O(num_annotations^2) per child (O(num_annotations) for F81 and JC) instead of O(num_annotations^3).
+     * The product of the messages of all the siblings but one is then combined from
+     * the product of the messages before it (prefix) and after it (suffix),
+     * so that a polytomy of d children takes O(d) vector products instead of O(d^2).
+     * The workspace must hold 2 * (number of children + 1) arena vectors, followed by (number of children) doubles.
      */
-    Node *father = nd->neigh[0];
-    Node *other_child;
-    int my_id = -1;
-    int father_scaling_factors[num_annotations];
-    int *scaling_factors = calloc(num_annotations, sizeof(int));
-    double prob_father[num_annotations];
+    const int *children = plan->children + plan->child_offset[father_id];
+    int nb_children = plan->child_offset[father_id + 1] - plan->child_offset[father_id];
+    double *prob_father = workspace;
+    double *prefix = workspace + arena->stride;
+    double *messages = prefix + arena->stride;
+    double *suffixes = messages + nb_children * arena->stride;
+    const double *father_top_down_likelihood = NODE_VECTOR(arena, top_down_likelihood, father_id);
+    const double *other_child_bottom_up_likelihood, *pij;
+    double *top_down_likelihood;
     double mu = get_mu(frequencies, num_annotations);
-    int child_id, j, i, k;
+    double exp_mu_t, sum, length, *lengths;
+    int c, other, l, nb_lengths;
+    size_t i, j;
+
+    if (father_id == root_id) {
+        /* we ignore the root and consider the tree as unrooted,
+         * therefore the other_child becomes the parent of our nd:
+         * L_up(nd=i|D, params) = \prod_other_child \sum_j( L_down(other_child=j) P(j->i, dist(nd) + dist(other_child)) ),
+         * where P follows from exp(-mu t) as for F81, see get_pij.
+         * The factor of other_child depends on dist(nd) too, so it is not a message shared by all the siblings:
+         * the children are grouped by their branch length, and for each group the factors of all the children
+         * are calculated once and combined with the prefix and suffix products as below.
+         * A root of d children with k different branch lengths takes O(d k) vector products
+         * (O(d) when they all have the same one), the lengths already grouped being kept after the suffixes.
+         */
+        lengths = suffixes + nb_children * arena->stride;
+        nb_lengths = 0;
+        for (c = 0; c < nb_children; c++) {
+            length = arena->branch_len[children[c]];
+            for (l = 0; l < nb_lengths && lengths[l] != length; l++);
+            if (l < nb_lengths) {
+                continue;
+            }
+            lengths[nb_lengths++] = length;
+
+            for (other = 0; other < nb_children; other++) {
+                other_child_bottom_up_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, children[other]);
+                exp_mu_t = exp(-mu * (length + arena->branch_len[children[other]]));
+                sum = 0.0;
+                for (j = 0; j < num_annotations; j++) {
+                    sum += other_child_bottom_up_likelihood[j];
+                }
+                sum *= 1.0 - exp_mu_t;
+                for (i = 0; i < num_annotations; i++) {
+                    messages[other * arena->stride + i] = frequencies[i] * sum
+                                                          + exp_mu_t * other_child_bottom_up_likelihood[i];
+                }
+            }
+            multiply_suffixes(messages, suffixes, nb_children, arena->stride, num_annotations);
 
-    for (child_id = 0; child_id < father->nb_neigh; child_id++) {
-        if (father->neigh[child_id] == nd) {
-            my_id = child_id;
+            /* the children before c have other lengths, but their factors still go to the prefix */
+            for (i = 0; i < num_annotations; i++) {
+                prefix[i] = 1.0;
+            }
+            for (other = 0; other < nb_children; other++) {
+                if (other >= c && arena->branch_len[children[other]] == length) {
+                    multiply_vectors(prefix, suffixes + other * arena->stride,
+                                     NODE_VECTOR(arena, top_down_likelihood, children[other]), num_annotations);
+                }
+                if (other + 1 < nb_children) {
+                    multiply_vectors(prefix, messages + other * arena->stride, prefix, num_annotations);
+                }
+            }
         }
+        return;
     }
-    // current node has annotation i
-    for (i = 0; i < num_annotations; i++) {
-        scaling_factors[i] = 0;
 
-        if (father == root) {
-            nd->top_down_likelihood[i] = 1.0;
-            /* as our tree is rooted, there will be just one other child */
-            for (child_id = 0; child_id < father->nb_neigh; child_id++) {
-                if (child_id != my_id) {
-                    other_child = father->neigh[child_id];
-                    /* we ignore the root and consider the tree as unrooted,
-                     * therefore the other_child becomes the parent of our nd:
-                     * L_up(nd=i|D, params) = \sum_j( L_down(other_child=j) P(j->i, dist(nd) + dist(other_child)) )
-                     */
-                    double prob_up_i = 0.0;
-                    for (j = 0; j < num_annotations; j++) {
-                        prob_up_i += other_child->bottom_up_likelihood[j]
-                                     * get_pij(frequencies, mu, nd->branch_len + other_child->branch_len, j, i);
-                    }
-                    nd->top_down_likelihood[i] *= prob_up_i;
-                }
+    /* the message of each child: P(j->state(child), dist(child)),
+     * which is 1 for the subtrees with missing data only (see mark_missing_data) */
+    for (c = 0; c < nb_children; c++) {
+        if (arena->tip_state[children[c]] == num_annotations) {
+            for (j = 0; j < num_annotations; j++) {
+                messages[c * arena->stride + j] = 1.0;
             }
+        } else if (arena->f81) {
+            multiply_by_f81_child(arena->branch_exp[children[c]], frequencies,
+                                  NODE_VECTOR(arena, bottom_up_likelihood, children[c]),
+                                  messages + c * arena->stride, num_annotations, TRUE);
         } else {
-            nd->top_down_likelihood[i] = 0.0;
-            /* we need to combine the up probability of our parent being in a state j
-             * with the probabilities of all its children (including nd) evolving from j.
-             * L_up(nd=i|D, params) =
-             * \sum_j( L_up(father=j) P(j->i, dist(nd)) P(j->state(other_child_1), dist(other_child_1) ...) )
-             */
+            multiply_by_child(BRANCH_PIJ(arena, children[c]), NODE_VECTOR(arena, bottom_up_likelihood, children[c]),
+                              messages + c * arena->stride, num_annotations, TRUE);
+        }
+    }
+    multiply_suffixes(messages, suffixes, nb_children, arena->stride, num_annotations);
+
+    /* prefix = the product of the up-likelihood of the father and of the messages of the children 0, .., c - 1 */
+    memcpy(prefix, father_top_down_likelihood, num_annotations * sizeof(double));
+
+    for (c = 0; c < nb_children; c++) {
+        /* the up probability of our parent being in a state j, combined with the probabilities
+         * of all its other children evolving from j:
+         * L_up(father=j) P(j->state(other_child_1), dist(other_child_1) ...)
+         */
+        multiply_vectors(prefix, suffixes + c * arena->stride, prob_father, num_annotations);
+        if (c + 1 < nb_children) {
+            multiply_vectors(prefix, messages + c * arena->stride, prefix, num_annotations);
+        }
+
+        /* L_up(nd=i|D, params) = \sum_j( L_up(father=j) P(j->i, dist(nd)) P(j->state(other_child_1), dist(other_child_1) ...) ) */
+        top_down_likelihood = NODE_VECTOR(arena, top_down_likelihood, children[c]);
+        if (arena->f81) {
+            exp_mu_t = arena->branch_exp[children[c]];
+            sum = 0.0;
             for (j = 0; j < num_annotations; j++) {
-                prob_father[j] = nd->pij[j][i] * father->top_down_likelihood[j];
-                father_scaling_factors[j] = 0;
-                // as our father is not root, its first nb_neigh is our grandfather,
-                // and we should iterate over children staring from 1
-                for (child_id = 1; child_id < father->nb_neigh; child_id++) {
-                    if (child_id != my_id) {
-                        other_child = father->neigh[child_id];
-                        double other_child_prob = 0.0;
-                        for (k = 0; k < num_annotations; k++) {
-                            other_child_prob += other_child->pij[j][k] * other_child->bottom_up_likelihood[k];
-                        }
-                        prob_father[j] *= other_child_prob;
-                    }
-                    if (prob_father[j] < LIM_P) {
-                        int curr_scaler_pow1 = get_scaling_pow(prob_father[j]);
-                        father_scaling_factors[j] += curr_scaler_pow1;
-                        rescale(prob_father, j, curr_scaler_pow1);
-                    }
-                }
+                sum += prob_father[j];
+            }
+            sum *= 1.0 - exp_mu_t;
+            for (i = 0; i < num_annotations; i++) {
+                top_down_likelihood[i] = frequencies[i] * sum + exp_mu_t * prob_father[i];
+            }
+        } else {
+            pij = BRANCH_PIJ(arena, children[c]);
+            for (i = 0; i < num_annotations; i++) {
+                top_down_likelihood[i] = 0.0;
             }
-            int max_father_factor = get_max(father_scaling_factors, num_annotations);
             for (j = 0; j < num_annotations; j++) {
-                int curr_scaler_pow = max_father_factor - father_scaling_factors[j];
-                if (curr_scaler_pow != 0) {
-                    rescale(prob_father, j, curr_scaler_pow);
+                for (i = 0; i < num_annotations; i++) {
+                    top_down_likelihood[i] += pij[j * num_annotations + i] * prob_father[j];
                 }
-                nd->top_down_likelihood[i] += prob_father[j];
             }
-            scaling_factors[i] = max_father_factor;
         }
     }
-    return scaling_factors;
 }
 
-void calculate_node_marginal_probabilities(Node *nd, Node *root, size_t num_annotations, double *frequency) {
+void calculate_node_marginal_probabilities(Arena *arena, const Node *nd, const Node *root, size_t num_annotations,
+                                           const double *frequency) {
     /**
-     * The up-likelihood of a given node is computed based on the information
-     * coming from all the tips that are not descending from the studied node
-     * and contained in the “up-subtree” of that node.
-     *
-     *
-     * For example, in a rooted tree ((T1, (T2, T3)N2)N1, (T4, T5)N3)ROOT;
-     * to compute the up-likelihood of N1 = x,
-     * we consider substitutions from its parent node N3
-     * (note that we ignore the root and consider the tree as unrooted).
-     * We then multiply each down likelihoods of N3 = y
-     * by the probability of substitution from y to x during the time dist(N1) + dist(N3), and sum them.
-     *
-     * The up-likelihood of N2 having a certain state x can then be calculated
-     * by summing up-likelihoods of N1 having state y,
-     * multiplying each of them by the probability of substitutions among N1 and T1 (y → tip_state(T1), in branch(T3)),
-     * and N1 and N2 (y → x, in branch(N2)).
-     *
-     * We calculate up-likelihoods for N3 in same manner.
-     *
-     * Finally, the marginal likelihood of a certain state can be computed by multiplying its up- and down-likelihoods,
+     * The marginal likelihood of a certain state can be computed by multiplying its up- and down-likelihoods,
      * and its prior probability (frequency).
+     * The up-likelihood of the node must have been calculated (see calculate_top_down_likelihoods).
      */
     int i;
-    int curr_scaler_pow, max_factor;
+    double *marginal = NODE_VECTOR(arena, marginal, nd->id);
+    const double *top_down_likelihood = NODE_VECTOR(arena, top_down_likelihood, nd->id);
+    const double *bottom_up_likelihood = NODE_VECTOR(arena, bottom_up_likelihood, nd->id);
 
     if (nd == root) {
-        memcpy((void *) nd->marginal, (void *) nd->bottom_up_likelihood, num_annotations * sizeof(double));
+        memcpy((void *) marginal, (void *) bottom_up_likelihood, num_annotations * sizeof(double));
     } else {
-        int *tmp_factor = calculate_top_down_likelihoods(nd, root, num_annotations, frequency);
-        max_factor = get_max(tmp_factor, num_annotations);
-        for (i = 0; i < num_annotations; i++) {
-            curr_scaler_pow = max_factor - tmp_factor[i];
-            if (curr_scaler_pow != 0) {
-                rescale(nd->top_down_likelihood, i, curr_scaler_pow);
-            }
-        }
-        free(tmp_factor);
-
         // Finally, the marginal likelihood of a certain state can be computed
         // by multiplying its up-, down-likelihoods, and its frequency.
-	double s=0.0;
         for (i = 0; i < num_annotations; i++) {
-            nd->marginal[i] = nd->top_down_likelihood[i] * nd->bottom_up_likelihood[i] * frequency[i];
-	    s+=nd->marginal[i];
+            marginal[i] = top_down_likelihood[i] * bottom_up_likelihood[i] * frequency[i];
         }
-	printf("%f\n",log(s));
-    }
-    normalize(nd->marginal, num_annotations);
-    if(SIMULATION == TRUE) {
-        for (i = 0; i < num_annotations; i++) {
-            nd->sim_marginal_prob[i] = nd->marginal[i];
-        }
-    }
-
-    // recursively calculate marginal probabilities for the children
-    for (i = (nd == root) ? 0 : 1; i < nd->nb_neigh; i++) {
-        calculate_node_marginal_probabilities(nd->neigh[i], root, num_annotations, frequency);
     }
+    normalize(marginal, num_annotations);
 }
 
-void calculate_marginal_probabilities(Tree *s_tree, size_t num_annotations, double *frequency) {
+int calculate_marginal_probabilities(Tree *s_tree, Arena *arena, size_t num_annotations, double *frequency) {
     /**
-     * Calculates marginal probabilities of tree nodes.
+     * Calculates marginal probabilities of tree nodes,
+     * visiting them in pre-order, so that each node comes after its parent,
+     * and calculating the up-likelihoods of the children of each node once its own are known.
      */
-    calculate_node_marginal_probabilities(s_tree->root, s_tree->root, num_annotations, frequency);
-}
-
+    const TraversalPlan *plan = s_tree->plan;
+    int i, id, max_children = 0;
+    double *workspace;
 
+    for (id = 0; id < plan->nb_nodes; id++) {
+        max_children = MAX(max_children, plan->child_offset[id + 1] - plan->child_offset[id]);
+    }
+    workspace = malloc((2 * (max_children + 1) * arena->stride + max_children) * sizeof(double));
+    if (workspace == NULL) {
+        return ENOMEM;
+    }
+    for (i = 0; i < plan->nb_nodes; i++) {
+        id = plan->pre_order[i];
+        calculate_node_marginal_probabilities(arena, s_tree->nodes[id], s_tree->root, num_annotations, frequency);
+        if (plan->child_offset[id + 1] > plan->child_offset[id]) {
+            calculate_top_down_likelihoods(arena, plan, id, s_tree->root->id, num_annotations, frequency, workspace);
+        }
+    }
+    free(workspace);
+    return EXIT_SUCCESS;
+}
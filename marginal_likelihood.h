@@ -7,6 +7,6 @@
 
 #include "pastml.h"
 
-void calculate_marginal_probabilities(Tree *s_tree, size_t num_annotations, double *frequency);
+int calculate_marginal_probabilities(Tree *s_tree, Arena *arena, size_t num_annotations, double *frequency);
 
 #endif //PASTML_MARGINAL_LIK_H_H
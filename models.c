@@ -1,14 +1,21 @@
+#include <errno.h>
+#include <pthread.h>
 #include "pastml.h"
 #include "logger.h"
+#include "eigen.h"
 
 #define NUM_AA 20
 #define SQNUM_AA 400
 #define CUNUM_AA 8000
 #define NUM_AA_REL_RATES 190
 
-double aaFreq[NUM_AA];
-double aaRelativeRate[NUM_AA_REL_RATES];
+/* the JTT rate matrix and its eigensystem, set up once for all the analyses of the process (see SetupJTTMatrix) */
+static double aaFreq[NUM_AA];
+static double aaRelativeRate[NUM_AA_REL_RATES];
 static double Qij[SQNUM_AA], Cijk[CUNUM_AA], Root[NUM_AA];
+static pthread_once_t jtt_matrix_once = PTHREAD_ONCE_INIT;
+
+static const char *model_names[] = {"JC", "F81", "HKY", "JTT"};
 
 static double jttRelativeRates[NUM_AA_REL_RATES] = {
 	0.531678, 0.557967, 0.827445, 0.574478, 0.556725, 1.066681, 1.740159, 0.219970, 0.361684, 0.310007, 0.369437, 0.469395, 0.138293, 1.959599, 3.887095, 4.582565, 0.084329, 0.139492, 2.924161,
@@ -36,13 +43,53 @@ static double jttFrequencies[NUM_AA] = {
 	0.076862, 0.051057, 0.042546, 0.051269, 0.020279, 0.041061, 0.061820, 0.074714, 0.022983, 0.052569, 0.091111, 0.059498, 0.023414, 0.040530, 0.050532, 0.068225, 0.058518, 0.014336, 0.032303, 0.066374
 };
 
-void exchange_params(size_t *num_annotations, size_t *num_tips, int *states, char **character, char *model, double *parameters) {
+int parse_model(const char *name, Model *model) {
+    /**
+     * Sets the model of the given name (JC, F81, HKY or JTT), or returns EINVAL if there is no such model.
+     */
+    int i;
+    for (i = 0; i < (int) (sizeof(model_names) / sizeof(model_names[0])); i++) {
+        if (strcmp(name, model_names[i]) == 0) {
+            *model = (Model) i;
+            return EXIT_SUCCESS;
+        }
+    }
+    return EINVAL;
+}
+
+const char *get_model_name(Model model) {
+    return model_names[model];
+}
+
+void set_model_frequencies(Model model, double *frequencies) {
+    /**
+     * Sets the fixed state frequencies of HKY (in the order TCAG) or JTT (in the order ARNDCQEGHILKMFPSTWYV).
+     */
+    size_t i;
+    if (model == MODEL_HKY) {
+        frequencies[0] = 0.1;
+        frequencies[1] = 0.4;
+        frequencies[2] = 0.2;
+        frequencies[3] = 0.3;
+    } else if (model == MODEL_JTT) {
+        for (i = 0; i < NUM_AA; i++) {
+            frequencies[i] = jttFrequencies[i];
+        }
+    }
+}
+
+void exchange_params(size_t num_annotations, size_t num_tips, int *states, char **character, double *parameters,
+                     const AnalysisContext *context) {
   size_t i;
 
 
-  if(strcmp(model,"HKY")==0){
+  if(context->model == MODEL_HKY){
     /*put 4 characters in this order : TCAG*/
     for(i=0;i<num_tips;i++){
+       if(states[i] == -1){
+         /* missing data */
+         continue;
+       }
        if(strcmp(character[states[i]], "T")==0){
          states[i]=0;
        } else if(strcmp(character[states[i]], "C")==0){
@@ -53,20 +100,21 @@ void exchange_params(size_t *num_annotations, size_t *num_tips, int *states, cha
          states[i]=3;
        }
     }
-    strcpy(character[0],"T");
-    strcpy(character[1],"C");
-    strcpy(character[2],"A");
-    strcpy(character[3],"G");
+    character[0] = "T";
+    character[1] = "C";
+    character[2] = "A";
+    character[3] = "G";
     /*put same frequencies with the simulation*/
-    parameters[0]=0.1;
-    parameters[1]=0.4;
-    parameters[2]=0.2;
-    parameters[3]=0.3;
+    set_model_frequencies(context->model, parameters);
   }
 
-  if(strcmp(model,"JTT")==0){
+  if(context->model == MODEL_JTT){
     /*put 20 characters in this order : ARNDCQEGHILKMFPSTWYV*/
     for(i=0;i<num_tips;i++){
+       if(states[i] == -1){
+         /* missing data */
+         continue;
+       }
        if(strcmp(character[states[i]], "A")==0){
          states[i]=0;
        } else if(strcmp(character[states[i]], "R")==0){
@@ -109,35 +157,35 @@ void exchange_params(size_t *num_annotations, size_t *num_tips, int *states, cha
          states[i]=19;
        }
     }
-    strcpy(character[0],"A");
-    strcpy(character[1],"R");
-    strcpy(character[2],"N");
-    strcpy(character[3],"D");
-    strcpy(character[4],"C");
-    strcpy(character[5],"Q");
-    strcpy(character[6],"E");
-    strcpy(character[7],"G");
-    strcpy(character[8],"H");
-    strcpy(character[9],"I");
-    strcpy(character[10],"L");
-    strcpy(character[11],"K");
-    strcpy(character[12],"M");
-    strcpy(character[13],"F");
-    strcpy(character[14],"P");
-    strcpy(character[15],"S");
-    strcpy(character[16],"T");
-    strcpy(character[17],"W");
-    strcpy(character[18],"Y");
-    strcpy(character[19],"V");
+    character[0] = "A";
+    character[1] = "R";
+    character[2] = "N";
+    character[3] = "D";
+    character[4] = "C";
+    character[5] = "Q";
+    character[6] = "E";
+    character[7] = "G";
+    character[8] = "H";
+    character[9] = "I";
+    character[10] = "L";
+    character[11] = "K";
+    character[12] = "M";
+    character[13] = "F";
+    character[14] = "P";
+    character[15] = "S";
+    character[16] = "T";
+    character[17] = "W";
+    character[18] = "Y";
+    character[19] = "V";
     /*and re-order frequencies*/
-    for(i=0;i<num_annotations;i++) parameters[i] = jttFrequencies[i];
+    set_model_frequencies(context->model, parameters);
   }
-  printf("RE-ORDERED CHARACTERS AND FREQUENCIES :\n\n");
-  for(i=0;i<num_annotations;i++) printf("\t%s:\t%lf\n",character[i],parameters[i]);
-  printf("\n");
+  log_info(context, "RE-ORDERED CHARACTERS AND FREQUENCIES :\n\n");
+  for(i=0;i<num_annotations;i++) log_info(context, "\t%s:\t%lf\n",character[i],parameters[i]);
+  log_info(context, "\n");
 }
 
-void SetRelativeRates(double *inRelativeRate) 
+static void SetRelativeRates(double *inRelativeRate) 
 {
 	int i;
 	for (i=0; i<NUM_AA_REL_RATES; i++) {
@@ -145,7 +193,7 @@ void SetRelativeRates(double *inRelativeRate)
 	}
 }
 
-void SetFrequencies(double *inFrequencies)
+static void SetFrequencies(double *inFrequencies)
 {
 	int i;
 	for (i=0; i<NUM_AA; i++) {
@@ -153,8 +201,12 @@ void SetFrequencies(double *inFrequencies)
 	}
 }
 
-void SetupJTTMatrix()
+static void BuildJTTMatrix()
 {
+    /**
+     * Builds the JTT rate matrix and caches its eigensystem (Root and Cijk),
+     * so that P(t) = Cijk * exp{Root*t} can be evaluated for any branch without redoing the decomposition.
+     */
 	int i,j,k;
 	double mr;
 	double sum;
@@ -203,43 +255,50 @@ void SetupJTTMatrix()
    	}
 }
 
-void SetJTTMatrix(double *matrix, double len)
-{	
+void SetupJTTMatrix()
+{
+    /**
+     * Sets up the JTT eigensystem (see BuildJTTMatrix) once per process,
+     * whatever the number of analyses (and of their threads) asking for it.
+     */
+	pthread_once(&jtt_matrix_once, BuildJTTMatrix);
+}
+
+void get_pij_jtt(double *pij, double bl)
+{
+    /**
+     * Sets probabilities of substitution p[i][j] (stored as pij[i*NUM_AA+j]) for the JTT model,
+     * using the eigensystem cached by SetupJTTMatrix:
+     * P(t)ij = SUM Cijk * exp{Root*t}
+     */
 	int i,j,k;
 	double expt[NUM_AA];
-	double *P;
+	const double *C;
 
-        SetupJTTMatrix();	
-/* P(t)ij = SUM Cijk * exp{Root*t}
-*/
-	P=matrix;
-	if (len<1e-6) { 
+	SetupJTTMatrix();
+	if (bl<1e-6) {
 		for (i=0; i<NUM_AA; i++) {
 			for (j=0; j<NUM_AA; j++) {
-				if (i==j)
-					*P=1.0;
-				else 	
-					*P=0.0;
-				P++;
+				pij[i*NUM_AA+j] = (i==j) ? 1.0 : 0.0;
 			}
 		}
-		return; 
+		return;
 	}
 	for (k=1; k<NUM_AA; k++) {
-		expt[k]=exp(len*Root[k]);
-	}	
+		expt[k]=exp(bl*Root[k]);
+	}
 	for (i=0; i<NUM_AA; i++) {
 		for (j=0; j<NUM_AA; j++) {
-			(*P)=Cijk[i*SQNUM_AA+j*NUM_AA];
+			C=Cijk+i*SQNUM_AA+j*NUM_AA;
+			pij[i*NUM_AA+j]=C[0];
 			for (k=1; k<NUM_AA; k++) {
-				(*P)+=Cijk[i*SQNUM_AA+j*NUM_AA+k]*expt[k];
+				pij[i*NUM_AA+j]+=C[k]*expt[k];
 			}
-			P++;
 		}
 	}
 }
 
-void get_pij_hky(const Node *nd, size_t num_frequencies, const double *frequency, double bl) {
+void get_pij_hky(double *pij, size_t num_frequencies, const double *frequency, double bl) {
   size_t i,j;
   double ts=8.0, beta, freqTC, freqAG, mul, mul2, rig, lef;
 
@@ -254,88 +313,88 @@ void get_pij_hky(const Node *nd, size_t num_frequencies, const double *frequency
             lef=frequency[0]*(freqTC+(freqAG)*exp(mul))/(freqTC);
             mul2=mul*(1.0+(freqTC)*(ts-1.0));
             rig=frequency[1]/freqTC*exp(mul2);
-            nd->pij[i][j]=lef+rig;
+            pij[i*num_frequencies+j]=lef+rig;
         //T->C
           } else if (i==0&&j==1){
             mul=-1.0*bl*beta;
             lef=frequency[1]*(freqTC+(freqAG)*exp(mul))/(freqTC);
             mul2=mul*(1.0+(freqTC)*(ts-1.0));
             rig=frequency[1]/freqTC*exp(mul2);
-            nd->pij[i][j]=lef-rig;
+            pij[i*num_frequencies+j]=lef-rig;
         //T->A
           } else if (i==0&&j==2){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[2]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[2]*(1-exp(mul));
         //T->G
           } else if (i==0&&j==3){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[3]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[3]*(1-exp(mul));
         //C->T
           } else if (i==1&&j==0){
             mul=-1.0*bl*beta;
             lef=frequency[0]*(freqTC+(freqAG)*exp(mul))/(freqTC);
             mul2=mul*(1.0+(freqTC)*(ts-1.0));
             rig=frequency[0]/freqTC*exp(mul2);
-            nd->pij[i][j]=lef-rig;
+            pij[i*num_frequencies+j]=lef-rig;
         //C->C
           } else if (i==1&&j==1){
             mul=-1.0*bl*beta;
             lef=frequency[1]*(freqTC+(freqAG)*exp(mul))/(freqTC);
             mul2=mul*(1.0+(freqTC)*(ts-1.0));
             rig=frequency[0]/freqTC*exp(mul2);
-            nd->pij[i][j]=lef+rig;
+            pij[i*num_frequencies+j]=lef+rig;
         //C->A
           } else if (i==1&&j==2){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[2]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[2]*(1-exp(mul));
         //C->G
           } else if (i==1&&j==3){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[3]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[3]*(1-exp(mul));
         //A->T
           } else if (i==2&&j==0){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[0]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[0]*(1-exp(mul));
         //A->C
           } else if (i==2&&j==1){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[1]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[1]*(1-exp(mul));
         //A->A
           } else if (i==2&&j==2){
             mul=-1.0*bl*beta;
             lef=frequency[2]*(freqAG+(freqTC)*exp(mul))/(freqAG);
             mul2=mul*(1.0+(freqAG)*(ts-1.0));
             rig=frequency[3]/freqAG*exp(mul2);
-            nd->pij[i][j]=lef+rig;
+            pij[i*num_frequencies+j]=lef+rig;
         //A->G
           } else if (i==2&&j==3){
             mul=-1.0*bl*beta;
             lef=frequency[3]*(freqAG+(freqTC)*exp(mul))/(freqAG);
             mul2=mul*(1.0+(freqAG)*(ts-1.0));
             rig=frequency[3]/freqAG*exp(mul2);
-            nd->pij[i][j]=lef-rig;
+            pij[i*num_frequencies+j]=lef-rig;
         //G->T
           } else if (i==3&&j==0){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[0]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[0]*(1-exp(mul));
         //G->C
           } else if (i==3&&j==1){
             mul=-1.0*bl*beta;
-            nd->pij[i][j]=frequency[1]*(1-exp(mul));
+            pij[i*num_frequencies+j]=frequency[1]*(1-exp(mul));
         //G->A
           } else if (i==3&&j==2){
             mul=-1.0*bl*beta;
             lef=frequency[2]*(freqAG+(freqTC)*exp(mul))/(freqAG);
             mul2=mul*(1.0+(freqAG)*(ts-1.0));
             rig=frequency[2]/freqAG*exp(mul2);
-            nd->pij[i][j]=lef-rig;
+            pij[i*num_frequencies+j]=lef-rig;
         //G->G
           } else if (i==3&&j==3){
             mul=-1.0*bl*beta;
             lef=frequency[3]*(freqAG+(freqTC)*exp(mul))/(freqAG);
             mul2=mul*(1.0+(freqAG)*(ts-1.0));
             rig=frequency[2]/freqAG*exp(mul2);
-            nd->pij[i][j]=lef+rig;
+            pij[i*num_frequencies+j]=lef+rig;
           }
         }
        }
@@ -7,8 +7,13 @@
 
 #include "pastml.h"
 
-void exchange_params(size_t *num_annotations, size_t *num_tips, int *states, char **character, char *model, double *parameters);
-void SetJTTMatrix(double *matrix, double len);
-void get_pij_hky(const Node *nd, size_t num_frequencies, const double *frequencies, double bl);
+int parse_model(const char *name, Model *model);
+const char *get_model_name(Model model);
+void set_model_frequencies(Model model, double *frequencies);
+void exchange_params(size_t num_annotations, size_t num_tips, int *states, char **character, double *parameters,
+                     const AnalysisContext *context);
+void SetupJTTMatrix();
+void get_pij_jtt(double *pij, double bl);
+void get_pij_hky(double *pij, size_t num_frequencies, const double *frequencies, double bl);
 
 #endif //PASTML_MODEL_H
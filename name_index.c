@@ -0,0 +1,75 @@
+#include "name_index.h"
+
+size_t hash_name(const char *name) {
+    /* FNV-1a */
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 0x100000001B3ULL;
+    }
+    return (size_t) (hash ^ (hash >> 32));
+}
+
+NameIndex *new_name_index(size_t max_names) {
+    /**
+     * Allocates an empty index for up to max_names names.
+     */
+    size_t nb_slots = 16;
+    NameIndex *index = malloc(sizeof(NameIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+    while (nb_slots < 2 * max_names) {
+        nb_slots *= 2;
+    }
+    index->mask = nb_slots - 1;
+    index->nb_names = 0;
+    index->names = calloc(nb_slots, sizeof(char *));
+    index->indices = malloc(nb_slots * sizeof(size_t));
+    if (index->names == NULL || index->indices == NULL) {
+        free_name_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+void free_name_index(NameIndex *index) {
+    if (index == NULL) return;
+    free(index->names);
+    free(index->indices);
+    free(index);
+}
+
+size_t add_name(NameIndex *index, const char *name, size_t name_index) {
+    /**
+     * Adds the name with the given index, unless the name is already there.
+     * Returns the index of the name: the given one if it is new, the one it was first added with otherwise.
+     * The index must have been created for enough names (see new_name_index).
+     */
+    size_t slot = hash_name(name) & index->mask;
+
+    while (index->names[slot] != NULL) {
+        if (strcmp(index->names[slot], name) == 0) {
+            return index->indices[slot];
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    index->names[slot] = name;
+    index->indices[slot] = name_index;
+    index->nb_names++;
+    return name_index;
+}
+
+size_t find_name(const NameIndex *index, const char *name) {
+    /**
+     * Returns the index the name was added with, or NOT_INDEXED if it was not.
+     */
+    size_t slot = hash_name(name) & index->mask;
+
+    while (index->names[slot] != NULL) {
+        if (strcmp(index->names[slot], name) == 0) {
+            return index->indices[slot];
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return NOT_INDEXED;
+}
@@ -0,0 +1,12 @@
+#ifndef PASTML_NAME_INDEX_H
+#define PASTML_NAME_INDEX_H
+
+#include "pastml.h"
+
+NameIndex *new_name_index(size_t max_names);
+void free_name_index(NameIndex *index);
+size_t add_name(NameIndex *index, const char *name, size_t name_index);
+size_t find_name(const NameIndex *index, const char *name);
+size_t hash_name(const char *name);
+
+#endif //PASTML_NAME_INDEX_H
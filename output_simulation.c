@@ -2,37 +2,33 @@
 #include <errno.h>
 #include "pastml.h"
 
-void output_sim_node_states(Node *nd, Node *root, size_t num_annotations, char **character, FILE *outfile, size_t method_num, size_t first_child_index){
+void output_sim_node_states(Arena *arena, Node *nd, size_t num_annotations, char **character, FILE *outfile, size_t method_num){
   size_t i, k, tmp_map;
   double tmp_prob;
+  const double *sim_marginal_prob = NODE_VECTOR(arena, sim_marginal_prob, nd->id);
+  const size_t *best_states = NODE_VECTOR(arena, best_states, nd->id);
 
   if(nd->nb_neigh==1){
     return;
   }
 
-  first_child_index = (nd == root) ? 0 : 1;
-  
-  for(i=first_child_index; i<nd->nb_neigh; i++){
-    output_sim_node_states(nd->neigh[i], root, num_annotations, character, outfile, method_num, first_child_index);
-  }
-
   fprintf(outfile, "%s", nd->sim_name);
 
   if(method_num == 0){
     //OUTPUT_JOINT
-    fprintf(outfile, ",%s\n", character[nd->best_joint_state]);
+    fprintf(outfile, ",%s\n", character[arena->best_joint_state[nd->id]]);
   } else if (method_num == 1) {
     //OUTPUT_MARGINAL
     for (i = 0; i < num_annotations; i++) {
-      fprintf(outfile, ",%s=%.8f", character[i], nd->sim_marginal_prob[i]);
+      fprintf(outfile, ",%s=%.8f", character[i], sim_marginal_prob[i]);
     }
     fprintf(outfile, "\n");
   } else if (method_num == 2) {
     //OUTPUT_MAP
     tmp_prob=0.0;
     for (i = 0; i < num_annotations; i++) {
-       if(tmp_prob < nd->sim_marginal_prob[i]) {
-         tmp_prob = nd->sim_marginal_prob[i];
+       if(tmp_prob < sim_marginal_prob[i]) {
+         tmp_prob = sim_marginal_prob[i];
          tmp_map = i;
        }
     }
@@ -40,7 +36,7 @@ void output_sim_node_states(Node *nd, Node *root, size_t num_annotations, char *
   } else if (method_num == 3) {
     //OUTPUT_MARGINAL_APPROXIMATION
     for (i = 0; i < num_annotations; i++) {
-      if(i < nd->ma_state) fprintf(outfile, ",%s", character[nd->best_states[i]]);
+      if(i < arena->ma_state[nd->id]) fprintf(outfile, ",%s", character[best_states[i]]);
     }
     fprintf(outfile, "\n"); 
   }
@@ -51,7 +47,7 @@ void output_sim_node_states(Node *nd, Node *root, size_t num_annotations, char *
 
 
 
-int output_simulation(Tree *tree, size_t num_annotations, char **character, char *output_file_path, size_t method_num) {
+int output_simulation(Tree *tree, Arena *arena, size_t num_annotations, char **character, char *output_file_path, size_t method_num) {
     FILE* outfile = fopen(output_file_path, "w");
     if (!outfile) {
         fprintf(stderr, "Output file %s is impossible to access.", output_file_path);
@@ -59,7 +55,12 @@ int output_simulation(Tree *tree, size_t num_annotations, char **character, char
         fprintf(stderr, "Error opening the file: %s\n", strerror(errno));
         return ENOENT;
     }
-    output_sim_node_states(tree->root, tree->root, num_annotations, character, outfile, method_num, 0);
+    int k;
+    /* post-order, so that the children are written before their parents */
+    for (k = 0; k < tree->plan->nb_nodes; k++) {
+        output_sim_node_states(arena, tree->nodes[tree->plan->post_order[k]], num_annotations, character, outfile,
+                               method_num);
+    }
 
     fclose(outfile);
     return EXIT_SUCCESS;
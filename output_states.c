@@ -3,7 +3,8 @@
 #include "pastml.h"
 
 
-int output_state_ancestral_states(Tree *tree, size_t num_annotations, char **character, char *output_file_path) {
+int output_state_ancestral_states(Tree *tree, Arena *arena, size_t num_annotations, char **character,
+                                  char *output_file_path) {
     FILE* outfile = fopen(output_file_path, "w");
     if (!outfile) {
         fprintf(stderr, "Output annotation file %s is impossible to access.", output_file_path);
@@ -29,8 +30,8 @@ int output_state_ancestral_states(Tree *tree, size_t num_annotations, char **cha
 
         for (i = 0; i < num_annotations; i++) {
             for (j = 0; j < num_annotations; j++) {
-                if (strcmp(character[i], character[nd->best_states[j]]) == 0) {
-                    fprintf(outfile, ",%.5f", nd->marginal[j]);
+                if (strcmp(character[i], character[NODE_VECTOR(arena, best_states, nd->id)[j]]) == 0) {
+                    fprintf(outfile, ",%.5f", NODE_VECTOR(arena, marginal, nd->id)[j]);
                 }
             }
         }
@@ -7,6 +7,7 @@
 
 #include "pastml.h"
 
-int output_state_ancestral_states(Tree *tree, size_t num_annotations, char **character, char *output_file_path);
+int output_state_ancestral_states(Tree *tree, Arena *arena, size_t num_annotations, char **character,
+                                  char *output_file_path);
 
 #endif //PASTML_OUTPUT_STATES_H
@@ -11,7 +11,7 @@ int dir_a_to_b(Node *a, Node *b) {
     }
 } /* end dir_a_to_b */
 
-int write_subtree_to_stream(Node *node, Node *node_from, FILE *stream, double epsilon, double scaling) {
+int write_subtree_to_stream(Node *node, Node *node_from, FILE *stream, const double *branch_len) {
     int i, direction_to_exclude, n = node->nb_neigh;
     if (node_from == NULL) {
         return EXIT_SUCCESS;
@@ -28,23 +28,26 @@ int write_subtree_to_stream(Node *node, Node *node_from, FILE *stream, double ep
         /* we have to write (n-1) subtrees in total. The last print is not followed by a comma */
         for (i = 1; i < n - 1; i++) {
             if (EXIT_SUCCESS !=
-                write_subtree_to_stream(node->neigh[(direction_to_exclude + i) % n], node, stream, epsilon, scaling)) {
+                write_subtree_to_stream(node->neigh[(direction_to_exclude + i) % n], node, stream, branch_len)) {
                 return EXIT_FAILURE;
             } /* a son */
             putc(',', stream);
         }
-        if (EXIT_SUCCESS != write_subtree_to_stream(node->neigh[(direction_to_exclude + i) % n], node, stream, epsilon,
-                                                    scaling)) {
+        if (EXIT_SUCCESS != write_subtree_to_stream(node->neigh[(direction_to_exclude + i) % n], node, stream,
+                                                    branch_len)) {
             return EXIT_FAILURE;
         } /* last son */
         putc(')', stream);
     }
     // write node's name and dist to father
-    fprintf(stream, "%s:%f", (node->name ? node->name : ""), node->branch_len);
+    fprintf(stream, "%s:%f", (node->name ? node->name : ""), branch_len[node->id]);
     return EXIT_SUCCESS;
 } /* end write_subtree_to_stream */
 
-int write_nh_tree(Tree *s_tree, char *output_filepath, double epsilon, double scaling) {
+int write_nh_tree(Tree *s_tree, const double *branch_len, char *output_filepath) {
+    /**
+     * Writes the tree in newick format, with the given branch lengths (indexed by node id).
+     */
 
     FILE* output_file = fopen(output_filepath, "w");
     if (!output_file) {
@@ -58,12 +61,12 @@ int write_nh_tree(Tree *s_tree, char *output_filepath, double epsilon, double sc
     putc('(', output_file);
     for (i = 0; i < n - 1; i++) {
         if (EXIT_SUCCESS != write_subtree_to_stream(s_tree->root->neigh[i], s_tree->root,
-                                                    output_file, epsilon, scaling)) {
+                                                    output_file, branch_len)) {
             return EXIT_FAILURE;
         } /* a son */
         putc(',', output_file);
     }
-    if (EXIT_SUCCESS != write_subtree_to_stream(s_tree->root->neigh[i], s_tree->root, output_file, epsilon, scaling)) {
+    if (EXIT_SUCCESS != write_subtree_to_stream(s_tree->root->neigh[i], s_tree->root, output_file, branch_len)) {
         return EXIT_FAILURE;
     } /* last son */
     putc(')', output_file);
@@ -7,6 +7,6 @@
 
 #include "pastml.h"
 
-int write_nh_tree(Tree *s_tree, char *output_filepath, double epsilon, double scaling);
+int write_nh_tree(Tree *s_tree, const double *branch_len, char *output_filepath);
 
 #endif //PASTML_OUTPUT_TREE_H
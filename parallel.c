@@ -0,0 +1,325 @@
+#include "parallel.h"
+#include <pthread.h>
+#include <errno.h>
+
+/* One post-order pass over a tree, shared by the threads of the pool.
+ * Its tasks are either whole small subtrees (at most SERIAL_SUBTREE_SIZE nodes, whose parent is bigger),
+ * or single big nodes, which become ready once all their children are processed. */
+typedef struct __PostOrderJob {
+    const TraversalPlan *plan;
+    node_function process;
+    void *data;
+    int *queue;         /* ready tasks, by root id, each of them is queued once */
+    int head;
+    int tail;
+    int *pending;       /* number of unprocessed children of each big node */
+    int *factors;       /* scaling factors of each task, by root id */
+    int failed;
+    int done;
+} PostOrderJob;
+
+/* The workers of an analysis, started on its first post-order pass over a big enough tree. */
+struct __ThreadPool {
+    int threads;            /* including the thread that posts the jobs */
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;    /* a new job is posted, or the pool is shut down */
+    pthread_cond_t task_cond;   /* a task is queued, or the job is done */
+    pthread_cond_t idle_cond;   /* a worker has left the job */
+    pthread_t *workers;
+    int nb_workers;
+    int busy_workers;
+    unsigned long job_generation;
+    PostOrderJob *current_job;
+    int shutting_down;
+};
+
+int process_subtree(const TraversalPlan *plan, int id, node_function process, void *data) {
+    /**
+     * Processes the subtree of the given node in post-order, and returns the sum of its scaling factors,
+     * or -1 if one of its nodes failed.
+     */
+    int i, add_factors, factors = 0;
+    int last = plan->post_order_index[id];
+    for (i = last - plan->subtree_size[id] + 1; i <= last; i++) {
+        add_factors = process(plan->post_order[i], data);
+        if (add_factors == -1) {
+            return -1;
+        }
+        factors += add_factors;
+    }
+    return factors;
+}
+
+static int is_task(const TraversalPlan *plan, int id) {
+    int parent = plan->parent[id];
+    return plan->subtree_size[id] > SERIAL_SUBTREE_SIZE
+           || parent == -1 || plan->subtree_size[parent] > SERIAL_SUBTREE_SIZE;
+}
+
+static void work_on(ThreadPool *pool, PostOrderJob *job) {
+    /**
+     * Takes the tasks of the job from its queue until the job is done.
+     * Must be called with the pool mutex locked, returns with it locked.
+     */
+    const TraversalPlan *plan = job->plan;
+    int id, parent, factors, failed;
+
+    while (!job->done) {
+        if (job->head == job->tail) {
+            pthread_cond_wait(&pool->task_cond, &pool->mutex);
+            continue;
+        }
+        id = job->queue[job->head++];
+        failed = job->failed;
+        pthread_mutex_unlock(&pool->mutex);
+
+        /* once a task failed, the others are only drained to get to the root */
+        if (failed) {
+            factors = -1;
+        } else if (plan->subtree_size[id] > SERIAL_SUBTREE_SIZE) {
+            factors = job->process(id, job->data);
+        } else {
+            factors = process_subtree(plan, id, job->process, job->data);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        job->factors[id] = factors;
+        if (factors == -1) {
+            job->failed = TRUE;
+        }
+        parent = plan->parent[id];
+        if (parent == -1) {
+            job->done = TRUE;
+            pthread_cond_broadcast(&pool->task_cond);
+        } else if (--job->pending[parent] == 0) {
+            job->queue[job->tail++] = parent;
+            pthread_cond_signal(&pool->task_cond);
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    ThreadPool *pool = (ThreadPool *) arg;
+    unsigned long seen_generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (TRUE) {
+        while (!pool->shutting_down && (pool->current_job == NULL || pool->job_generation == seen_generation)) {
+            pthread_cond_wait(&pool->job_cond, &pool->mutex);
+        }
+        if (pool->shutting_down) {
+            break;
+        }
+        seen_generation = pool->job_generation;
+        work_on(pool, pool->current_job);
+        if (--pool->busy_workers == 0) {
+            pthread_cond_signal(&pool->idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+ThreadPool *new_thread_pool(int threads) {
+    /**
+     * Creates the pool of an analysis with the given number of threads (including the one posting the jobs),
+     * or returns NULL if there is only one, the passes being processed serially then.
+     * The workers are only started by the first pass that needs them.
+     */
+    ThreadPool *pool;
+    if (threads <= 1) {
+        return NULL;
+    }
+    pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = threads;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->task_cond, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+    return pool;
+}
+
+static int start_thread_pool(ThreadPool *pool) {
+    /**
+     * Starts threads - 1 workers (the calling thread is the last one), if not started yet.
+     * Must be called with the pool mutex locked. Returns the number of running workers.
+     */
+    if (pool->workers != NULL) {
+        return pool->nb_workers;
+    }
+    pool->workers = malloc((pool->threads - 1) * sizeof(pthread_t));
+    if (pool->workers == NULL) {
+        return 0;
+    }
+    pool->shutting_down = FALSE;
+    for (pool->nb_workers = 0; pool->nb_workers < pool->threads - 1; pool->nb_workers++) {
+        if (pthread_create(&pool->workers[pool->nb_workers], NULL, worker_main, pool) != 0) {
+            break;
+        }
+    }
+    return pool->nb_workers;
+}
+
+void free_thread_pool(ThreadPool *pool) {
+    int i;
+    if (pool == NULL) return;
+    if (pool->workers != NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->shutting_down = TRUE;
+        pthread_cond_broadcast(&pool->job_cond);
+        pthread_mutex_unlock(&pool->mutex);
+        for (i = 0; i < pool->nb_workers; i++) {
+            pthread_join(pool->workers[i], NULL);
+        }
+        free(pool->workers);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_cond_destroy(&pool->task_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool);
+}
+
+int process_post_order(ThreadPool *pool, const TraversalPlan *plan, node_function process, void *data) {
+    /**
+     * Processes all the nodes of the tree, each of them after its children, and returns the sum of their scaling factors,
+     * or -1 if one of the nodes failed.
+     *
+     * With a thread pool (not NULL) the independent subtrees are processed by its threads:
+     * the subtrees of at most SERIAL_SUBTREE_SIZE nodes as single tasks, the nodes above them one by one,
+     * as soon as their children are done.
+     * The scaling factors are summed up per task and then over the tasks in post-order,
+     * so that the result does not depend on which thread processed what.
+     */
+    int root = plan->post_order[plan->nb_nodes - 1];
+    int i, k, id, factors = 0;
+    PostOrderJob job;
+
+    if (pool == NULL || plan->subtree_size[root] <= SERIAL_SUBTREE_SIZE) {
+        return process_subtree(plan, root, process, data);
+    }
+
+    job.plan = plan;
+    job.process = process;
+    job.data = data;
+    job.head = 0;
+    job.tail = 0;
+    job.failed = FALSE;
+    job.done = FALSE;
+    job.queue = malloc(3 * plan->nb_nodes * sizeof(int));
+    if (job.queue == NULL) {
+        return process_subtree(plan, root, process, data);
+    }
+    job.pending = job.queue + plan->nb_nodes;
+    job.factors = job.pending + plan->nb_nodes;
+
+    /* small subtrees are ready straight away, big nodes wait for their children */
+    for (i = 0; i < plan->nb_nodes; i++) {
+        id = plan->pre_order[i];
+        if (plan->subtree_size[id] > SERIAL_SUBTREE_SIZE) {
+            job.pending[id] = plan->child_offset[id + 1] - plan->child_offset[id];
+        } else if (is_task(plan, id)) {
+            job.queue[job.tail++] = id;
+        }
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    /* the pool serves one pass at a time, the others (e.g. of characters analysed in parallel) are done serially */
+    if (pool->current_job != NULL || start_thread_pool(pool) == 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(job.queue);
+        return process_subtree(plan, root, process, data);
+    }
+    pool->current_job = &job;
+    pool->job_generation++;
+    pool->busy_workers = pool->nb_workers;
+    pthread_cond_broadcast(&pool->job_cond);
+    work_on(pool, &job);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->idle_cond, &pool->mutex);
+    }
+    pool->current_job = NULL;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (!job.failed) {
+        for (k = 0; k < plan->nb_nodes; k++) {
+            id = plan->post_order[k];
+            if (is_task(plan, id)) {
+                factors += job.factors[id];
+            }
+        }
+    }
+    free(job.queue);
+    return job.failed ? -1 : factors;
+}
+
+typedef struct __IndexJob {
+    size_t n;
+    size_t next;        /* the next index to be taken */
+    index_function process;
+    void *data;
+    int *results;
+    pthread_mutex_t mutex;
+} IndexJob;
+
+static void *index_worker(void *arg) {
+    IndexJob *job = (IndexJob *) arg;
+    size_t i;
+    while (TRUE) {
+        pthread_mutex_lock(&job->mutex);
+        i = job->next++;
+        pthread_mutex_unlock(&job->mutex);
+        if (i >= job->n) {
+            break;
+        }
+        job->results[i] = job->process(i, job->data);
+    }
+    return NULL;
+}
+
+int for_each_in_parallel(int max_threads, size_t n, index_function process, void *data) {
+    /**
+     * Calls process(i, data) for each i in 0, .., n - 1, on up to max_threads threads (including the calling one),
+     * each thread taking the next index once it is done with the previous one.
+     * Returns EXIT_SUCCESS if all the calls succeeded, otherwise the result of the first (by index) failed call.
+     */
+    IndexJob job;
+    pthread_t *threads;
+    size_t i, nb_threads = 0;
+    int exit_val = EXIT_SUCCESS;
+
+    job.n = n;
+    job.next = 0;
+    job.process = process;
+    job.data = data;
+    job.results = malloc(n * sizeof(int));
+    threads = malloc(MIN((size_t) max_threads, n) * sizeof(pthread_t));
+    if (job.results == NULL || threads == NULL) {
+        free(job.results);
+        free(threads);
+        return ENOMEM;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    while (nb_threads + 1 < MIN((size_t) max_threads, n)
+           && pthread_create(&threads[nb_threads], NULL, index_worker, &job) == 0) {
+        nb_threads++;
+    }
+    index_worker(&job);
+    for (i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.mutex);
+
+    for (i = 0; i < n; i++) {
+        if (job.results[i] != EXIT_SUCCESS) {
+            exit_val = job.results[i];
+            break;
+        }
+    }
+    free(job.results);
+    free(threads);
+    return exit_val;
+}
@@ -0,0 +1,21 @@
+#ifndef PASTML_PARALLEL_H
+#define PASTML_PARALLEL_H
+
+#include "pastml.h"
+
+/* subtrees of at most this many nodes are processed serially, as one task */
+#define SERIAL_SUBTREE_SIZE 256
+
+/* processes one node whose children are already processed, returns its scaling factors or -1 on failure */
+typedef int (*node_function)(int id, void *data);
+
+/* processes the i-th of several independent items, returns EXIT_SUCCESS or an error code */
+typedef int (*index_function)(size_t i, void *data);
+
+int process_subtree(const TraversalPlan *plan, int id, node_function process, void *data);
+ThreadPool *new_thread_pool(int threads);
+void free_thread_pool(ThreadPool *pool);
+int process_post_order(ThreadPool *pool, const TraversalPlan *plan, node_function process, void *data);
+int for_each_in_parallel(int max_threads, size_t n, index_function process, void *data);
+
+#endif //PASTML_PARALLEL_H
@@ -3,7 +3,7 @@
 #include "likelihood.h"
 #include "logger.h"
 
-#define GRADIENT_STEP 1.0e-7
+#define MIN_STEP_SIZE 1.0e-7
 
 double softmax(double* xs, size_t n) {
     /**
@@ -37,16 +37,16 @@ double anti_sigmoid(double x, const double lower_bound, const double upper_bound
 }
 
 void *get_likelihood_parameters(const gsl_vector *v, size_t num_annotations, double scale_low, double scale_up,
-                                double epsilon_low, double epsilon_up, double* cur_parameters, char* model) {
+                                double epsilon_low, double epsilon_up, double* cur_parameters, Model model) {
     size_t i;
-    if (strcmp("F81", model) == 0) {
+    if (model == MODEL_F81) {
         /* 1. Frequencies */
         for (i = 0; i < num_annotations; i++) {
             cur_parameters[i] = gsl_vector_get(v, i);
         }
         softmax(cur_parameters, num_annotations);
     }
-    size_t scaling_factor_index = (strcmp("F81", model) == 0) ? num_annotations: 0;
+    size_t scaling_factor_index = (model == MODEL_F81) ? num_annotations: 0;
     /* 2. Scaling factor */
     cur_parameters[num_annotations] = sigmoid(gsl_vector_get(v, scaling_factor_index), scale_low, scale_up);
 
@@ -55,7 +55,8 @@ void *get_likelihood_parameters(const gsl_vector *v, size_t num_annotations, dou
 }
 
 double
-minus_loglikelihood (const gsl_vector *v, void *params, double* cur_parameters, char* model, Tree* s_tree)
+minus_loglikelihood (const gsl_vector *v, void *params, double* cur_parameters, Model model, Tree* s_tree,
+                     Arena *arena)
 {
     /**
      * Calculates the -log likelihood value.
@@ -65,21 +66,27 @@ minus_loglikelihood (const gsl_vector *v, void *params, double* cur_parameters,
     double scale_low = p[1], scale_up = p[2], epsilon_low = p[3], epsilon_up = p[4];
     get_likelihood_parameters(v, num_annotations, scale_low, scale_up, epsilon_low, epsilon_up, cur_parameters, model);
 
-    return -calculate_bottom_up_likelihood(s_tree, num_annotations, cur_parameters);
+    return -calculate_bottom_up_likelihood(s_tree, arena, num_annotations, cur_parameters);
 }
 void
-d_minus_loglikelihood (gsl_vector *v, void *params, gsl_vector *df, double* cur_parameters,
-                       double cur_minus_log_likelihood, char* model, Tree* s_tree)
+d_minus_loglikelihood (const gsl_vector *v, void *params, gsl_vector *df, double* cur_parameters,
+                       double cur_minus_log_likelihood, Model model, Tree* s_tree, Arena *arena)
 {
     /** Fills in the gradient vector for each of the parameters.
      * parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon].
-     * cur_minus_log_likelihood in the given point can be pre-specified,
+     * cur_minus_log_likelihood in the given point can be pre-specified
+     * (then the bottom-up likelihoods in the arena must correspond to it),
      * otherwise should be put to a negative value to show that it needs recalculation.
+     *
+     * The derivatives by the parameters are calculated analytically (see calculate_log_likelihood_gradient),
+     * and then by the optimised variables via the softmax and sigmoid transformations:
+     * d\pi_k/dx_m = \pi_k (\delta_km - \pi_m), dsigmoid/dx = (sigmoid - lower) (upper - sigmoid) / (upper - lower).
      */
     double *p = (double *)params;
     size_t num_annotations = (size_t) p[0];
     double scale_low = p[1], scale_up = p[2], epsilon_low = p[3], epsilon_up = p[4];
-    double diff_log_likelihood;
+    double gradient[num_annotations + 2];
+    double weighted_sum = 0.0;
     size_t i;
 
     // if the cur_minus_log_likelihood is already given, let's not recalculate it
@@ -87,47 +94,47 @@ d_minus_loglikelihood (gsl_vector *v, void *params, gsl_vector *df, double* cur_
     if (cur_minus_log_likelihood < 0) {
         get_likelihood_parameters(v, num_annotations, scale_low, scale_up, epsilon_low, epsilon_up,
                                   cur_parameters, model);
-        cur_minus_log_likelihood = -calculate_bottom_up_likelihood(s_tree, num_annotations, cur_parameters);
+        calculate_bottom_up_likelihood(s_tree, arena, num_annotations, cur_parameters);
     }
+    calculate_log_likelihood_gradient(s_tree, arena, num_annotations, cur_parameters, gradient);
 
-    size_t n = (strcmp("F81", model) == 0) ? (num_annotations + 2): 2;
-    for (i = 0; i < n; i++) {
-        /* create a next_step_parameters array, where all the values but the i-th are the same as in parameters,
-         * and the i-th value is increased by the corresponding step.*/
-        if (i > 0) {
-            gsl_vector_set(v, i - 1, gsl_vector_get(v, i - 1) - GRADIENT_STEP);
+    size_t scaling_factor_index = (model == MODEL_F81) ? num_annotations: 0;
+    if (model == MODEL_F81) {
+        for (i = 0; i < num_annotations; i++) {
+            weighted_sum += cur_parameters[i] * gradient[i];
+        }
+        for (i = 0; i < num_annotations; i++) {
+            gsl_vector_set(df, i, -cur_parameters[i] * (gradient[i] - weighted_sum));
         }
-        gsl_vector_set(v, i, gsl_vector_get(v, i) + GRADIENT_STEP);
-        get_likelihood_parameters(v, num_annotations, scale_low, scale_up, epsilon_low, epsilon_up,
-                                  cur_parameters, model);
-
-        diff_log_likelihood = -calculate_bottom_up_likelihood(s_tree, num_annotations, cur_parameters)
-                              - cur_minus_log_likelihood;
-
-        /* calculate the gradients*/
-        gsl_vector_set(df, i, diff_log_likelihood / GRADIENT_STEP);
     }
-    gsl_vector_set(v, n - 1, gsl_vector_get(v, n - 1) - GRADIENT_STEP);
+    gsl_vector_set(df, scaling_factor_index, -gradient[num_annotations]
+                   * (cur_parameters[num_annotations] - scale_low) * (scale_up - cur_parameters[num_annotations])
+                   / (scale_up - scale_low));
+    gsl_vector_set(df, scaling_factor_index + 1, -gradient[num_annotations + 1]
+                   * (cur_parameters[num_annotations + 1] - epsilon_low)
+                   * (epsilon_up - cur_parameters[num_annotations + 1]) / (epsilon_up - epsilon_low));
 }
 
-double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters, char **character, char *model,
-                       double scale_low, double scale_up, double epsilon_low, double epsilon_up) {
+double minimize_params(Tree* s_tree, Arena *arena, size_t num_annotations, double *parameters, char **character,
+                       double scale_low, double scale_up, double epsilon_low, double epsilon_up,
+                       const AnalysisContext *context) {
     /**
      * Optimises the following parameters:
      * parameters = [frequency_char_1, .., frequency_char_n, scaling_factor, epsilon],
      * using BFGS algorithm.
-     * If model is JC, the frequences are not optimised.
+     * If the model of the context is JC, the frequences are not optimised.
      * The parameters variable is updated to contain the optimal parameters found.
      * The optimal value of the likelihood is returned.
      */
 
     size_t i, iter = 0;
     int status;
+    Model model = context->model;
 
-    log_info("Scaling factor can vary between %.10f and %.10f\n", scale_low, scale_up);
-    log_info("Epsilon can vary between %.e and %.e\n", epsilon_low, epsilon_up);
+    log_info(context, "Scaling factor can vary between %.10f and %.10f\n", scale_low, scale_up);
+    log_info(context, "Epsilon can vary between %.e and %.e\n", epsilon_low, epsilon_up);
 
-    size_t n = (size_t) ((strcmp("JC", model) == 0) ? 2 : (num_annotations + 2));
+    size_t n = (size_t) ((model == MODEL_JC) ? 2 : (num_annotations + 2));
 
     const gsl_multimin_fdfminimizer_type *T;
     gsl_multimin_fdfminimizer *s;
@@ -135,16 +142,16 @@ double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters,
     double par[5] = {(double) num_annotations, scale_low, scale_up, epsilon_low, epsilon_up};
 
     double my_f(const gsl_vector *v, void *params) {
-        return minus_loglikelihood(v, params, parameters, model, s_tree);
+        return minus_loglikelihood(v, params, parameters, model, s_tree, arena);
     }
 
     void my_df(const gsl_vector *v, void *params, gsl_vector *df) {
-        return d_minus_loglikelihood (v, params, df, parameters, -1, model, s_tree);
+        return d_minus_loglikelihood (v, params, df, parameters, -1, model, s_tree, arena);
     }
 
     void my_fdf(const gsl_vector *v, void *params, double *f, gsl_vector *df) {
-        *f = minus_loglikelihood(v, params, parameters, model, s_tree);
-        d_minus_loglikelihood (v, params, df, parameters, *f, model, s_tree);
+        *f = minus_loglikelihood(v, params, parameters, model, s_tree, arena);
+        d_minus_loglikelihood (v, params, df, parameters, *f, model, s_tree, arena);
     }
 
     gsl_vector *x;
@@ -157,7 +164,7 @@ double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters,
 
     /* Starting point */
     x = gsl_vector_alloc(n);
-    if (strcmp("F81", model) == 0) {
+    if (model == MODEL_F81) {
         for (i = 0; i < num_annotations; i++) {
             gsl_vector_set(x, i, log(parameters[i]));
         }
@@ -172,13 +179,13 @@ double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters,
     double tol = .1;
     gsl_multimin_fdfminimizer_set(s, &my_func, x, step_size, tol);
 
-    log_info ("\tstep\tlog-lh\t\t");
-    if (strcmp("F81", model) == 0) {
+    log_info(context, "\tstep\tlog-lh\t\t");
+    if (model == MODEL_F81) {
         for (i = 0; i < num_annotations; i++) {
-            log_info("%s\t", character[i]);
+            log_info(context, "%s\t", character[i]);
         }
     }
-    log_info ("scaling\tepsilon\n");
+    log_info(context, "scaling\tepsilon\n");
     double epsabs = 1e-3;
     do
     {
@@ -187,15 +194,15 @@ double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters,
 
         if (status) {
             // if the iteration is not making progress towards solution let's try to reduce the step size
-            if (GSL_ENOPROG == status && step_size > GRADIENT_STEP) {
+            if (GSL_ENOPROG == status && step_size > MIN_STEP_SIZE) {
                 step_size /= 10.0;
                 iter--;
                 status = GSL_CONTINUE;
                 gsl_multimin_fdfminimizer_set(s, &my_func, gsl_multimin_fdfminimizer_x(s), step_size, tol);
-                log_info("\t\t(decreased the step size to %.1e)\n", step_size);
+                log_info(context, "\t\t(decreased the step size to %.1e)\n", step_size);
                 continue;
             }
-            log_info("\t\t(stopping minimization as %s)\n", gsl_strerror(status));
+            log_info(context, "\t\t(stopping minimization as %s)\n", gsl_strerror(status));
             break;
         }
 
@@ -203,23 +210,24 @@ double minimize_params(Tree* s_tree, size_t num_annotations, double *parameters,
         get_likelihood_parameters(s->x, num_annotations, scale_low, scale_up, epsilon_low, epsilon_up, parameters,
                                   model);
 
-        log_info("\t%3zd\t%5.10f\t\t", iter, -s->f);
-        if (strcmp("F81", model) == 0) {
+        log_info(context, "\t%3zd\t%5.10f\t\t", iter, -s->f);
+        if (model == MODEL_F81) {
             for (i = 0; i < num_annotations; i++) {
-                log_info("%.10f\t", parameters[i]);
+                log_info(context, "%.10f\t", parameters[i]);
             }
         }
-        log_info("%.10f\t%e\n", parameters[num_annotations], parameters[num_annotations + 1]);
+        log_info(context, "%.10f\t%e\n", parameters[num_annotations], parameters[num_annotations + 1]);
 
         if (status == GSL_SUCCESS) {
             // let's adjust the tolerance to make sure we are at the minimum
             if (iter < 10 && epsabs > 1e-5) {
                 epsabs /= 10.0;
                 status = GSL_CONTINUE;
-                log_info("\t\t(found an optimum candidate, but to be sure decreased the gradient tolerance to %.1e)\n",
-                       epsabs);
+                log_info(context,
+                         "\t\t(found an optimum candidate, but to be sure decreased the gradient tolerance to %.1e)\n",
+                         epsabs);
             } else {
-                log_info("\t\t(optimum found!)\n");
+                log_info(context, "\t\t(optimum found!)\n");
             }
         }
     }
@@ -12,9 +12,8 @@
 
 
 #define MAXLNAME 255
-#define MAXNSP 50000
-#define MAX_TREELENGTH    10000000 /* more or less 10MB for a tree file in NH format */
 #define MAX_NAMELENGTH        255    /* max length of a taxon name */
+#define GENERATED_NAME_LENGTH 32    /* enough for "Pastml_Node_" (or "Node") followed by a node number */
 #define TRUE 1
 #define FALSE 0
 #define POW (-500)
@@ -22,6 +21,31 @@
 #define LOG2 0.69314718055994528623
 #define MIN(a, b) ((a)<(b)?(a):(b))
 #define MAX(a, b) ((a)>(b)?(a):(b))
+#define NO_TIP_STATE ((size_t) -1)
+#define NOT_INDEXED ((size_t) -1)
+
+typedef enum __Model {
+    MODEL_JC,
+    MODEL_F81,
+    MODEL_HKY,
+    MODEL_JTT
+} Model;
+
+/* Threads that process the post-order passes over the trees of an analysis, see parallel.c */
+typedef struct __ThreadPool ThreadPool;
+
+/* Everything an analysis depends on besides its input and output files: the model, the options,
+ * the thread pool and where to log, so that several analyses can run at the same time in one process,
+ * each with its own context (see runpastml). */
+typedef struct __AnalysisContext {
+    Model model;
+    int simulation;             /* TRUE to also output the joint, marginal, MAP and MA predictions separately */
+    int huge_pages;             /* TRUE to back the likelihood arrays with huge pages */
+    int threads;                /* number of threads of the analysis, at least 1 */
+    const char *tree_snapshot;  /* where to save the parsed tree (see tree_snapshot.c), NULL for nowhere */
+    FILE *log;                  /* where to print the progress information, NULL to be quiet */
+    ThreadPool *pool;           /* set up by runpastml for the time of the analysis */
+} AnalysisContext;
 
 typedef struct __Node {
     char *name;
@@ -29,25 +53,29 @@ typedef struct __Node {
     int id;            /* unique id attributed to the node */
     int nb_neigh;    /* number of neighbours */
     struct __Node **neigh;    /* neighbour nodes */
-
-    double **pij;           /* probability of substitution from i to j */
-    double *bottom_up_likelihood;       /* conditional likelihoods at the node*/
-    double *marginal;
-    double *sim_marginal_prob;
-    size_t *best_states;
-    double *top_down_likelihood;
-    double *joint_likelihood;
-    size_t *joint_state;
-    size_t best_joint_state;
-    size_t ma_state;
     double branch_len;
     double original_len;
 } Node;
 
 
+/* Flat traversal schedule of a rooted tree, built once after parsing and shared by all the passes over it.
+ * Children of node id are children[child_offset[id]], ..., children[child_offset[id + 1] - 1]. */
+typedef struct __TraversalPlan {
+    int nb_nodes;
+    int *post_order;        /* node ids, every node comes after all its descendants */
+    int *pre_order;         /* node ids, every node comes before all its descendants */
+    int *parent;            /* parent id of each node, -1 for the root */
+    int *child_offset;      /* nb_nodes + 1 offsets into children */
+    int *children;          /* child ids, grouped by parent */
+    int *subtree_size;      /* number of nodes in the subtree of each node, including the node itself */
+    int *post_order_index;  /* position of each node in post_order, its subtree ends there */
+} TraversalPlan;
+
 typedef struct __Tree {
     Node **nodes;            /* array of node pointers */
+    Node *node_slab;         /* storage for all the nodes, nodes[i] points into it */
     Node *root;            /* the root or pseudo-root node */
+    TraversalPlan *plan;
     int nb_nodes;
     int nb_edges;
     size_t nb_taxa;
@@ -55,6 +83,90 @@ typedef struct __Tree {
     double avg_branch_len;
     double min_branch_len;
     double avg_tip_branch_len;
+    void *snapshot;          /* the mapped snapshot the tree was loaded from (see tree_snapshot.c), NULL if parsed */
+    size_t snapshot_size;
+    void *snapshot_slab;     /* the neighbours and sim names of a tree loaded from a snapshot, in one block */
 } Tree;
 
+/* Hash table from names (that it does not copy) to indices, e.g. of the annotation rows, with open addressing.
+ * Its size is fixed at creation, to at least twice the maximal number of names. */
+typedef struct __NameIndex {
+    const char **names;     /* NULL for the empty slots */
+    size_t *indices;
+    size_t mask;            /* number of slots - 1, a power of two */
+    size_t nb_names;
+} NameIndex;
+
+/* Per-node working memory of an analysis, kept in a few large slabs indexed by node id.
+ * Every per-node vector (matrix) starts on a cache line boundary. */
+typedef struct __Arena {
+    size_t nb_nodes;
+    size_t num_annotations;
+    size_t stride;                  /* length of a per-node vector, padded to whole cache lines */
+    size_t pij_stride;              /* length of a per-node matrix, padded to whole cache lines */
+    double *pij;                    /* probability of substitution from i to j: pij[i * num_annotations + j] */
+    double *branch_exp;             /* F81 (and JC) only, instead of pij: exp(-mu t) of the branch above the node */
+    Model model;
+    int f81;                        /* TRUE if the substitutions are given by branch_exp rather than by pij */
+    double *bottom_up_likelihood;   /* conditional likelihoods at the node */
+    double *top_down_likelihood;
+    double *marginal;
+    double *sim_marginal_prob;
+    double *joint_likelihood;
+    double *branch_len;             /* one value per node: the branch above it, rescaled with the optimised parameters */
+    size_t *best_states;
+    size_t *joint_state;
+    size_t *best_joint_state;       /* one value per node */
+    size_t *ma_state;               /* one value per node */
+    size_t *tip_state;              /* one value per node: the observed state of a tip, num_annotations if missing
+                                     * (or, for an inner node, if all the tips of its subtree are missing),
+                                     * NO_TIP_STATE for the other inner nodes, whose likelihood vectors are used instead */
+    void *slabs[3];
+    size_t slab_sizes[3];
+    int huge_pages;
+    ThreadPool *pool;               /* processes the post-order passes, NULL to process them serially */
+    /* all but F81 (and JC): open addressing table from a rescaled branch length
+     * to the node whose pij holds the matrix of that length during the current evaluation */
+    double *pij_cache_len;
+    int *pij_cache_id;
+    size_t pij_cache_size;          /* a power of 2 */
+    int *pij_owner;                 /* one value per node: the node whose pij is used for the branch above it */
+    int *pij_status;                /* one value per node: PIJ_PENDING, PIJ_COMPUTING or PIJ_READY (atomic) */
+    size_t pij_computed;            /* statistics over all the evaluations */
+    size_t pij_reused;
+} Arena;
+
+#define NODE_VECTOR(arena, slab, id) ((arena)->slab + (size_t) (id) * (arena)->stride)
+#define NODE_PIJ(arena, id) ((arena)->pij + (size_t) (id) * (arena)->pij_stride)
+/* the probabilities of substitution of the branch above the node, possibly shared with other branches */
+#define BRANCH_PIJ(arena, id) NODE_PIJ(arena, (arena)->pij_owner[id])
+
+#define PIJ_PENDING 0
+#define PIJ_COMPUTING 1
+#define PIJ_READY 2
+
+/* Working memory of the bottom-up likelihood evaluated for several parameter vectors (lanes) at once.
+ * The per-node data is interleaved by lane: the value of state i in lane l is at [i * nb_lanes + l],
+ * and the probability of substitution from i to j at [(i * num_annotations + j) * nb_lanes + l]. */
+typedef struct __LaneArena {
+    size_t nb_nodes;
+    size_t num_annotations;
+    size_t nb_lanes;
+    size_t stride;                  /* length of a per-node vector (all lanes), padded to whole cache lines */
+    size_t pij_stride;              /* length of a per-node matrix (all lanes), padded to whole cache lines */
+    size_t lane_stride;             /* length of a per-node scalar (all lanes), padded to whole cache lines */
+    Model model;
+    int f81;
+    double *pij;
+    double *branch_exp;             /* F81 (and JC) only, instead of pij */
+    double *bottom_up_likelihood;
+    void *slabs[2];
+    size_t slab_sizes[2];
+    int huge_pages;
+} LaneArena;
+
+#define NODE_LANE_VECTOR(lanes, id) ((lanes)->bottom_up_likelihood + (size_t) (id) * (lanes)->stride)
+#define NODE_LANE_PIJ(lanes, id) ((lanes)->pij + (size_t) (id) * (lanes)->pij_stride)
+#define NODE_LANE_EXP(lanes, id) ((lanes)->branch_exp + (size_t) (id) * (lanes)->lane_stride)
+
 #endif // PASTML_H
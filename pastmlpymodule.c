@@ -1,30 +1,75 @@
 //
 // Created by azhukova on 1/24/18.
 //
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "runpastml.h"
 #include "pastml.h"
+#include "models.h"
+#include "libpastml.h"
+#include "name_index.h"
 
-extern QUIET;
+static PyObject *PastmlError;
+
+/*  parsed tree, that can be analysed several times, also from several threads at once */
+typedef struct {
+    PyObject_HEAD
+    PastmlTree *tree;
+} TreeObject;
+
+static PyTypeObject TreeType;
+
+static const char *get_string(PyObject *object) {
+    /* the text of a str object (UTF-8 encoded in Python 3), NULL with a Python exception set if it is not one */
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_AsUTF8(object);
+#else
+    return PyString_AsString(object);
+#endif
+}
 
 /*  wrapped pastml function */
 static PyObject *infer_ancestral_states(PyObject *self, PyObject *args) {
     char *annotation_name;
-    char *tree_name;
+    PyObject *tree_arg;
+    char *tree_name = NULL;
     char *out_annotation_name;
     char *out_tree_name;
     char *model;
     int *quiet = FALSE;
+    int threads = 1;
     int sts;
+    AnalysisContext context;
 
-    if (!PyArg_ParseTuple(args, "sssss|i", &annotation_name, &tree_name, &out_annotation_name, &out_tree_name, &model,
-                          &quiet)) {
+    if (!PyArg_ParseTuple(args, "sOsss|ii", &annotation_name, &tree_arg, &out_annotation_name, &out_tree_name, &model,
+                          &quiet, &threads)) {
+        return NULL;
+    }
+    /* a parsed tree is reused as is, otherwise the tree is read from its file */
+    if (!PyObject_TypeCheck(tree_arg, &TreeType)) {
+        tree_name = (char *) get_string(tree_arg);
+        if (tree_name == NULL) {
+            return NULL;
+        }
+    }
+    init_context(&context);
+    if (EXIT_SUCCESS != parse_model(model, &context.model)) {
+        PyErr_SetString(PyErr_NewException("pastml.error", NULL, NULL), "Model must be either JC, F81, HKY or JTT.");
         return NULL;
     }
+    context.threads = MAX(threads, 1);
     if (quiet != FALSE) {
-        QUIET = TRUE;
+        context.log = NULL;
     }
-    sts = runpastml(annotation_name, tree_name, out_annotation_name, out_tree_name, model);
+    /* the arguments (and the tree) are kept alive by args */
+    Py_BEGIN_ALLOW_THREADS
+    if (tree_name == NULL) {
+        sts = runpastml_on_tree(annotation_name, ((TreeObject *) tree_arg)->tree, out_annotation_name, out_tree_name,
+                                &context);
+    } else {
+        sts = runpastml(annotation_name, tree_name, out_annotation_name, out_tree_name, &context);
+    }
+    Py_END_ALLOW_THREADS
     if (sts != EXIT_SUCCESS) {
         if (errno) {
             return PyErr_SetFromErrno(PyErr_NewException("pastml.error", NULL, NULL));
@@ -36,20 +81,392 @@ static PyObject *infer_ancestral_states(PyObject *self, PyObject *args) {
     return PyLong_FromLong(sts);
 }
 
+static PyObject *Tree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"newick", NULL};
+    const char *newick;
+    Py_ssize_t length;
+    TreeObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#", keywords, &newick, &length)) {
+        return NULL;
+    }
+    self = (TreeObject *) type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    /* the newick string is kept alive by args */
+    Py_BEGIN_ALLOW_THREADS
+    self->tree = pastml_new_tree_from_newick(newick, (size_t) length);
+    Py_END_ALLOW_THREADS
+    if (self->tree == NULL) {
+        Py_DECREF(self);
+        PyErr_SetString(PastmlError, "Not a syntactically correct newick tree.");
+        return NULL;
+    }
+    return (PyObject *) self;
+}
+
+static void Tree_dealloc(TreeObject *self) {
+    pastml_free_tree(self->tree);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *get_node_names(const PastmlTree *tree) {
+    int id, nb_nodes = pastml_get_nb_nodes(tree);
+    PyObject *name, *names = PyList_New(nb_nodes);
+    if (names == NULL) {
+        return NULL;
+    }
+    for (id = 0; id < nb_nodes; id++) {
+        name = PyUnicode_FromString(pastml_get_node_name(tree, id));
+        if (name == NULL) {
+            Py_DECREF(names);
+            return NULL;
+        }
+        PyList_SET_ITEM(names, id, name);
+    }
+    return names;
+}
+
+static PyObject *Tree_get_node_names(TreeObject *self, void *closure) {
+    return get_node_names(self->tree);
+}
+
+static PyObject *Tree_get_nb_tips(TreeObject *self, void *closure) {
+    return PyLong_FromLong(pastml_get_nb_tips(self->tree));
+}
+
+static PyGetSetDef Tree_getset[] = {
+        {"node_names", (getter) Tree_get_node_names, NULL, "list of str, the node names, by node id (the root is 0).", NULL},
+        {"nb_tips", (getter) Tree_get_nb_tips, NULL, "int, the number of tips.", NULL},
+        {NULL}
+};
+
+static PyObject *new_array(char format, Py_ssize_t rows, Py_ssize_t columns, void **data) {
+    /**
+     * Creates a memoryview of rows x columns (or of rows if columns is 0) doubles ('d') or ints ('i'),
+     * whose memory the engine fills directly (see reconstruct).
+     */
+    Py_ssize_t item_size = (format == 'd') ? sizeof(double) : sizeof(int);
+    PyObject *bytes, *view;
+#if PY_MAJOR_VERSION >= 3
+    PyObject *array;
+#endif
+    bytes = PyByteArray_FromStringAndSize(NULL, rows * MAX(columns, 1) * item_size);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    *data = PyByteArray_AS_STRING(bytes);
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (view == NULL) {
+        return NULL;
+    }
+#if PY_MAJOR_VERSION >= 3
+    if (columns > 0) {
+        array = PyObject_CallMethod(view, "cast", "C(nn)", format, rows, columns);
+    } else {
+        array = PyObject_CallMethod(view, "cast", "C", format);
+    }
+    Py_DECREF(view);
+    return array;
+#else
+    return view;
+#endif
+}
+
+static PyObject *get_state_names(const char **state_names, int nb_states) {
+    int i;
+    PyObject *name, *names = PyList_New(nb_states);
+    if (names == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < nb_states; i++) {
+        name = PyUnicode_FromString(state_names[i]);
+        if (name == NULL) {
+            Py_DECREF(names);
+            return NULL;
+        }
+        PyList_SET_ITEM(names, i, name);
+    }
+    return names;
+}
+
+static int add_item(PyObject *dict, const char *key, PyObject *value) {
+    /* steals the reference to value */
+    int exit_val = (value == NULL) ? -1 : PyDict_SetItemString(dict, key, value);
+    Py_XDECREF(value);
+    return exit_val;
+}
+
+static const char *get_state_value(PyObject *item) {
+    /* the state of a tip as a string, NULL for a missing one (None, empty or ?) */
+    const char *value;
+    if (item == Py_None) {
+        return NULL;
+    }
+    value = get_string(item);
+    if (value != NULL && (value[0] == '\0' || strcmp(value, "?") == 0)) {
+        return NULL;
+    }
+    return value;
+}
+
+static int set_tip_states(const PastmlTree *tree, PyObject *tips, PyObject *values, Model model,
+                          int *states, const char **state_names, int *nb_states) {
+    /**
+     * Sets the state index of each tree node (by id, -1 for the missing and not annotated ones) from the states of
+     * the given tips, the tips that are not in the tree being ignored, and the state names:
+     * in order of appearance for JC and F81, the model ones for HKY (TCAG) and JTT (ARNDCQEGHILKMFPSTWYV).
+     * The state names point into the values, which must be kept alive (as must the tree).
+     * Returns -1 with a Python exception set on failure.
+     */
+    static const char *hky_states[] = {"T", "C", "A", "G"};
+    static const char *jtt_states[] = {"A", "R", "N", "D", "C", "Q", "E", "G", "H", "I",
+                                       "L", "K", "M", "F", "P", "S", "T", "W", "Y", "V"};
+    Py_ssize_t k, nb_tips = PySequence_Fast_GET_SIZE(tips);
+    int id, nb_nodes = pastml_get_nb_nodes(tree), exit_val = 0;
+    size_t state, node;
+    const char *name, *value;
+    NameIndex *tip_index = new_name_index((size_t) nb_nodes);
+    NameIndex *state_index = new_name_index((size_t) nb_tips + 20);
+
+    if (tip_index == NULL || state_index == NULL) {
+        free_name_index(tip_index);
+        free_name_index(state_index);
+        PyErr_NoMemory();
+        return -1;
+    }
+    *nb_states = 0;
+    if (model == MODEL_HKY || model == MODEL_JTT) {
+        *nb_states = (model == MODEL_HKY) ? 4 : 20;
+        for (id = 0; id < *nb_states; id++) {
+            state_names[id] = (model == MODEL_HKY) ? hky_states[id] : jtt_states[id];
+            add_name(state_index, state_names[id], (size_t) id);
+        }
+    }
+    for (id = 0; id < nb_nodes; id++) {
+        states[id] = -1;
+        if (id > 0) {
+            add_name(tip_index, pastml_get_node_name(tree, id), (size_t) id);
+        }
+    }
+
+    for (k = 0; k < nb_tips && exit_val == 0; k++) {
+        name = get_string(PySequence_Fast_GET_ITEM(tips, k));
+        value = get_state_value(PySequence_Fast_GET_ITEM(values, k));
+        if (name == NULL || PyErr_Occurred()) {
+            exit_val = -1;
+        } else if (value != NULL && (node = find_name(tip_index, name)) != NOT_INDEXED) {
+            if (model == MODEL_HKY || model == MODEL_JTT) {
+                state = find_name(state_index, value);
+            } else {
+                state = add_name(state_index, value, (size_t) *nb_states);
+                if (state == (size_t) *nb_states) {
+                    state_names[(*nb_states)++] = value;
+                }
+            }
+            if (state == NOT_INDEXED) {
+                PyErr_Format(PyExc_ValueError, "State %s of tip %s is not one of the %s model states.", value, name,
+                             get_model_name(model));
+                exit_val = -1;
+            }
+            states[node] = (int) state;
+        }
+    }
+    free_name_index(tip_index);
+    free_name_index(state_index);
+    return exit_val;
+}
+
+typedef struct __Reconstruction {
+    int nb_states;
+    double log_likelihood;
+    double scaling_factor;
+    double epsilon;
+    double *frequencies;
+    double *marginal_probabilities;
+    double *predicted_probabilities;
+    int *nb_predicted;
+} Reconstruction;
+
+static int reconstruct_marginal(PastmlTree *tree, const char *model, const int *states, const char **state_names,
+                                int threads, int quiet, Reconstruction *result) {
+    /**
+     * Runs the whole reconstruction, filling the result arrays.
+     * Called without the GIL, so it only touches the tree (read-only), its arguments and the engine.
+     */
+    int exit_val;
+    PastmlAnalysis *analysis = pastml_new_analysis(tree, model, result->nb_states, state_names, threads,
+                                                   quiet ? NULL : stdout);
+    if (analysis == NULL) {
+        return EINVAL;
+    }
+    exit_val = pastml_set_tip_states(analysis, states);
+    if (EXIT_SUCCESS == exit_val) {
+        exit_val = pastml_optimise(analysis, &result->log_likelihood);
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        exit_val = pastml_reconstruct_marginal(analysis);
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        pastml_get_parameters(analysis, result->frequencies, &result->scaling_factor, &result->epsilon);
+        pastml_get_marginal_probabilities(analysis, result->marginal_probabilities);
+        exit_val = pastml_get_predicted_states(analysis, result->predicted_probabilities, result->nb_predicted);
+    }
+    pastml_free_analysis(analysis);
+    return exit_val;
+}
+
+static PyObject *reconstruct(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"tree", "tips", "states", "model", "threads", "quiet", NULL};
+    PyObject *tree_arg, *tips_arg, *states_arg, *tips = NULL, *values = NULL, *result = NULL;
+    PyObject *tree_object = NULL;
+    const char *model_name = "F81";
+    const char **state_names = NULL;
+    int threads = 1, quiet = TRUE, nb_nodes, exit_val = EXIT_SUCCESS;
+    int *states = NULL;
+    Model model;
+    Reconstruction reconstruction;
+    PastmlTree *tree;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|sii", keywords, &tree_arg, &tips_arg, &states_arg,
+                                     &model_name, &threads, &quiet)) {
+        return NULL;
+    }
+    if (EXIT_SUCCESS != parse_model(model_name, &model)) {
+        PyErr_SetString(PastmlError, "Model must be either JC, F81, HKY or JTT.");
+        return NULL;
+    }
+    /* a newick string is parsed into a temporary tree */
+    if (PyObject_TypeCheck(tree_arg, &TreeType)) {
+        Py_INCREF(tree_arg);
+        tree_object = tree_arg;
+    } else {
+        tree_object = PyObject_CallFunctionObjArgs((PyObject *) &TreeType, tree_arg, NULL);
+        if (tree_object == NULL) {
+            return NULL;
+        }
+    }
+    tree = ((TreeObject *) tree_object)->tree;
+    nb_nodes = pastml_get_nb_nodes(tree);
+
+    tips = PySequence_Fast(tips_arg, "tips must be a sequence of str.");
+    /* a tuple, so that the values (and the state names pointing into them) cannot change once the GIL is released */
+    values = PySequence_Tuple(states_arg);
+    if (tips == NULL || values == NULL) {
+        goto done;
+    }
+    if (PySequence_Fast_GET_SIZE(tips) != PySequence_Fast_GET_SIZE(values)) {
+        PyErr_SetString(PyExc_ValueError, "tips and states must have the same length.");
+        goto done;
+    }
+    states = malloc(nb_nodes * sizeof(int));
+    state_names = malloc((PySequence_Fast_GET_SIZE(tips) + 20) * sizeof(char *));
+    if (states == NULL || state_names == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (set_tip_states(tree, tips, values, model, states, state_names, &reconstruction.nb_states) != 0) {
+        goto done;
+    }
+
+    result = PyDict_New();
+    if (result == NULL
+        || add_item(result, "node_names", get_node_names(tree))
+        || add_item(result, "frequencies", new_array('d', reconstruction.nb_states, 0,
+                                                     (void **) &reconstruction.frequencies))
+        || add_item(result, "marginal_probabilities",
+                    new_array('d', nb_nodes, reconstruction.nb_states,
+                              (void **) &reconstruction.marginal_probabilities))
+        || add_item(result, "predicted_probabilities",
+                    new_array('d', nb_nodes, reconstruction.nb_states,
+                              (void **) &reconstruction.predicted_probabilities))
+        || add_item(result, "nb_predicted_states", new_array('i', nb_nodes, 0,
+                                                             (void **) &reconstruction.nb_predicted))) {
+        Py_CLEAR(result);
+        goto done;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    exit_val = reconstruct_marginal(tree, model_name, states, state_names, threads, quiet, &reconstruction);
+    Py_END_ALLOW_THREADS
+
+    if (EXIT_SUCCESS != exit_val) {
+        PyErr_SetString(PastmlError, strerror(exit_val));
+        Py_CLEAR(result);
+        goto done;
+    }
+    if (add_item(result, "states", get_state_names(state_names, reconstruction.nb_states))
+        || add_item(result, "log_likelihood", PyFloat_FromDouble(reconstruction.log_likelihood))
+        || add_item(result, "scaling_factor", PyFloat_FromDouble(reconstruction.scaling_factor))
+        || add_item(result, "epsilon", PyFloat_FromDouble(reconstruction.epsilon))) {
+        Py_CLEAR(result);
+    }
+
+done:
+    free(states);
+    free(state_names);
+    Py_XDECREF(tips);
+    Py_XDECREF(values);
+    Py_XDECREF(tree_object);
+    return result;
+}
+
 /*  define functions in module */
 static PyMethodDef PastmlMethods[] =
         {
+                {"reconstruct", (PyCFunction) reconstruct, METH_VARARGS | METH_KEYWORDS,
+                        "Reconstruct the marginal ancestral states of one character, without any file.\n"
+                        "The computation runs without the GIL, so that several reconstructions can run in parallel threads.\n"
+                        "   :param tree: pastml.Tree, or str, the tree in newick format.\n"
+                        "   :param tips: sequence of str, tip names.\n"
+                        "   :param states: sequence of str, the states of the tips (None, empty or ? if missing).\n"
+                        "   :param model: str, the model of state evolution, either JC, F81 (by default), HKY or JTT.\n"
+                        "   :param threads: int, number of threads for the likelihood calculation (1 by default).\n"
+                        "   :param quiet: int, set to zero to print log information (quiet by default).\n"
+                        "   :return: dict with node_names (by node id) and states (the column names),\n"
+                        "   marginal_probabilities and predicted_probabilities (the chosen states having equal non-zero ones),\n"
+                        "   memoryviews of shape (nodes, states) of float64, nb_predicted_states (per node, int32),\n"
+                        "   frequencies (float64), log_likelihood, scaling_factor and epsilon.\n"
+                        "   The memoryviews can be wrapped without copy, e.g. with numpy.asarray.\n"},
                 {"infer_ancestral_states", infer_ancestral_states, METH_VARARGS,
                         "Infer tree ancestral states with PASTML.\n"
-                        "   :param annotation_file: str, path to the csv file containing two (unnamed) columns: tree tip ids and their states.\n"
-                        "   :param tree_file: str, path to the tree in newick format.\n"
+                        "   :param annotation_file: str, path to the csv file containing (unnamed) columns: tree tip ids and their states\n"
+                        "   (one or several columns, for several columns .column_<i> is added to the output file names).\n"
+                        "   :param tree_file: str, path to the tree in newick format,\n"
+                        "   or pastml.Tree, the tree parsed once for several calls (that can run in parallel threads).\n"
                         "   :param out_annotation_file: str, path where the csv file with the inferred annotations will be stored.\n"
                         "   :param out_tree_file: str, path where the output tree (with named internal nodes) in newick format will be stored.\n"
                         "   :param model: str, the model of state evolution, must be either JC or F81.\n"
-                        "   :param quiet: int, set to non-zero value to prevent PASTMl from printing log information.\n"},
+                        "   :param quiet: int, set to non-zero value to prevent PASTMl from printing log information.\n"
+                        "   :param threads: int, number of threads for the likelihood calculation (1 by default).\n"},
                 {NULL, NULL, 0, NULL}
         };
 
+static int add_types(PyObject *module) {
+    TreeType.tp_name = "pastml.Tree";
+    TreeType.tp_doc = "Tree(newick): a parsed tree, that can be given to reconstruct and infer_ancestral_states "
+                      "instead of its newick string or file, for as many analyses as needed.";
+    TreeType.tp_basicsize = sizeof(TreeObject);
+    TreeType.tp_flags = Py_TPFLAGS_DEFAULT;
+    TreeType.tp_new = Tree_new;
+    TreeType.tp_dealloc = (destructor) Tree_dealloc;
+    TreeType.tp_getset = Tree_getset;
+    if (PyType_Ready(&TreeType) < 0) {
+        return -1;
+    }
+    PastmlError = PyErr_NewException("pastml.error", NULL, NULL);
+    if (PastmlError == NULL) {
+        return -1;
+    }
+    Py_INCREF(&TreeType);
+    PyModule_AddObject(module, "Tree", (PyObject *) &TreeType);
+    Py_INCREF(PastmlError);
+    PyModule_AddObject(module, "error", PastmlError);
+    return 0;
+}
+
 #if PY_MAJOR_VERSION >= 3
 /* module initialization */
 /* Python version 3*/
@@ -64,7 +481,12 @@ static struct PyModuleDef cModPyDem =
 PyMODINIT_FUNC
 PyInit_pastml(void)
 {
-    return PyModule_Create(&cModPyDem);
+    PyObject *module = PyModule_Create(&cModPyDem);
+    if (module != NULL && add_types(module) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
 
 #else
@@ -73,7 +495,10 @@ PyInit_pastml(void)
 /* Python version 2 */
 PyMODINIT_FUNC
 initpastml(void) {
-    (void) Py_InitModule("pastml", PastmlMethods);
+    PyObject *module = Py_InitModule("pastml", PastmlMethods);
+    if (module != NULL) {
+        add_types(module);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -7,137 +7,276 @@
 #include "output_states.h"
 #include "logger.h"
 #include "make_tree.h"
+#include "models.h"
+#include "arena.h"
+#include "joint_likelihood.h"
+#include "output_simulation.h"
+#include "traversal.h"
+#include "kernels.h"
+#include "parallel.h"
+#include "name_index.h"
+#include "tree_snapshot.h"
+#include "clade_summary.h"
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-extern QUIET;
-extern SIMULATION;
-char *global_model;
-
-size_t tell_size_of_one_tree(char *filename) {
-    /* the only purpose of this is to know about the size of a treefile (NH format)
-     * in order to save memspace in allocating the string later on */
-    size_t mysize = 0;
-    int u;
-    FILE *myfile = fopen(filename, "r");
-    if (myfile) {
-        while ((u = fgetc(myfile)) != ';') { /* termination character of the tree */
-            if (feof(myfile)) {
-                break;
-            } /* shouldn't happen anyway */
-            if (!isspace(u)) {
-                mysize++;
-            }
+static char *map_file(const char *file_path, const char *file_kind, size_t *size) {
+    /**
+     * Maps the whole file read-only into memory, and returns it (NULL if it is not accessible or empty).
+     * The mapping must be released with munmap(data, *size).
+     */
+    struct stat file_stat;
+    char *data;
+
+    int file = open(file_path, O_RDONLY);
+    if (file == -1 || fstat(file, &file_stat) == -1) {
+        fprintf(stderr, "%s file %s is not found or is impossible to access.\n", file_kind, file_path);
+        fprintf(stderr, "Value of errno: %d\n", errno);
+        fprintf(stderr, "Error opening the file: %s\n", strerror(errno));
+        if (file != -1) {
+            close(file);
         }
-        fclose(myfile);
-    } /* end if(myfile) */
-    return mysize + 1;
+        return NULL;
+    }
+    *size = (size_t) file_stat.st_size;
+    if (*size == 0) {
+        fprintf(stderr, "%s file %s is empty.\n", file_kind, file_path);
+        close(file);
+        return NULL;
+    }
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s file %s could not be mapped into memory: %s\n", file_kind, file_path, strerror(errno));
+        return NULL;
+    }
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
 }
 
-int copy_nh_stream_into_str(FILE *nh_stream, char *big_string) {
-    int index_in_string = 0;
-    int u;
-    /* rewind(nh_stream);
-     * DO NOT go to the beginning of the stream
-     * if we want to make this flexible enough to read several trees per file */
-    while ((u = fgetc(nh_stream)) != ';') { /* termination character of the tree */
-        if (feof(nh_stream)) {
-            big_string[index_in_string] = '\0';
-            return EXIT_FAILURE;
-        } /* error code telling that no tree has been read properly */
-        if (index_in_string == MAX_TREELENGTH - 1) {
-            fprintf(stderr, "Fatal error: tree file seems too big, are you sure it is a newick tree file?\n");
-            return EXIT_FAILURE;
+static const char *read_csv_field(const char *pos, const char *end, char **strings) {
+    /**
+     * Copies the CSV field starting at pos into *strings, null-terminated, and advances *strings past it.
+     * A field in double quotes can contain commas and line breaks, a double quote being written as "".
+     * Returns the position of the comma or line break that ends the field (end for the last one).
+     */
+    char *out = *strings;
+
+    if (pos < end && *pos == '"') {
+        for (pos++; pos < end; pos++) {
+            if (*pos == '"') {
+                if (pos + 1 < end && pos[1] == '"') {
+                    pos++;
+                } else {
+                    pos++;
+                    break;
+                }
+            }
+            *out++ = *pos;
         }
-        if (!isspace(u)) {
-            big_string[index_in_string++] = (char) u;
+    }
+    /* whatever follows the closing quote is kept as well */
+    for (; pos < end && *pos != ',' && *pos != '\n' && *pos != '\r'; pos++) {
+        *out++ = *pos;
+    }
+    *out++ = '\0';
+    *strings = out;
+    return pos;
+}
+
+static size_t count_rows(const char *pos, const char *end) {
+    /**
+     * Counts the line breaks ending the rows of a csv file (a '\r' or a '\n', "\r\n" being one),
+     * those inside the double quotes of a field being skipped, plus one for a last row without one.
+     * This is the number of rows read by read_annotations, unless some quotes are misplaced.
+     */
+    size_t nb_rows = 1;
+    int quoted = FALSE;
+
+    for (; pos < end; pos++) {
+        if (*pos == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*pos == '\n' || *pos == '\r')) {
+            if (*pos == '\r' && pos + 1 < end && pos[1] == '\n') {
+                pos++;
+            }
+            nb_rows++;
         }
     }
-    big_string[index_in_string++] = ';';
-    big_string[index_in_string] = '\0';
-    return EXIT_SUCCESS; /* leaves the stream right after the terminal ';' */
-} /*end copy_nh_stream_into_str */
+    return nb_rows;
+}
 
-void free_node(Node *node, int count, size_t num_anno) {
-    int j;
+static int grow_rows(char ***tips, char ***values, size_t num_columns, size_t *capacity) {
+    /**
+     * Doubles the room for the rows of the tip names and of each column of values.
+     */
+    size_t i, new_capacity = 2 * *capacity;
+    char **rows = realloc(*tips, new_capacity * sizeof(char *));
 
-    if (node == NULL) return;
-    if (node->name && count != 0) {
-        free(node->name);
-        free(node->sim_name);
+    if (rows == NULL) {
+        return ENOMEM;
     }
-    free(node->neigh);
-    free(node->bottom_up_likelihood);
-    free(node->marginal);
-    free(node->sim_marginal_prob);
-    free(node->joint_likelihood);
-    free(node->joint_state);
-    free(node->best_states);
-    free(node->top_down_likelihood);
-    for (j = 0; j < num_anno; j++) {
-        free(node->pij[j]);
+    *tips = rows;
+    for (i = 0; i < num_columns; i++) {
+        rows = realloc(values[i], new_capacity * sizeof(char *));
+        if (rows == NULL) {
+            return ENOMEM;
+        }
+        values[i] = rows;
     }
-    free(node->pij);
-    free(node);
+    *capacity = new_capacity;
+    return EXIT_SUCCESS;
 }
 
-void free_tree(Tree *tree, size_t num_anno) {
-    int i;
-    if (tree == NULL) return;
-    for (i = 0; i < tree->nb_nodes; i++) {
-        free_node(tree->nodes[i], i, num_anno);
+char ***read_annotations(char *annotation_file_path, char ***tips, char **strings, size_t *num_columns,
+                         size_t *num_tips) {
+    /**
+     * Reads the annotation csv file, where each line contains a tip name
+     * followed by its states in one or several (unnamed) columns.
+     * Sets the tip names (*tips), and returns the values of each column: values[column][tip],
+     * missing values being "?". The number of columns is given by the first line.
+     * The lines can end with "\n", "\r\n" or "\r".
+     *
+     * The file is mapped into memory and read in one pass. All the names and values are copied
+     * (unquoted) into one block, *strings, that the tip names and values point to: the memory used is
+     * proportional to the file size, with one allocation for the strings and one array per column,
+     * sized by the number of rows (and grown if there are more of them, e.g. with misplaced quotes).
+     */
+    static char missing_value[] = "?";
+    size_t size, nb_rows, i;
+    int quoted;
+    const char *data, *pos, *end, *line;
+    char *string;
+    char ***values = NULL;
+    *num_columns = 0;
+    *num_tips = 0;
+    *tips = NULL;
+    *strings = NULL;
+
+    data = map_file(annotation_file_path, "Annotation", &size);
+    if (data == NULL) {
+        return NULL;
     }
-    free(tree->nodes);
-    free(tree);
-}
+    end = data + size;
 
+    /* as every field is followed by a separator (or the end of the file),
+     * the unquoted strings are not longer than the file, plus one null */
+    nb_rows = count_rows(data, end);
+    *strings = malloc(size + 1);
+    *tips = malloc(nb_rows * sizeof(char *));
+    if (*strings == NULL || *tips == NULL) {
+        goto fail;
+    }
+    string = *strings;
 
-char **read_annotations(char *annotation_file_path, char **tips, int *states,
-                        size_t *num_annotations, size_t *num_tips) {
-    char annotation_line[MAXLNAME];
-    int found_new_annotation;
-    size_t i;
-    size_t max_characters = 50;
-    char **character = calloc(max_characters, sizeof(char *));
-    for (i = 0; i < max_characters; i++) {
-        character[i] = calloc(MAXLNAME, sizeof(char));
+    for (pos = data; pos < end;) {
+        if (*pos == '\n' || *pos == '\r') {
+            /* an empty line */
+            pos++;
+            continue;
+        }
+        if (values == NULL) {
+            for (line = pos, quoted = FALSE, *num_columns = 0;
+                 line < end && (quoted || (*line != '\n' && *line != '\r')); line++) {
+                if (*line == '"') {
+                    quoted = !quoted;
+                } else if (*line == ',' && !quoted) {
+                    *num_columns = *num_columns + 1;
+                }
+            }
+            *num_columns = MAX(*num_columns, 1);
+            values = calloc(*num_columns, sizeof(char **));
+            if (values == NULL) {
+                goto fail;
+            }
+            for (i = 0; i < *num_columns; i++) {
+                if ((values[i] = malloc(nb_rows * sizeof(char *))) == NULL) {
+                    goto fail;
+                }
+            }
+        }
+        if (*num_tips == nb_rows && EXIT_SUCCESS != grow_rows(tips, values, *num_columns, &nb_rows)) {
+            goto fail;
+        }
+
+        (*tips)[*num_tips] = string;
+        pos = read_csv_field(pos, end, &string);
+        if (strlen((*tips)[*num_tips]) >= MAXLNAME) {
+            /* as for the tip names of the tree */
+            (*tips)[*num_tips][MAXLNAME - 1] = '\0';
+        }
+        for (i = 0; i < *num_columns; i++) {
+            values[i][*num_tips] = missing_value;
+            if (pos < end && *pos == ',') {
+                values[i][*num_tips] = string;
+                pos = read_csv_field(pos + 1, end, &string);
+                if (*values[i][*num_tips] == '\0') {
+                    values[i][*num_tips] = missing_value;
+                }
+            }
+        }
+        /* the extra fields, if any, are ignored */
+        while (pos < end && *pos != '\n' && *pos != '\r') {
+            pos++;
+        }
+        *num_tips = *num_tips + 1;
     }
-    *num_annotations = 0;
-    *num_tips = 0;
+    munmap((void *) data, size);
+    if (values == NULL) {
+        fprintf(stderr, "Annotation file %s is empty.\n", annotation_file_path);
+    }
+    return values;
 
-    char **annotations = calloc(MAXNSP, sizeof(char *));
-    for (i = 0; i < MAXNSP; i++) {
-        annotations[i] = calloc(MAXLNAME, sizeof(char));
+fail:
+    fprintf(stderr, "Not enough memory to read the annotation file %s.\n", annotation_file_path);
+    /* the columns allocated so far, the others are NULL */
+    for (i = 0; values != NULL && i < *num_columns; i++) {
+        free(values[i]);
     }
+    free(values);
+    free(*strings);
+    free(*tips);
+    *strings = NULL;
+    *tips = NULL;
+    *num_columns = 0;
+    *num_tips = 0;
+    munmap((void *) data, size);
+    return NULL;
+}
 
-    /*Read annotation from file*/
-    FILE *annotation_file = fopen(annotation_file_path, "r");
-    if (!annotation_file) {
-        fprintf(stderr, "Annotation file %s is not found or is impossible to access.", annotation_file_path);
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        fprintf(stderr, "Error opening the file: %s\n", strerror(errno));
+char **get_character_states(char **values, size_t num_tips, int *states, size_t *num_annotations) {
+    /**
+     * Finds the different states of a character (a column of the annotation file),
+     * sets the state index of each tip (-1 for the missing data), and returns the state names.
+     * The states are interned in a hash table, so that each value is looked up in constant time.
+     * The state names point to the values (or to string literals, see exchange_params),
+     * and there is always room for one more, the missing data.
+     */
+    size_t k;
+    size_t max_characters = 50;
+    char **character;
+    NameIndex *state_index = new_name_index(num_tips);
+    character = calloc(max_characters, sizeof(char *));
+    if (state_index == NULL || character == NULL) {
+        fprintf(stderr, "Problems with allocating memory: %s\n", strerror(errno));
+        free_name_index(state_index);
+        free(character);
         return NULL;
     }
+    *num_annotations = 0;
 
-    while (fgets(annotation_line, MAXLNAME, annotation_file)) {
-        sscanf(annotation_line, "%[^\n,],%[^\n\r]", tips[*num_tips], annotations[*num_tips]);
-        char *annotation_value = annotations[*num_tips];
-        if (strcmp(annotation_value, "") == 0) sprintf(annotation_value, "?");
+    for (k = 0; k < num_tips; k++) {
+        char *annotation_value = values[k];
         if (strcmp(annotation_value, "?") == 0) {
-            states[*num_tips] = -1;
+            states[k] = -1;
         } else {
-            found_new_annotation = TRUE;
-            for (i = 0; i < *num_tips; i++) {
-                if (strcmp(annotations[i], "?") != 0 && strcmp(annotation_value, annotations[i]) == 0) {
-                    states[*num_tips] = states[i];
-                    strcpy(character[states[*num_tips]], annotation_value);
-                    found_new_annotation = FALSE;
-                    break;
-                }
-            }
-            if (found_new_annotation == TRUE) {
-                states[*num_tips] = (int) *num_annotations;
-                if (*num_annotations >= max_characters) {
+            states[k] = (int) add_name(state_index, annotation_value, *num_annotations);
+            if (states[k] == *num_annotations) {
+                if (*num_annotations + 1 >= max_characters) {
                     /* Annotations do not fit in the character array (of size max_characters) anymore,
                      * so we gonna double reallocate the memory for the array (of double size) and copy data there */
                     max_characters *= 2;
@@ -145,25 +284,42 @@ char **read_annotations(char *annotation_file_path, char **tips, int *states,
                     if (character == NULL) {
                         fprintf(stderr, "Problems with allocating memory: %s\n", strerror(errno));
                         fprintf(stderr, "Value of errno: %d\n", errno);
+                        free_name_index(state_index);
                         return NULL;
                     }
-                    for (i = *num_annotations; i < max_characters; i++) {
-                        character[i] = calloc(MAXLNAME, sizeof(char));
-                    }
                 }
-                strcpy(character[*num_annotations], annotation_value);
+                character[*num_annotations] = annotation_value;
                 *num_annotations = *num_annotations + 1;
             }
         }
-        *num_tips = *num_tips + 1;
     }
-    fclose(annotation_file);
-    free(annotations);
+    free_name_index(state_index);
     return character;
 }
 
-int calculate_frequencies(size_t num_annotations, size_t num_tips, int *states, char **character, char *model,
-                          double *parameters) {
+char *get_column_file_name(const char *file_name, size_t column, size_t num_columns) {
+    /**
+     * If there are several annotation columns, inserts the (1-based) column number before the file extension:
+     * out.csv -> out.column_2.csv, otherwise keeps the file name.
+     */
+    size_t length = strlen(file_name);
+    char *column_file_name = calloc(length + 32, sizeof(char));
+    const char *extension = strrchr(file_name, '.');
+    const char *directory_end = strrchr(file_name, '/');
+
+    if (num_columns == 1) {
+        strcpy(column_file_name, file_name);
+    } else if (extension == NULL || (directory_end != NULL && extension < directory_end)) {
+        sprintf(column_file_name, "%s.column_%zu", file_name, column + 1);
+    } else {
+        sprintf(column_file_name, "%.*s.column_%zu%s", (int) (extension - file_name), file_name, column + 1,
+                extension);
+    }
+    return column_file_name;
+}
+
+int calculate_frequencies(size_t num_annotations, size_t num_tips, int *states, char **character, double *parameters,
+                          const AnalysisContext *context) {
     /* we would need an additional spot in the count array for the missing data,
      * therefore num_annotations + 1*/
     int *count_array = calloc(num_annotations + 1, sizeof(int));
@@ -178,266 +334,712 @@ int calculate_frequencies(size_t num_annotations, size_t num_tips, int *states,
     for (i = 0; i < num_tips; i++) {
         if (states[i] == -1) {
             states[i] = (int) num_annotations;
-            sprintf(character[num_annotations], "?");
+            character[num_annotations] = "?";
         }
         count_array[states[i]]++;
     }
 
+    /* the frequencies are estimated over the annotated tips, so that they sum up to 1:
+     * the tips with missing data then contribute a likelihood of 1 whatever the state of their parent */
     int sum_freq = 0;
-    for (i = 0; i <= num_annotations; i++) {
+    for (i = 0; i < num_annotations; i++) {
         sum_freq += count_array[i];
     }
-    log_info("MODEL:\t%s\n\n", model);
-    log_info("INITIAL FREQUENCIES:\n\n");
+    log_info(context, "MODEL:\t%s\n\n", get_model_name(context->model));
+    log_info(context, "INITIAL FREQUENCIES:\n\n");
     for (i = 0; i < num_annotations; i++) {
-        if (strcmp(model, "JC") == 0) {
+        if (context->model == MODEL_JC) {
             parameters[i] = ((double) 1) / num_annotations;
-        } else if (strcmp(model, "F81") == 0) {
+        } else if (context->model == MODEL_F81) {
             parameters[i] = ((double) count_array[i]) / sum_freq;
         } else {
             parameters[i] = ((double) count_array[i]) / sum_freq;
         }
-        log_info("\t%s:\t%.10f\n", character[i], parameters[i]);
+        log_info(context, "\t%s:\t%.10f\n", character[i], parameters[i]);
     }
     if (count_array[num_annotations] > 0.0) {
-        log_info("\n\tMissing data:\t%.10f\n", (double) count_array[num_annotations] / (double) sum_freq);
+        log_info(context, "\n\tMissing data:\t%.10f\n", (double) count_array[num_annotations] / (double) num_tips);
     }
-    log_info("\n");
+    log_info(context, "\n");
     free(count_array);
     return EXIT_SUCCESS;
 }
 
-Tree *read_tree(char *nwk, size_t num_anno) {
+/* What the characters (annotation columns) analysed against the same trees have in common */
+typedef struct __CharacterAnalysis {
+    Tree *s_tree;               /* the first tree */
+    size_t nb_trees;
+    char *tree_data;            /* the mapped tree file, if it contains several trees (parsed as they are analysed) */
+    size_t tree_data_size;
+    size_t *tree_starts;        /* offsets of the trees in tree_data, followed by the end of the last one */
+    CladeSummary **summaries;   /* per column, if there are several trees */
+    char **tips;
+    size_t num_tips;
+    NameIndex *tip_index;       /* tip name -> annotation row */
+    char ***values;             /* values[column][tip] */
+    char *annotation_strings;   /* the tip names and values point into it */
+    size_t num_columns;
+    AnalysisContext *context;
+    char *out_annotation_name;
+    char *out_tree_name;
+} CharacterAnalysis;
+
+static size_t split_trees(const char *data, size_t size, size_t *tree_starts) {
+    /**
+     * Counts the trees of a newick file, each one ending with a semicolon (those inside quoted names or comments,
+     * which the parser skips, do not count, see find_nh_tree_end),
+     * and, if tree_starts is not NULL, sets their offsets followed by the end of the last one.
+     * Anything but blanks after the last semicolon counts as one more (unterminated) tree.
+     */
+    const char *pos = data, *end = data + size, *semicolon;
+    size_t nb_trees = 0;
+
+    while (pos < end) {
+        semicolon = find_nh_tree_end(pos, end);
+        if (semicolon == end) {
+            for (; pos < end && isspace(*pos); pos++);
+            if (pos == end) {
+                break;
+            }
+            semicolon = end - 1;
+        }
+        if (tree_starts != NULL) {
+            tree_starts[nb_trees] = (size_t) (pos - data);
+        }
+        nb_trees++;
+        pos = semicolon + 1;
+    }
+    if (tree_starts != NULL) {
+        tree_starts[nb_trees] = size;
+    }
+    return nb_trees;
+}
+
+int read_trees(char *nwk, CharacterAnalysis *analysis) {
     /**
-     * Read a tree from newick file
+     * Read the tree(s) from newick file, or a tree from a tree snapshot (see tree_snapshot.c).
+     * Only the first tree is parsed: if there are several, the file stays mapped
+     * so that the others are parsed as they are analysed (see infer_tree).
      */
 
     Tree *s_tree;
+    size_t size;
 
-    FILE *tree_file = fopen(nwk, "r");
-    if (tree_file == NULL) {
-        fprintf(stderr, "Tree file %s is not found or is impossible to access.\n", nwk);
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        fprintf(stderr, "Error opening the file: %s\n", strerror(errno));
-        return NULL;
-    }
+    analysis->nb_trees = 1;
+    analysis->tree_data = NULL;
+    analysis->tree_starts = NULL;
 
-    size_t tree_file_size = 3 * tell_size_of_one_tree(nwk);
-    if (tree_file_size > MAX_TREELENGTH) {
-        fprintf(stderr, "Tree filesize for %s is more than %d bytes: are you sure it's a valid newick tree?\n",
-                nwk, MAX_TREELENGTH / 3);
-        return NULL;
+    /* the tree is parsed directly from the mapped file, with no copy and no limit on its size */
+    char *c_tree = map_file(nwk, "Tree", &size);
+    if (c_tree == NULL) {
+        return EXIT_FAILURE;
     }
-
-    void *retval;
-    if ((retval = calloc(tree_file_size + 1, sizeof(char))) == NULL) {
-        fprintf(stderr, "Not enough memory\n");
-        return NULL;
+    if (is_tree_snapshot(c_tree, size)) {
+        /* the tree keeps the snapshot mapped */
+        analysis->s_tree = load_tree_snapshot(c_tree, size, analysis->context);
+        if (NULL == analysis->s_tree) {
+            munmap(c_tree, size);
+            fprintf(stderr, "A problem occurred while loading the tree snapshot %s.\n", nwk);
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
     }
-    char *c_tree = (char *) retval;
 
-    if (EXIT_SUCCESS != copy_nh_stream_into_str(tree_file, c_tree)) {
-        fprintf(stderr, "A problem occurred while parsing the reference tree.\n");
-        return NULL;
+    analysis->nb_trees = MAX(split_trees(c_tree, size, NULL), 1);
+    if (analysis->nb_trees > 1) {
+        analysis->tree_starts = malloc((analysis->nb_trees + 1) * sizeof(size_t));
+        if (analysis->tree_starts == NULL) {
+            munmap(c_tree, size);
+            return ENOMEM;
+        }
+        split_trees(c_tree, size, analysis->tree_starts);
+        analysis->tree_data = c_tree;
+        analysis->tree_data_size = size;
+        size = analysis->tree_starts[1];
     }
-    fclose(tree_file);
 
     /*Make Tree structure*/
-    s_tree = complete_parse_nh(c_tree, num_anno);
+    s_tree = complete_parse_nh(c_tree, size, analysis->context);
+    if (analysis->nb_trees == 1) {
+        munmap(c_tree, size);
+    }
     if (NULL == s_tree) {
         fprintf(stderr, "A problem occurred while parsing the reference tree.\n");
-        return NULL;
+        if (analysis->nb_trees > 1) {
+            munmap(analysis->tree_data, analysis->tree_data_size);
+            free(analysis->tree_starts);
+            analysis->tree_data = NULL;
+            analysis->tree_starts = NULL;
+        }
+        return EXIT_FAILURE;
     }
-    return s_tree;
+    analysis->s_tree = s_tree;
+    return EXIT_SUCCESS;
 }
 
-int runpastml(char *annotation_name, char *tree_name, char *out_annotation_name, char *out_tree_name, char *model) {
-    int i;
-    int *states;
-    double log_likelihood, sec;
-    int minutes;
-    double *parameters;
-    char **character, **tips, fname[50];
-    size_t num_annotations, num_tips = 0;
-    struct timespec time_start, time_end;
-    int exit_val;
-    Tree *s_tree;
-    FILE *fp;
 
-    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_start);
-    srand((unsigned) time(NULL));
-    global_model = model;
-    
+Tree *read_tree(char *tree_name, AnalysisContext *context) {
+    /**
+     * Reads the tree of a newick file (the first one if there are several) or of a tree snapshot,
+     * to be analysed by runpastml_on_tree, and freed with free_tree.
+     */
+    CharacterAnalysis analysis;
 
-    if ((strcmp(model, "JC") != 0) && (strcmp(model, "F81") != 0) && (strcmp(model, "HKY") != 0) && (strcmp(model, "JTT") != 0)) {
-        sprintf(stderr, "Model must be either JC or F81, not %s", model);
-        return EINVAL;
+    analysis.context = context;
+    if (EXIT_SUCCESS != read_trees(tree_name, &analysis)) {
+        return NULL;
     }
-
-    /* Allocate memory */
-    states = calloc(MAXNSP, sizeof(int));
-    tips = calloc(MAXNSP, sizeof(char *));
-    for (i = 0; i < MAXNSP; i++) {
-        tips[i] = calloc(MAXLNAME, sizeof(char));
+    if (analysis.nb_trees > 1) {
+        log_info(context, "Only the first of the %zd trees of %s is kept.\n\n", analysis.nb_trees, tree_name);
+        munmap(analysis.tree_data, analysis.tree_data_size);
+        free(analysis.tree_starts);
     }
-    states[0] = 0;
+    return analysis.s_tree;
+}
 
-    size_t *num_anno_arr = calloc(1, sizeof(int));
-    size_t *num_tips_arr = calloc(1, sizeof(int));
-    character = read_annotations(annotation_name, tips, states, num_anno_arr, num_tips_arr);
-    if (character == NULL) {
-        return EXIT_FAILURE;
+
+int write_simulation_output(Tree *s_tree, Arena *arena, size_t num_annotations, char **character,
+                            size_t column, size_t num_columns, char *file_name, size_t method_num,
+                            const char *method_name, const AnalysisContext *context) {
+    char *fname = get_column_file_name(file_name, column, num_columns);
+    int exit_val = output_simulation(s_tree, arena, num_annotations, character, fname, method_num);
+    if (EXIT_SUCCESS == exit_val) {
+        log_info(context, "\t%s prediction is written to %s in csv format.\n", method_name, fname);
+        log_info(context, "\n");
     }
-    num_annotations = *num_anno_arr;
-    if(strcmp(model, "HKY") == 0)  num_annotations = 4;
-    if(strcmp(model, "JTT") == 0)  num_annotations = 20;
-    num_tips = *num_tips_arr;
-    free(num_anno_arr);
-    free(num_tips_arr);
-
-    /* we would need two additional spots in the parameters array: for the scaling factor, and for the epsilon,
-     * therefore num_annotations + 2*/
-    parameters = calloc(num_annotations + 2, sizeof(double));
-    if (parameters == NULL) {
-        fprintf(stderr, "Memory problems: %s\n", strerror(errno));
-        fprintf(stderr, "Value of errno: %d\n", errno);
-        return ENOMEM;
+    free(fname);
+    return exit_val;
+}
+
+static int write_character_outputs(CharacterAnalysis *analysis, Tree *s_tree, Arena *arena, size_t num_annotations,
+                                   char **character, const double *parameters, size_t column,
+                                   const AnalysisContext *context) {
+    /**
+     * Predicts the ancestral states of a character from its marginal probabilities,
+     * and writes them together with the scaled tree (and the simulation outputs if needed).
+     */
+    char *fname;
+    int exit_val;
+    FILE *fp;
+
+    /* the marginal probabilities are kept for the simulation outputs, as choosing the states changes them */
+    if (context->simulation) {
+        memcpy(arena->sim_marginal_prob, arena->marginal, arena->nb_nodes * arena->stride * sizeof(double));
     }
+    log_info(context, "PREDICTING MOST LIKELY ANCESTRAL STATES...\n\n");
+    choose_likely_states(s_tree, arena, num_annotations);
 
-    if ((strcmp(model, "JC") == 0) || (strcmp(model, "F81") == 0)) {
-      exit_val = calculate_frequencies(num_annotations, num_tips, states, character, model, parameters);
+    //For reproduction of the simulation results proposed by Ishikawa et al. 201X
+    if (context->simulation) {
+      log_info(context, "CALCULATING JOINT PROBABILITIES...\n\n");
+      calculate_joint_probabilities(s_tree, arena, num_annotations, parameters, context);
+      exit_val = write_simulation_output(s_tree, arena, num_annotations, character, column, analysis->num_columns,
+                                         "joint.txt", 0, "Joint", context);
+      if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+      }
+      exit_val = write_simulation_output(s_tree, arena, num_annotations, character, column, analysis->num_columns,
+                                         "marginal.txt", 1, "Marginal", context);
       if (EXIT_SUCCESS != exit_val) {
         return exit_val;
       }
+      exit_val = write_simulation_output(s_tree, arena, num_annotations, character, column, analysis->num_columns,
+                                         "maximum_posteriori.txt", 2, "MAP", context);
+      if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+      }
+      exit_val = write_simulation_output(s_tree, arena, num_annotations, character, column, analysis->num_columns,
+                                         "marginal_approximation.txt", 3, "MA", context);
+      if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+      }
+      fname = get_column_file_name("scaling_factor.txt", column, analysis->num_columns);
+      fp = fopen(fname, "w");
+      fprintf(fp, "%lf\n", parameters[num_annotations]);
+      fclose(fp);
+      log_info(context, "\tOptimized scaling factor is written to %s.\n", fname);
+      log_info(context, "\n");
+      free(fname);
     }
 
-    /*Re-order states, characters and frequencies for the HKY and JTT models*/
-    if ((strcmp(model, "HKY") == 0) || (strcmp(model, "JTT") == 0)) {
-      exchange_params(num_annotations, num_tips, states, character, model, parameters);
+    fname = get_column_file_name(analysis->out_tree_name, column, analysis->num_columns);
+    exit_val = write_nh_tree(s_tree, arena->branch_len, fname);
+    if (EXIT_SUCCESS != exit_val) {
+        free(fname);
+        return exit_val;
     }
+    log_info(context, "SAVING THE RESULTS...\n\n");
+    log_info(context, "\tScaled tree with internal node ids is written to %s.\n", fname);
+    free(fname);
 
-    s_tree = read_tree(tree_name, num_annotations);
-    if (s_tree == NULL) {
-        return EXIT_FAILURE;
+    fname = get_column_file_name(analysis->out_annotation_name, column, analysis->num_columns);
+    exit_val = output_state_ancestral_states(s_tree, arena, num_annotations, character, fname);
+    if (EXIT_SUCCESS != exit_val) {
+        free(fname);
+        return exit_val;
     }
+    log_info(context, "\tState predictions are written to %s in csv format.\n", fname);
+    log_info(context, "\n");
+    free(fname);
+    return EXIT_SUCCESS;
+}
+
+int optimise_parameters(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters, char **character,
+                        double *log_likelihood, const AnalysisContext *context) {
+    /**
+     * Optimises the parameters of a character whose tip probabilities are initialised in the arena:
+     * parameters = [frequency_1, .., frequency_n, scaling_factor, epsilon], the frequencies being set beforehand
+     * (and only optimised under F81), and sets the optimised log likelihood.
+     * The branch lengths and probabilities of substitution are then left in the arena, ready for the reconstruction.
+     */
+    Model model = context->model;
+    size_t i;
+    int nb_missing;
 
-    if (s_tree->nb_taxa != num_tips) {
-        fprintf(stderr, "Number of annotations (even empty ones) specified in the annotation file (%zd)"
-                " and the number of tips (%zd) do not match", num_tips, s_tree->nb_taxa);
-    }
-    num_tips = s_tree->nb_taxa;
     parameters[num_annotations] = 1.0 / s_tree->avg_branch_len;
     parameters[num_annotations + 1] = s_tree->min_branch_len;
 
-    initialise_tip_probabilities(s_tree, tips, states, num_tips, num_annotations);
-    free(tips);
+    nb_missing = mark_missing_data(s_tree, arena, num_annotations);
+    if (nb_missing > 0) {
+        log_info(context,
+                 "MISSING DATA:\t%d nodes in subtrees without annotations, skipped by the likelihood calculation\n\n",
+                 nb_missing);
+    }
 
-    if ((strcmp(model, "HKY") == 0) || (strcmp(model, "JTT") == 0)) { parameters[num_annotations] = 1.0; parameters[num_annotations + 1] = 0.0; }
-    log_likelihood = calculate_bottom_up_likelihood(s_tree, num_annotations, parameters);
-    if (log_likelihood == log(0)) {
+    if ((model == MODEL_HKY) || (model == MODEL_JTT)) { parameters[num_annotations] = 1.0; parameters[num_annotations + 1] = 0.0; }
+    *log_likelihood = calculate_bottom_up_likelihood(s_tree, arena, num_annotations, parameters);
+    if (*log_likelihood == log(0)) {
         fprintf(stderr, "A problem occurred while calculating the bottom up likelihood: "
                 "Is your tree ok and has at least 2 children per every inner node?\n");
         return EXIT_FAILURE;
     }
-    log_info("INITIAL LOG LIKELIHOOD:\t%.10f\n\n", log_likelihood);
+    log_info(context, "INITIAL LOG LIKELIHOOD:\t%.10f\n", *log_likelihood);
+    if (!arena->f81) {
+        log_info(context, "TRANSITION MATRICES:\t%zd calculated, %zd reused\n",
+                 arena->pij_computed, arena->pij_reused);
+    }
+    log_info(context, "\n");
 
-    if ((strcmp(model, "JC") == 0) || (strcmp(model, "F81") == 0)) {
-      log_info("OPTIMISING PARAMETERS...\n\n");
+    if ((model == MODEL_JC) || (model == MODEL_F81)) {
+      log_info(context, "OPTIMISING PARAMETERS...\n\n");
       if(parameters[num_annotations + 1] > s_tree->avg_tip_branch_len / 10.0) parameters[num_annotations + 1] = s_tree->avg_tip_branch_len / 10.0;
-      log_likelihood = minimize_params(s_tree, num_annotations, parameters, character, model,
+      *log_likelihood = minimize_params(s_tree, arena, num_annotations, parameters, character,
                                      0.01 / s_tree->avg_branch_len, 10.0 / s_tree->avg_branch_len,
                                      MIN(s_tree->min_branch_len / 10.0, s_tree->avg_tip_branch_len / 100.0),
-                                     s_tree->avg_tip_branch_len / 10.0);
-      log_info("\n");
+                                     s_tree->avg_tip_branch_len / 10.0, context);
+      log_info(context, "\n");
     }
 
-    log_info("OPTIMISED PARAMETERS:\n\n");
-    if (0 == strcmp("F81", model) || (strcmp(model, "HKY") == 0) || (strcmp(model, "JTT") == 0)) {
+    log_info(context, "OPTIMISED PARAMETERS:\n\n");
+    if ((model == MODEL_F81) || (model == MODEL_HKY) || (model == MODEL_JTT)) {
         for (i = 0; i < num_annotations; i++) {
-            log_info("\tFrequency of %s:\t%.10f\n", character[i], parameters[i]);
+            log_info(context, "\tFrequency of %s:\t%.10f\n", character[i], parameters[i]);
         }
-        log_info("\n");
+        log_info(context, "\n");
     }
-    log_info("\tScaling factor:\t%.10f \n", parameters[num_annotations]);
-    log_info("\tEpsilon:\t%e\n", parameters[num_annotations + 1]);
-    log_info("\n");
-    log_info("OPTIMISED LOG LIKELIHOOD:\t%.10f\n", log_likelihood);
-    log_info("\n");
+    log_info(context, "\tScaling factor:\t%.10f \n", parameters[num_annotations]);
+    log_info(context, "\tEpsilon:\t%e\n", parameters[num_annotations + 1]);
+    log_info(context, "\n");
+    log_info(context, "OPTIMISED LOG LIKELIHOOD:\t%.10f\n", *log_likelihood);
+    log_info(context, "\n");
 
-    rescale_branch_lengths(s_tree, parameters[num_annotations], parameters[num_annotations + 1]);
+    rescale_branch_lengths(s_tree, arena, parameters[num_annotations], parameters[num_annotations + 1]);
+    set_missing_data_p_ij(s_tree, arena, num_annotations, parameters);
 
-    //Marginal bottom_up_likelihood calculation
-    log_info("\nCALCULATING MARGINAL PROBABILITIES...\n\n");
-    calculate_marginal_probabilities(s_tree, num_annotations, parameters);
-    log_info("PREDICTING MOST LIKELY ANCESTRAL STATES...\n\n");
-    choose_likely_states(s_tree, num_annotations);
+    return EXIT_SUCCESS;
+}
 
-    //For reproduction of the simulation results proposed by Ishikawa et al. 201X
-    if(SIMULATION == TRUE) {
-      calculate_joint_probabilities(s_tree, num_annotations, parameters);
-      log_info("CALCULATING JOINT PROBABILITIES...\n\n");
-      sprintf(fname,"joint.txt");
-      exit_val = output_simulation(s_tree, num_annotations, character, fname, 0);
-      if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
-      }
-      log_info("\tJoint prediction is written to %s in csv format.\n", fname);
-      log_info("\n");
-      sprintf(fname,"marginal.txt");
-      exit_val = output_simulation(s_tree, num_annotations, character, fname, 1);
-      if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
-      }
-      log_info("\tMarginal prediction is written to %s in csv format.\n", fname);
-      log_info("\n"); 
-      sprintf(fname,"maximum_posteriori.txt");
-      exit_val = output_simulation(s_tree, num_annotations, character, fname, 2);
-      if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
-      }
-      log_info("\tMAP prediction is written to %s in csv format.\n", fname);
-      log_info("\n"); 
-      sprintf(fname,"marginal_approximation.txt");
-      exit_val = output_simulation(s_tree, num_annotations, character, fname, 3);
-      if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
+static int infer_character_on_tree(CharacterAnalysis *analysis, Tree *s_tree, size_t column,
+                                   const AnalysisContext *context) {
+    /**
+     * Reconstructs the ancestral states of one character (annotation column) on one tree:
+     * optimises its parameters, calculates the marginal probabilities and writes its outputs,
+     * or, if there are several trees, adds the marginal probabilities to the clade summary of the character.
+     * The tree is shared with the other characters and is not modified.
+     */
+    Model model = context->model;
+    int *states;
+    double log_likelihood;
+    double *parameters = NULL;
+    char **character = NULL;
+    size_t i, num_annotations, num_tips = analysis->num_tips;
+    int exit_val = EXIT_SUCCESS;
+    Arena *arena = NULL;
+
+    states = calloc(num_tips, sizeof(int));
+    if (states == NULL) {
+        fprintf(stderr, "Memory problems: %s\n", strerror(errno));
+        return ENOMEM;
+    }
+    character = get_character_states(analysis->values[column], num_tips, states, &num_annotations);
+    if (character == NULL) {
+        exit_val = EXIT_FAILURE;
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        if(model == MODEL_HKY)  num_annotations = 4;
+        if(model == MODEL_JTT)  num_annotations = 20;
+
+        /* we would need two additional spots in the parameters array: for the scaling factor, and for the epsilon,
+         * therefore num_annotations + 2*/
+        parameters = calloc(num_annotations + 2, sizeof(double));
+        if (parameters == NULL) {
+            fprintf(stderr, "Memory problems: %s\n", strerror(errno));
+            fprintf(stderr, "Value of errno: %d\n", errno);
+            exit_val = ENOMEM;
+        }
+    }
+
+    if (EXIT_SUCCESS == exit_val && ((model == MODEL_JC) || (model == MODEL_F81))) {
+      exit_val = calculate_frequencies(num_annotations, num_tips, states, character, parameters, context);
+    }
+
+    /*Re-order states, characters and frequencies for the HKY and JTT models*/
+    if (EXIT_SUCCESS == exit_val && ((model == MODEL_HKY) || (model == MODEL_JTT))) {
+      exchange_params(num_annotations, num_tips, states, character, parameters, context);
+      for (i = 0; i < num_tips; i++) {
+        if (states[i] == -1) {
+          states[i] = (int) num_annotations;
+          character[num_annotations] = "?";
+        }
       }
-      log_info("\tMA prediction is written to %s in csv format.\n", fname);
-      log_info("\n");   
-      sprintf(fname,"scaling_factor.txt");
-      fp = fopen(fname, "w");
-      fprintf(fp, "%lf\n", parameters[num_annotations]);
-      fclose(fp);
-      log_info("\tOptimized scaling factor is written to %s.\n", fname);
-      log_info("\n");   
     }
 
-    exit_val = write_nh_tree(s_tree, out_tree_name, parameters[num_annotations], parameters[num_annotations + 1]);
-    if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
+    if (EXIT_SUCCESS == exit_val) {
+        arena = allocate_arena((size_t) s_tree->nb_nodes, num_annotations, context);
+        if (arena == NULL) {
+            exit_val = ENOMEM;
+        }
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        initialise_tip_probabilities(s_tree, arena, analysis->tip_index, states, num_annotations);
+        exit_val = optimise_parameters(s_tree, arena, num_annotations, parameters, character, &log_likelihood,
+                                       context);
     }
-    log_info("SAVING THE RESULTS...\n\n");
-    log_info("\tScaled tree with internal node ids is written to %s.\n", out_tree_name);
 
-    exit_val = output_state_ancestral_states(s_tree, num_annotations, character, out_annotation_name);
-    if (EXIT_SUCCESS != exit_val) {
-        return exit_val;
+    //Marginal bottom_up_likelihood calculation
+    if (EXIT_SUCCESS == exit_val) {
+        log_info(context, "\nCALCULATING MARGINAL PROBABILITIES...\n\n");
+        exit_val = calculate_marginal_probabilities(s_tree, arena, num_annotations, parameters);
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        if (analysis->nb_trees > 1) {
+            exit_val = add_to_clade_summary(analysis->summaries[column], s_tree, arena, num_annotations, character);
+        } else {
+            exit_val = write_character_outputs(analysis, s_tree, arena, num_annotations, character, parameters,
+                                               column, context);
+        }
     }
-    log_info("\tState predictions are written to %s in csv format.\n", out_annotation_name);
-    log_info("\n");
 
     //free all
     free(character);
     free(states);
-    free_tree(s_tree, num_annotations);
+    free(parameters);
+    if (arena != NULL) {
+        free_arena(arena);
+    }
+    return exit_val;
+}
+
+static void start_item_log(const CharacterAnalysis *analysis, size_t nb_items, AnalysisContext *item_context,
+                           char **log_buffer, size_t *log_size) {
+    /**
+     * Sets up the context of one of the items (characters or trees) analysed in parallel:
+     * if there are several of them and several threads, its log goes to a buffer,
+     * written out at once by end_item_log, so that the logs of the items do not interleave.
+     */
+    *item_context = *analysis->context;
+    *log_buffer = NULL;
+    *log_size = 0;
+    if (item_context->log != NULL && item_context->threads > 1 && nb_items > 1) {
+        item_context->log = open_memstream(log_buffer, log_size);
+        if (item_context->log == NULL) {
+            /* the log is interleaved then, rather than lost */
+            item_context->log = analysis->context->log;
+        }
+    }
+}
+
+static void end_item_log(const CharacterAnalysis *analysis, AnalysisContext *item_context, char **log_buffer,
+                         size_t *log_size) {
+    if (item_context->log != analysis->context->log) {
+        /* sets the buffer and its size */
+        fclose(item_context->log);
+        /* one call, during which the stream is locked */
+        fwrite(*log_buffer, 1, *log_size, analysis->context->log);
+        free(*log_buffer);
+    }
+}
+
+int infer_character(size_t column, void *data) {
+    /**
+     * Reconstructs the ancestral states of one character on the (only) tree.
+     */
+    CharacterAnalysis *analysis = (CharacterAnalysis *) data;
+    AnalysisContext context;
+    char *log_buffer;
+    size_t log_size;
+    int exit_val;
+
+    start_item_log(analysis, analysis->num_columns, &context, &log_buffer, &log_size);
+    if (analysis->num_columns > 1) {
+        log_info(&context, "CHARACTER %zd:\n\n", column + 1);
+    }
+    exit_val = infer_character_on_tree(analysis, analysis->s_tree, column, &context);
+    end_item_log(analysis, &context, &log_buffer, &log_size);
+    return exit_val;
+}
+
+int infer_tree(size_t tree_index, void *data) {
+    /**
+     * Reconstructs the ancestral states of all the characters on one of the trees,
+     * parsing it first (but the first tree, which is already parsed and is kept for the clade summaries).
+     * The trees are analysed in parallel, and only as many of them are in memory as there are threads.
+     */
+    CharacterAnalysis *analysis = (CharacterAnalysis *) data;
+    AnalysisContext context;
+    Tree *s_tree = analysis->s_tree;
+    char *log_buffer;
+    size_t column, log_size;
+    int exit_val = EXIT_SUCCESS;
+
+    start_item_log(analysis, analysis->nb_trees, &context, &log_buffer, &log_size);
+    if (analysis->num_columns == 1) {
+        log_info(&context, "TREE %zd:\n\n", tree_index + 1);
+    }
+    if (tree_index > 0) {
+        s_tree = complete_parse_nh(analysis->tree_data + analysis->tree_starts[tree_index],
+                                   analysis->tree_starts[tree_index + 1] - analysis->tree_starts[tree_index],
+                                   &context);
+        if (s_tree == NULL) {
+            fprintf(stderr, "A problem occurred while parsing the tree %zd.\n", tree_index + 1);
+            exit_val = EXIT_FAILURE;
+        }
+    }
+    for (column = 0; column < analysis->num_columns && EXIT_SUCCESS == exit_val; column++) {
+        if (analysis->num_columns > 1) {
+            log_info(&context, "TREE %zd, CHARACTER %zd:\n\n", tree_index + 1, column + 1);
+        }
+        exit_val = infer_character_on_tree(analysis, s_tree, column, &context);
+    }
+    if (tree_index > 0) {
+        free_tree(s_tree);
+    }
+    end_item_log(analysis, &context, &log_buffer, &log_size);
+    return exit_val;
+}
+
+static int summarise_trees(CharacterAnalysis *analysis) {
+    /**
+     * Reconstructs the ancestral states of each character on each tree, the trees being analysed in parallel,
+     * and writes, for each character, the clade supports and the mean marginal probabilities
+     * on the nodes of the first tree, which is written as well.
+     */
+    const AnalysisContext *context = analysis->context;
+    size_t column;
+    int id, exit_val = EXIT_SUCCESS;
+    char *fname;
+    double *branch_len;
+
+    analysis->summaries = calloc(analysis->num_columns, sizeof(CladeSummary *));
+    if (analysis->summaries == NULL) {
+        return ENOMEM;
+    }
+    for (column = 0; column < analysis->num_columns && EXIT_SUCCESS == exit_val; column++) {
+        analysis->summaries[column] = new_clade_summary(analysis->s_tree);
+        if (analysis->summaries[column] == NULL) {
+            exit_val = ENOMEM;
+        }
+    }
+    if (EXIT_SUCCESS == exit_val) {
+        exit_val = for_each_in_parallel(context->threads, analysis->nb_trees, infer_tree, analysis);
+    }
+
+    if (EXIT_SUCCESS == exit_val) {
+        log_info(context, "SAVING THE RESULTS...\n\n");
+        branch_len = malloc(analysis->s_tree->nb_nodes * sizeof(double));
+        if (branch_len == NULL) {
+            exit_val = ENOMEM;
+        } else {
+            for (id = 0; id < analysis->s_tree->nb_nodes; id++) {
+                branch_len[id] = analysis->s_tree->nodes[id]->branch_len;
+            }
+            exit_val = write_nh_tree(analysis->s_tree, branch_len, analysis->out_tree_name);
+            free(branch_len);
+        }
+        if (EXIT_SUCCESS == exit_val) {
+            log_info(context, "\tFirst tree with internal node ids is written to %s.\n", analysis->out_tree_name);
+        }
+    }
+    for (column = 0; column < analysis->num_columns && EXIT_SUCCESS == exit_val; column++) {
+        fname = get_column_file_name(analysis->out_annotation_name, column, analysis->num_columns);
+        exit_val = write_clade_summary(analysis->summaries[column], fname);
+        if (EXIT_SUCCESS == exit_val) {
+            log_info(context, "\tClade supports and mean marginal probabilities are written to %s in csv format.\n",
+                     fname);
+        }
+        free(fname);
+    }
+    log_info(context, "\n");
+
+    for (column = 0; column < analysis->num_columns; column++) {
+        free_clade_summary(analysis->summaries[column]);
+    }
+    free(analysis->summaries);
+    return exit_val;
+}
+
+void init_context(AnalysisContext *context) {
+    /**
+     * Sets the default options: JC model, one thread, progress information printed to the standard output.
+     */
+    context->model = MODEL_JC;
+    context->simulation = FALSE;
+    context->huge_pages = FALSE;
+    context->threads = 1;
+    context->tree_snapshot = NULL;
+    context->log = stdout;
+    context->pool = NULL;
+}
+
+static int run_analyses(char *annotation_name, char *tree_name, Tree *tree, char *out_annotation_name,
+                        char *out_tree_name, AnalysisContext *context) {
+    /**
+     * Reconstructs the ancestral states of each annotation column (character), all against the same tree:
+     * the given one if not NULL, which is only read, otherwise the one(s) read from tree_name.
+     * The characters are analysed in parallel if the context has several threads.
+     * Nothing but the context (and the given tree) is shared by the analysis, so that several of them can run
+     * at the same time in different threads, each with its own context.
+     */
+    size_t i, j;
+    double sec;
+    int minutes;
+    char **tips;
+    struct timespec time_start, time_end;
+    int exit_val;
+    CharacterAnalysis analysis;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_start);
+    srand((unsigned) time(NULL));
+    log_info(context, "LIKELIHOOD KERNELS:\t%s\n\n", init_kernels());
+    log_info(context, "THREADS:\t%d\n\n", context->threads);
+
+    analysis.values = read_annotations(annotation_name, &tips, &analysis.annotation_strings, &analysis.num_columns,
+                                       &analysis.num_tips);
+    if (analysis.values == NULL) {
+        return EXIT_FAILURE;
+    }
+    analysis.tips = tips;
+    /* from here on, any failure goes through the cleanup at the end (the tree only being freed if read here),
+     * as the analyses may run in a long-lived process (see runpastml_on_tree) */
+    analysis.s_tree = NULL;
+    analysis.nb_trees = 0;
+    analysis.tree_data = NULL;
+    analysis.tree_starts = NULL;
+    /* the first row of a tip annotates it, as when the rows were scanned for each tip */
+    analysis.tip_index = new_name_index(analysis.num_tips);
+    if (analysis.tip_index == NULL) {
+        exit_val = ENOMEM;
+        goto done;
+    }
+    for (j = 0; j < analysis.num_tips; j++) {
+        add_name(analysis.tip_index, tips[j], j);
+    }
+    analysis.context = context;
+    analysis.out_annotation_name = out_annotation_name;
+    analysis.out_tree_name = out_tree_name;
+    if (analysis.num_columns > 1) {
+        log_info(context, "CHARACTERS:\t%zd\n\n", analysis.num_columns);
+    }
+
+    /* the JTT eigensystem does not depend on the branch, so we decompose the rate matrix once for the whole run */
+    if (context->model == MODEL_JTT) {
+      SetupJTTMatrix();
+    }
+
+    if (tree != NULL) {
+        analysis.s_tree = tree;
+        analysis.nb_trees = 1;
+        analysis.tree_data = NULL;
+        analysis.tree_starts = NULL;
+    } else {
+        exit_val = read_trees(tree_name, &analysis);
+        if (EXIT_SUCCESS != exit_val) {
+            goto done;
+        }
+    }
+    if (context->simulation && analysis.nb_trees > 1) {
+        /* the trees are only summarised on the clades of the first one, see summarise_trees */
+        fprintf(stderr, "The simulation outputs (-s) need a single tree, but %s contains %zd.\n", tree_name,
+                analysis.nb_trees);
+        exit_val = EINVAL;
+        goto done;
+    }
+    if (context->tree_snapshot != NULL && analysis.nb_trees > 1) {
+        fprintf(stderr, "A tree snapshot holds a single tree, the first one of %s is saved.\n", tree_name);
+    }
+    if (context->tree_snapshot != NULL) {
+        if (EXIT_SUCCESS != write_tree_snapshot(analysis.s_tree, context->tree_snapshot)) {
+            exit_val = EXIT_FAILURE;
+            goto done;
+        }
+        log_info(context, "TREE SNAPSHOT:\t%s (can be given instead of the tree file)\n\n", context->tree_snapshot);
+    }
+    if (analysis.s_tree->nb_taxa != analysis.num_tips) {
+        fprintf(stderr, "Number of annotations (even empty ones) specified in the annotation file (%zd)"
+                " and the number of tips (%zd) do not match", analysis.num_tips, analysis.s_tree->nb_taxa);
+    }
+
+    context->pool = new_thread_pool(context->threads);
+    if (analysis.nb_trees == 1) {
+        exit_val = for_each_in_parallel(context->threads, analysis.num_columns, infer_character, &analysis);
+    } else {
+        log_info(context, "TREES:\t%zd, summarised on the clades of the first one\n\n", analysis.nb_trees);
+        exit_val = summarise_trees(&analysis);
+    }
+
+done:
+    //free all
+    for (i = 0; i < analysis.num_columns; i++) {
+        free(analysis.values[i]);
+    }
+    free(analysis.values);
+    free_name_index(analysis.tip_index);
+    free(tips);
+    free(analysis.annotation_strings);
+    if (tree == NULL && analysis.s_tree != NULL) {
+        free_tree(analysis.s_tree);
+    }
+    if (analysis.tree_data != NULL) {
+        munmap(analysis.tree_data, analysis.tree_data_size);
+        free(analysis.tree_starts);
+    }
+    free_thread_pool(context->pool);
+    context->pool = NULL;
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
 
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time_end);
     sec = (double) (time_end.tv_sec - time_start.tv_sec)
           + (time_end.tv_nsec - time_start.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
 
     minutes = (int) (sec / 60.0);
-    log_info("TOTAL EXECUTION TIME:\t%d minute%s %.2f seconds\n\n", minutes, (minutes != 1) ? "s" : "",
+    log_info(context, "TOTAL EXECUTION TIME:\t%d minute%s %.2f seconds\n\n", minutes, (minutes != 1) ? "s" : "",
              sec - (60.0 * minutes));
 
     return EXIT_SUCCESS;
 }
+
+int runpastml(char *annotation_name, char *tree_name, char *out_annotation_name, char *out_tree_name,
+              AnalysisContext *context) {
+    return run_analyses(annotation_name, tree_name, NULL, out_annotation_name, out_tree_name, context);
+}
+
+int runpastml_on_tree(char *annotation_name, Tree *tree, char *out_annotation_name, char *out_tree_name,
+                      AnalysisContext *context) {
+    /**
+     * Same as runpastml, against a tree that is already parsed (e.g. once for many annotation files),
+     * and that is neither modified nor freed, so that it can be analysed from several threads at once.
+     */
+    return run_analyses(annotation_name, NULL, tree, out_annotation_name, out_tree_name, context);
+}
@@ -4,5 +4,21 @@
 
 #ifndef PASTML_PASTML_H
 #define PASTML_PASTML_H
-int runpastml(char *annotation_name, char *tree_name, char *out_annotation_name, char *out_tree_name, char *model);
+
+#include "pastml.h"
+
+void init_context(AnalysisContext *context);
+int calculate_frequencies(size_t num_annotations, size_t num_tips, int *states, char **character, double *parameters,
+                          const AnalysisContext *context);
+int optimise_parameters(Tree *s_tree, Arena *arena, size_t num_annotations, double *parameters, char **character,
+                        double *log_likelihood, const AnalysisContext *context);
+char ***read_annotations(char *annotation_file_path, char ***tips, char **strings, size_t *num_columns,
+                         size_t *num_tips);
+char *get_column_file_name(const char *file_name, size_t column, size_t num_columns);
+Tree *read_tree(char *tree_name, AnalysisContext *context);
+int runpastml(char *annotation_name, char *tree_name, char *out_annotation_name, char *out_tree_name,
+              AnalysisContext *context);
+int runpastml_on_tree(char *annotation_name, Tree *tree, char *out_annotation_name, char *out_tree_name,
+                      AnalysisContext *context);
+
 #endif //PASTML_PASTML_H
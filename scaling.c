@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include "pastml.h"
+#include "scaling.h"
 
 int get_scaling_pow(double value) {
     return (int) (POW * LOG2 - log(value)) / LOG2;
@@ -52,6 +53,39 @@ int upscale_node_probs(double* array, size_t n) {
     return factors;
 }
 
+void upscale_lane_probs(double *array, size_t n, size_t nb_lanes, int *factors) {
+    /**
+     * Same as upscale_node_probs, for each lane of an array interleaved by lane (see LaneArena):
+     * adds the scaling factors of each lane to factors[lane],
+     * or sets it to -1 if all the probabilities of the lane are zero.
+     */
+    size_t i, l;
+    double smallest;
+
+    for (l = 0; l < nb_lanes; l++) {
+        if (factors[l] == -1) {
+            continue;
+        }
+        smallest = 1.1;
+        for (i = 0; i < n; i++) {
+            if (array[i * nb_lanes + l] > 0.0 && array[i * nb_lanes + l] < smallest) {
+                smallest = array[i * nb_lanes + l];
+            }
+        }
+        if (smallest == 1.1) {
+            factors[l] = -1;
+            continue;
+        }
+        if (smallest < LIM_P) {
+            int curr_scaler_pow = get_scaling_pow(smallest);
+            factors[l] += curr_scaler_pow;
+            for (i = 0; i < n; i++) {
+                rescale(array, (int) (i * nb_lanes + l), curr_scaler_pow);
+            }
+        }
+    }
+}
+
 void rescale(double *array, int i, int curr_scaler_pow) {
     int piecewise_scaler_pow;
     unsigned long long curr_scaler;
@@ -6,5 +6,6 @@
 #define PASTML_SCALING_H
 int upscale_node_probs(double* array, size_t n);
 void rescale(double *array, int i, int curr_scaler_pow);
+void upscale_lane_probs(double *array, size_t n, size_t nb_lanes, int *factors);
 int get_scaling_pow(double value);
 #endif //PASTML_SCALING_H
@@ -0,0 +1,904 @@
+#include "server.h"
+#include "runpastml.h"
+#include "make_tree.h"
+#include "models.h"
+#include "logger.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+/* A tree kept in memory, analysed by the requests naming its id */
+typedef struct __ResidentTree {
+    char *id;
+    Tree *tree;
+    int users;                      /* requests analysing it at the moment */
+    int forgotten;                  /* TRUE once forgotten or replaced, it is freed when its last user is done */
+    struct __ResidentTree *next;
+} ResidentTree;
+
+/* The state shared by the thread accepting the connections and the workers */
+typedef struct __Server {
+    const AnalysisContext *defaults;    /* the model and options of the requests, and the log of the daemon */
+    pthread_mutex_t mutex;
+    pthread_cond_t queue_cond;          /* a connection is queued, or the server is stopping */
+    int *queue;                         /* accepted connections waiting for a worker, a ring of queue_size */
+    size_t queue_size;
+    size_t head;
+    size_t nb_queued;
+    int stopping;
+    ResidentTree *trees;
+} Server;
+
+/* A request frame, split in place: its command, key=value fields and body */
+typedef struct __Request {
+    char *command;
+    char *keys[SERVER_MAX_FIELDS];
+    char *values[SERVER_MAX_FIELDS];
+    size_t nb_fields;
+    char *body;
+    size_t body_size;
+} Request;
+
+/* A reply frame being written, starting with 4 bytes for its length */
+typedef struct __Reply {
+    char *data;
+    size_t size;
+    size_t capacity;
+} Reply;
+
+/* set by the signal handler, which cannot reach the server otherwise */
+static volatile sig_atomic_t stop_signal = 0;
+
+static void on_stop_signal(int signal) {
+    stop_signal = signal;
+}
+
+static const char *error_name(int error) {
+    switch (error) {
+        case EINVAL:
+            return "EINVAL";
+        case ENOENT:
+            return "ENOENT";
+        case ENOMEM:
+            return "ENOMEM";
+        case EBUSY:
+            return "EBUSY";
+        case EMSGSIZE:
+            return "EMSGSIZE";
+        case EIO:
+            return "EIO";
+        default:
+            return "EFAILURE";
+    }
+}
+
+static int reserve_reply(Reply *reply, size_t size) {
+    /* makes room for size more bytes after the reply */
+    char *new_data;
+    size_t capacity = reply->capacity;
+
+    while (reply->size + size > capacity) {
+        capacity = MAX(2 * capacity, 256);
+    }
+    if (capacity > reply->capacity) {
+        new_data = realloc(reply->data, capacity);
+        if (new_data == NULL) {
+            return ENOMEM;
+        }
+        reply->data = new_data;
+        reply->capacity = capacity;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int add_reply_data(Reply *reply, const char *data, size_t size) {
+    int exit_val = reserve_reply(reply, size);
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    memcpy(reply->data + reply->size, data, size);
+    reply->size += size;
+    return EXIT_SUCCESS;
+}
+
+static int add_reply(Reply *reply, const char *format, ...) {
+    /**
+     * Formats a line in the reply, however long its values (e.g. the ids and paths given by the client).
+     */
+    int length, exit_val;
+    va_list args;
+
+    va_start(args, format);
+    length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0) {
+        return EINVAL;
+    }
+    /* vsnprintf also writes a terminating null, not counted in the reply */
+    exit_val = reserve_reply(reply, (size_t) length + 1);
+    if (EXIT_SUCCESS != exit_val) {
+        return exit_val;
+    }
+    va_start(args, format);
+    vsnprintf(reply->data + reply->size, (size_t) length + 1, format, args);
+    va_end(args);
+    reply->size += (size_t) length;
+    return EXIT_SUCCESS;
+}
+
+static int start_reply(Reply *reply) {
+    /* room for the length, set by send_reply */
+    uint32_t length = 0;
+
+    reply->data = NULL;
+    reply->size = 0;
+    reply->capacity = 0;
+    return add_reply_data(reply, (const char *) &length, sizeof(uint32_t));
+}
+
+static void set_error_reply(Reply *reply, int error, const char *message) {
+    /**
+     * Replaces whatever was written to the reply with an error.
+     */
+    reply->size = sizeof(uint32_t);
+    add_reply(reply, "ERROR %s\nmessage=%s\n", error_name(error), message);
+}
+
+static int write_all(int connection, const char *data, size_t size, int flags) {
+    ssize_t written;
+
+    while (size > 0) {
+        written = send(connection, data, size, MSG_NOSIGNAL | flags);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return EIO;
+        }
+        data += written;
+        size -= (size_t) written;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int read_all(int connection, char *data, size_t size) {
+    ssize_t nb_read;
+
+    while (size > 0) {
+        nb_read = recv(connection, data, size, 0);
+        if (nb_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nb_read <= 0) {
+            return EIO;
+        }
+        data += nb_read;
+        size -= (size_t) nb_read;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int send_reply(int connection, Reply *reply, int flags) {
+    uint32_t length = htonl((uint32_t) (reply->size - sizeof(uint32_t)));
+
+    memcpy(reply->data, &length, sizeof(uint32_t));
+    return write_all(connection, reply->data, reply->size, flags);
+}
+
+static char *read_frame(int connection, size_t *size, int *error) {
+    /**
+     * Reads a frame, and returns its text null-terminated (NULL if it could not be read, setting the error).
+     */
+    uint32_t length;
+    char *frame;
+
+    *error = read_all(connection, (char *) &length, sizeof(uint32_t));
+    if (EXIT_SUCCESS != *error) {
+        return NULL;
+    }
+    *size = ntohl(length);
+    if (*size > SERVER_MAX_FRAME) {
+        *error = EMSGSIZE;
+        return NULL;
+    }
+    frame = malloc(*size + 1);
+    if (frame == NULL) {
+        *error = ENOMEM;
+        return NULL;
+    }
+    *error = read_all(connection, frame, *size);
+    if (EXIT_SUCCESS != *error) {
+        free(frame);
+        return NULL;
+    }
+    frame[*size] = '\0';
+    return frame;
+}
+
+static int parse_request(char *frame, size_t size, Request *request) {
+    /**
+     * Splits the frame into the command line, the key=value lines, and the body after an empty line.
+     */
+    char *line = frame, *end = frame + size, *line_end, *equals;
+
+    request->nb_fields = 0;
+    request->body = NULL;
+    request->body_size = 0;
+    request->command = NULL;
+    while (line < end) {
+        line_end = memchr(line, '\n', (size_t) (end - line));
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        *line_end = '\0';
+        if (line_end > line && line_end[-1] == '\r') {
+            line_end[-1] = '\0';
+        }
+        if (request->command == NULL) {
+            request->command = line;
+        } else if (*line == '\0') {
+            request->body = line_end + 1;
+            request->body_size = (line_end < end) ? (size_t) (end - line_end - 1) : 0;
+            break;
+        } else {
+            equals = strchr(line, '=');
+            if (equals == NULL || request->nb_fields == SERVER_MAX_FIELDS) {
+                return EINVAL;
+            }
+            *equals = '\0';
+            request->keys[request->nb_fields] = line;
+            request->values[request->nb_fields] = equals + 1;
+            request->nb_fields++;
+        }
+        line = line_end + 1;
+    }
+    return (request->command == NULL) ? EINVAL : EXIT_SUCCESS;
+}
+
+static char *get_field(const Request *request, const char *key) {
+    size_t i;
+    for (i = 0; i < request->nb_fields; i++) {
+        if (strcmp(request->keys[i], key) == 0) {
+            return request->values[i];
+        }
+    }
+    return NULL;
+}
+
+static void release_tree(ResidentTree *resident) {
+    /**
+     * Frees a forgotten tree once it is not used anymore. Must be called with the server mutex locked.
+     */
+    if (resident->forgotten && resident->users == 0) {
+        free_tree(resident->tree);
+        free(resident->id);
+        free(resident);
+    }
+}
+
+static ResidentTree *remove_tree(Server *server, const char *id) {
+    /**
+     * Takes the tree of the given id out of the server, and returns it (NULL if there is none).
+     * Must be called with the server mutex locked.
+     */
+    ResidentTree **previous, *resident;
+
+    for (previous = &server->trees; *previous != NULL; previous = &(*previous)->next) {
+        resident = *previous;
+        if (strcmp(resident->id, id) == 0) {
+            *previous = resident->next;
+            resident->forgotten = TRUE;
+            return resident;
+        }
+    }
+    return NULL;
+}
+
+static ResidentTree *read_resident_tree(const Server *server, const char *id, char *path) {
+    /**
+     * Reads a tree file (see read_tree) to be kept under the given id, NULL if it could not be read.
+     */
+    ResidentTree *resident;
+    AnalysisContext context = *server->defaults;
+
+    /* the tree statistics of several workers would be mixed up in the log */
+    context.log = NULL;
+    resident = calloc(1, sizeof(ResidentTree));
+    if (resident == NULL || (resident->id = strdup(id)) == NULL) {
+        free(resident);
+        return NULL;
+    }
+    resident->tree = read_tree(path, &context);
+    if (resident->tree == NULL) {
+        free(resident->id);
+        free(resident);
+        return NULL;
+    }
+    return resident;
+}
+
+static void keep_tree(Server *server, ResidentTree *resident) {
+    /**
+     * Adds a tree to the server, in place of the one of the same id, if any.
+     */
+    ResidentTree *replaced;
+
+    pthread_mutex_lock(&server->mutex);
+    replaced = remove_tree(server, resident->id);
+    if (replaced != NULL) {
+        release_tree(replaced);
+    }
+    resident->next = server->trees;
+    server->trees = resident;
+    pthread_mutex_unlock(&server->mutex);
+}
+
+static void handle_tree(Server *server, const Request *request, Reply *reply) {
+    char *path = get_field(request, "path");
+    char *id = get_field(request, "id");
+    ResidentTree *resident;
+
+    if (path == NULL) {
+        set_error_reply(reply, EINVAL, "TREE needs a path");
+        return;
+    }
+    resident = read_resident_tree(server, (id != NULL) ? id : path, path);
+    if (resident == NULL) {
+        set_error_reply(reply, EINVAL, "the tree could not be read, see the standard error of the daemon");
+        return;
+    }
+    /* the tree can be replaced by another request as soon as it is kept */
+    if (EXIT_SUCCESS != add_reply(reply, "OK\nid=%s\ntips=%zd\nnodes=%d\n", resident->id,
+                                  resident->tree->nb_taxa, resident->tree->nb_nodes)) {
+        set_error_reply(reply, ENOMEM, "not enough memory for the reply");
+    }
+    keep_tree(server, resident);
+}
+
+static void handle_forget(Server *server, const Request *request, Reply *reply) {
+    char *id = get_field(request, "id");
+    ResidentTree *resident;
+
+    if (id == NULL) {
+        set_error_reply(reply, EINVAL, "FORGET needs an id");
+        return;
+    }
+    pthread_mutex_lock(&server->mutex);
+    resident = remove_tree(server, id);
+    if (resident != NULL) {
+        release_tree(resident);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    if (resident == NULL) {
+        set_error_reply(reply, ENOENT, "no tree of this id");
+        return;
+    }
+    add_reply(reply, "OK\nid=%s\n", id);
+}
+
+static int make_path(char *path, const char *format, const char *prefix) {
+    /**
+     * Writes the path made of the format and its prefix (e.g. a directory) into path, of PATH_MAX chars.
+     * Returns EINVAL if it does not fit, rather than using a truncated path.
+     */
+    int length = snprintf(path, PATH_MAX, format, prefix);
+    return (length < 0 || length >= PATH_MAX) ? EINVAL : EXIT_SUCCESS;
+}
+
+static void remove_directory(const char *directory) {
+    /**
+     * Removes a temporary directory, and the files in it.
+     */
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir = opendir(directory);
+
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                /* a truncated path could be another file */
+                if (snprintf(path, PATH_MAX, "%s/%s", directory, entry->d_name) < PATH_MAX) {
+                    unlink(path);
+                }
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(directory);
+}
+
+static int write_file(const char *path, const char *data, size_t size) {
+    FILE *file = fopen(path, "w");
+    int exit_val = EXIT_SUCCESS;
+
+    if (file == NULL) {
+        return EIO;
+    }
+    if (size > 0 && fwrite(data, 1, size, file) != size) {
+        exit_val = EIO;
+    }
+    if (fclose(file) != 0) {
+        exit_val = EIO;
+    }
+    return exit_val;
+}
+
+static int add_result_file(Reply *reply, const char *path) {
+    /**
+     * Appends the contents of an output file to the reply body.
+     */
+    char buffer[1 << 16];
+    size_t nb_read;
+    int exit_val = EXIT_SUCCESS;
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        return EIO;
+    }
+    while (EXIT_SUCCESS == exit_val && (nb_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        exit_val = add_reply_data(reply, buffer, nb_read);
+    }
+    fclose(file);
+    return exit_val;
+}
+
+static int add_results(Reply *reply, const char *out_annotation_name, const char *out_tree_name) {
+    /**
+     * Adds the outputs of each column to the reply: their sizes as fields, and their contents as the body.
+     * The outputs are in a directory of their own, so that their number tells the number of columns.
+     */
+    size_t num_columns, column, pass;
+    char *names[2];
+    struct stat file_stat;
+    int exit_val = EXIT_SUCCESS;
+
+    /* the outputs of a single column are not numbered */
+    if (stat(out_annotation_name, &file_stat) == 0) {
+        num_columns = 1;
+    } else {
+        for (num_columns = 0;; num_columns++) {
+            names[0] = get_column_file_name(out_annotation_name, num_columns, 2);
+            exit_val = stat(names[0], &file_stat);
+            free(names[0]);
+            if (exit_val != 0) {
+                break;
+            }
+        }
+    }
+    add_reply(reply, "columns=%zd\n", num_columns);
+    /* the sizes first, then the contents */
+    for (pass = 0, exit_val = EXIT_SUCCESS; pass < 2 && EXIT_SUCCESS == exit_val; pass++) {
+        if (pass == 1) {
+            exit_val = add_reply(reply, "\n");
+        }
+        for (column = 0; column < num_columns && EXIT_SUCCESS == exit_val; column++) {
+            names[0] = get_column_file_name(out_annotation_name, column, num_columns);
+            names[1] = get_column_file_name(out_tree_name, column, num_columns);
+            if (pass == 0) {
+                if (stat(names[0], &file_stat) == 0) {
+                    add_reply(reply, "annotation_result=%zd\n", (size_t) file_stat.st_size);
+                } else {
+                    exit_val = EIO;
+                }
+                if (stat(names[1], &file_stat) == 0) {
+                    add_reply(reply, "tree_result=%zd\n", (size_t) file_stat.st_size);
+                } else {
+                    exit_val = EIO;
+                }
+            } else {
+                exit_val = add_result_file(reply, names[0]);
+                if (EXIT_SUCCESS == exit_val) {
+                    exit_val = add_result_file(reply, names[1]);
+                }
+            }
+            free(names[0]);
+            free(names[1]);
+        }
+    }
+    return exit_val;
+}
+
+static int make_run_paths(const char *directory, char **annotation_name, char **out_annotation_name,
+                          char **out_tree_name, char *annotation_path, char *out_annotation_path, char *out_tree_path) {
+    /**
+     * Sets the paths of a RUN that it does not give: the annotation body and the outputs returned in the reply
+     * go to the directory of the request, the other outputs next to the annotation file
+     * (as the tree file may be long gone). The paths are written into the given PATH_MAX buffers.
+     * Returns EINVAL if one of them is too long.
+     */
+    int inline_results = (*annotation_name == NULL && *out_annotation_name == NULL && *out_tree_name == NULL);
+    int exit_val = EXIT_SUCCESS;
+
+    if (*annotation_name == NULL) {
+        exit_val = make_path(annotation_path, "%s/annotation.csv", directory);
+        *annotation_name = annotation_path;
+    }
+    if (EXIT_SUCCESS == exit_val && inline_results) {
+        exit_val = make_path(out_annotation_path, "%s/out.csv", directory);
+        if (EXIT_SUCCESS == exit_val) {
+            exit_val = make_path(out_tree_path, "%s/out.nwk", directory);
+        }
+        *out_annotation_name = out_annotation_path;
+        *out_tree_name = out_tree_path;
+    }
+    if (EXIT_SUCCESS == exit_val && *out_annotation_name == NULL) {
+        exit_val = make_path(out_annotation_path, "%s.pastml.out.csv", *annotation_name);
+        *out_annotation_name = out_annotation_path;
+    }
+    if (EXIT_SUCCESS == exit_val && *out_tree_name == NULL) {
+        exit_val = make_path(out_tree_path, "%s.pastml.out.nwk", *annotation_name);
+        *out_tree_name = out_tree_path;
+    }
+    return exit_val;
+}
+
+static void handle_run(Server *server, const Request *request, Reply *reply) {
+    char *id = get_field(request, "tree");
+    char *model = get_field(request, "model");
+    char *threads = get_field(request, "threads");
+    char *huge_pages = get_field(request, "huge_pages");
+    char *annotation_name = get_field(request, "annotation");
+    char *out_annotation_name = get_field(request, "out_annotation");
+    char *out_tree_name = get_field(request, "out_tree");
+    char directory[PATH_MAX] = "";
+    char annotation_path[PATH_MAX], out_annotation_path[PATH_MAX], out_tree_path[PATH_MAX];
+    const char *tmp_dir = getenv("TMPDIR");
+    int inline_results, exit_val;
+    ResidentTree *resident;
+    AnalysisContext context = *server->defaults;
+
+    /* the analyses of several workers would be mixed up in the log, and the simulation outputs overwritten */
+    context.log = NULL;
+    context.simulation = FALSE;
+    context.tree_snapshot = NULL;
+    context.threads = 1;
+    if (id == NULL) {
+        set_error_reply(reply, EINVAL, "RUN needs a tree");
+        return;
+    }
+    if (model != NULL && EXIT_SUCCESS != parse_model(model, &context.model)) {
+        set_error_reply(reply, EINVAL, "the model must be JC, F81, HKY or JTT");
+        return;
+    }
+    if (threads != NULL && (context.threads = atoi(threads)) < 1) {
+        set_error_reply(reply, EINVAL, "the number of threads must be positive");
+        return;
+    }
+    /* a request cannot take more threads than the daemon was given */
+    context.threads = MIN(context.threads, server->defaults->threads);
+    if (huge_pages != NULL) {
+        context.huge_pages = (atoi(huge_pages) != 0);
+    }
+    if (annotation_name == NULL && request->body == NULL) {
+        set_error_reply(reply, EINVAL, "RUN needs an annotation, or an annotation body");
+        return;
+    }
+    inline_results = (annotation_name == NULL && out_annotation_name == NULL && out_tree_name == NULL);
+    if (annotation_name == NULL && !inline_results && (out_annotation_name == NULL || out_tree_name == NULL)) {
+        set_error_reply(reply, EINVAL, "for an annotation body, give both output paths, or none");
+        return;
+    }
+
+    /* an annotation body, and the outputs returned in the reply, go to a directory of the request */
+    if (annotation_name == NULL || inline_results) {
+        if (EXIT_SUCCESS != make_path(directory, "%s/pastml.XXXXXX", (tmp_dir != NULL) ? tmp_dir : "/tmp")) {
+            *directory = '\0';
+            set_error_reply(reply, EINVAL, "the temporary directory path is too long");
+            return;
+        }
+        if (mkdtemp(directory) == NULL) {
+            set_error_reply(reply, EIO, "could not create a temporary directory");
+            return;
+        }
+    }
+    if (EXIT_SUCCESS != make_run_paths(directory, &annotation_name, &out_annotation_name, &out_tree_name,
+                                       annotation_path, out_annotation_path, out_tree_path)) {
+        set_error_reply(reply, EINVAL, "a path is too long");
+        if (*directory != '\0') {
+            remove_directory(directory);
+        }
+        return;
+    }
+    if (annotation_name == annotation_path) {
+        if (EXIT_SUCCESS != write_file(annotation_path, request->body, request->body_size)) {
+            set_error_reply(reply, EIO, "could not write the annotation to a temporary file");
+            remove_directory(directory);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    for (resident = server->trees; resident != NULL && strcmp(resident->id, id) != 0; resident = resident->next);
+    if (resident != NULL) {
+        resident->users++;
+    }
+    pthread_mutex_unlock(&server->mutex);
+    if (resident == NULL) {
+        set_error_reply(reply, ENOENT, "no tree of this id");
+    } else {
+        exit_val = runpastml_on_tree(annotation_name, resident->tree, out_annotation_name, out_tree_name, &context);
+        pthread_mutex_lock(&server->mutex);
+        resident->users--;
+        release_tree(resident);
+        pthread_mutex_unlock(&server->mutex);
+
+        if (EXIT_SUCCESS != exit_val) {
+            set_error_reply(reply, exit_val, "the reconstruction failed, see the standard error of the daemon");
+        } else {
+            add_reply(reply, "OK\n");
+            if (inline_results) {
+                exit_val = add_results(reply, out_annotation_name, out_tree_name);
+                if (EXIT_SUCCESS != exit_val) {
+                    set_error_reply(reply, exit_val, "could not read the outputs");
+                }
+            } else {
+                /* for several columns, .column_<i> is added before their extensions */
+                if (EXIT_SUCCESS != add_reply(reply, "out_annotation=%s\nout_tree=%s\n", out_annotation_name,
+                                              out_tree_name)) {
+                    set_error_reply(reply, ENOMEM, "not enough memory for the reply");
+                }
+            }
+        }
+    }
+    if (*directory != '\0') {
+        remove_directory(directory);
+    }
+}
+
+static void serve_connection(Server *server, int connection) {
+    /**
+     * Reads the request of a connection, processes it, sends the reply and closes the connection.
+     */
+    struct timeval timeout = {SERVER_TIMEOUT, 0};
+    struct timespec time_start, time_end;
+    Request request;
+    Reply reply;
+    size_t size;
+    int error;
+    char *frame;
+
+    clock_gettime(CLOCK_MONOTONIC, &time_start);
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (EXIT_SUCCESS != start_reply(&reply)) {
+        close(connection);
+        return;
+    }
+
+    frame = read_frame(connection, &size, &error);
+    if (frame == NULL) {
+        if (error != EIO) {
+            set_error_reply(&reply, error, "the request could not be read");
+            send_reply(connection, &reply, 0);
+        }
+        free(reply.data);
+        close(connection);
+        return;
+    }
+    if (EXIT_SUCCESS != parse_request(frame, size, &request)) {
+        set_error_reply(&reply, EINVAL, "the request must be a command followed by key=value lines");
+    } else if (strcmp(request.command, "RUN") == 0) {
+        handle_run(server, &request, &reply);
+    } else if (strcmp(request.command, "TREE") == 0) {
+        handle_tree(server, &request, &reply);
+    } else if (strcmp(request.command, "FORGET") == 0) {
+        handle_forget(server, &request, &reply);
+    } else {
+        set_error_reply(&reply, EINVAL, "unknown command, it must be RUN, TREE or FORGET");
+    }
+    send_reply(connection, &reply, 0);
+    close(connection);
+
+    clock_gettime(CLOCK_MONOTONIC, &time_end);
+    log_info(server->defaults, "%s:\t%.*s (%.3f seconds)\n", (request.command != NULL) ? request.command : "?",
+             (int) strcspn(reply.data + sizeof(uint32_t), "\n"), reply.data + sizeof(uint32_t),
+             (double) (time_end.tv_sec - time_start.tv_sec) + (time_end.tv_nsec - time_start.tv_nsec) / 1e9);
+    free(frame);
+    free(reply.data);
+}
+
+static void *worker_main(void *arg) {
+    Server *server = (Server *) arg;
+    int connection;
+
+    pthread_mutex_lock(&server->mutex);
+    while (TRUE) {
+        while (server->nb_queued == 0 && !server->stopping) {
+            pthread_cond_wait(&server->queue_cond, &server->mutex);
+        }
+        /* the queued requests are still processed when stopping */
+        if (server->nb_queued == 0) {
+            break;
+        }
+        connection = server->queue[server->head];
+        server->head = (server->head + 1) % server->queue_size;
+        server->nb_queued--;
+        pthread_mutex_unlock(&server->mutex);
+        serve_connection(server, connection);
+        pthread_mutex_lock(&server->mutex);
+    }
+    pthread_mutex_unlock(&server->mutex);
+    return NULL;
+}
+
+static void refuse_connection(int connection) {
+    /**
+     * Answers that the queue is full, without waiting for the request (which is then not read).
+     */
+    Reply reply;
+
+    if (EXIT_SUCCESS == start_reply(&reply)) {
+        set_error_reply(&reply, EBUSY, "too many requests are queued, try again later");
+        send_reply(connection, &reply, MSG_DONTWAIT);
+    }
+    free(reply.data);
+    close(connection);
+}
+
+static int open_socket(const char *socket_path) {
+    /**
+     * Creates the listening socket, accessible to the current user only.
+     * A socket file left by a daemon that is not running anymore is replaced.
+     */
+    struct sockaddr_un address;
+    struct stat file_stat;
+    mode_t mask;
+    int listener, probe, exit_val;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path %s is too long (at most %zd characters).\n", socket_path,
+                sizeof(address.sun_path) - 1);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    if (lstat(socket_path, &file_stat) == 0) {
+        if (!S_ISSOCK(file_stat.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket.\n", socket_path);
+            return -1;
+        }
+        probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        exit_val = connect(probe, (struct sockaddr *) &address, sizeof(address));
+        close(probe);
+        if (exit_val == 0) {
+            fprintf(stderr, "Another daemon is already serving on %s.\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+        fprintf(stderr, "Could not create the socket: %s\n", strerror(errno));
+        return -1;
+    }
+    mask = umask(0177);
+    exit_val = bind(listener, (struct sockaddr *) &address, sizeof(address));
+    umask(mask);
+    if (exit_val == -1 || listen(listener, SOMAXCONN) == -1) {
+        fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+int serve(const char *socket_path, char *tree_name, int workers, const AnalysisContext *defaults) {
+    /**
+     * Serves the requests (see server.h) on the socket until SIGINT or SIGTERM, with the given number of workers.
+     * The tree file, if not NULL, is parsed first and kept under its path. The defaults give the model
+     * and the huge pages option of the requests that do not set them, and where to log them.
+     */
+    Server server;
+    ResidentTree *resident;
+    pthread_t *threads;
+    struct sigaction action;
+    sigset_t signals, old_signals;
+    int listener, connection, nb_threads = 0, i;
+    int exit_val = EXIT_SUCCESS;
+
+    server.defaults = defaults;
+    server.trees = NULL;
+    server.head = 0;
+    server.nb_queued = 0;
+    server.stopping = FALSE;
+    server.queue_size = (size_t) workers * SERVER_QUEUE_PER_WORKER;
+    server.queue = malloc(server.queue_size * sizeof(int));
+    threads = malloc((size_t) workers * sizeof(pthread_t));
+    if (server.queue == NULL || threads == NULL) {
+        free(server.queue);
+        free(threads);
+        return ENOMEM;
+    }
+    pthread_mutex_init(&server.mutex, NULL);
+    pthread_cond_init(&server.queue_cond, NULL);
+
+    if (tree_name != NULL) {
+        resident = read_resident_tree(&server, tree_name, tree_name);
+        if (resident == NULL) {
+            fprintf(stderr, "A problem occurred while reading the tree %s.\n", tree_name);
+            exit_val = EXIT_FAILURE;
+        } else {
+            log_info(defaults, "TREE:\t%s (%zd tips)\n", tree_name, resident->tree->nb_taxa);
+            keep_tree(&server, resident);
+        }
+    }
+
+    listener = (EXIT_SUCCESS == exit_val) ? open_socket(socket_path) : -1;
+    if (listener == -1) {
+        exit_val = EXIT_FAILURE;
+    } else {
+        /* the signals stop the accepting thread only, the workers inherit their blocking */
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_stop_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+        while (nb_threads < workers && pthread_create(&threads[nb_threads], NULL, worker_main, &server) == 0) {
+            nb_threads++;
+        }
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+        log_info(defaults, "SERVING:\t%s (%d workers, up to %zd queued requests)\n\n", socket_path, nb_threads,
+                 server.queue_size);
+
+        while (nb_threads > 0 && !stop_signal) {
+            connection = accept(listener, NULL, NULL);
+            if (connection == -1) {
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    fprintf(stderr, "Could not accept a connection: %s\n", strerror(errno));
+                    exit_val = EXIT_FAILURE;
+                    break;
+                }
+                continue;
+            }
+            pthread_mutex_lock(&server.mutex);
+            if (server.nb_queued == server.queue_size) {
+                pthread_mutex_unlock(&server.mutex);
+                refuse_connection(connection);
+                continue;
+            }
+            server.queue[(server.head + server.nb_queued) % server.queue_size] = connection;
+            server.nb_queued++;
+            pthread_cond_signal(&server.queue_cond);
+            pthread_mutex_unlock(&server.mutex);
+        }
+        close(listener);
+        unlink(socket_path);
+        log_info(defaults, "\nSTOPPING...\n");
+    }
+
+    pthread_mutex_lock(&server.mutex);
+    server.stopping = TRUE;
+    pthread_cond_broadcast(&server.queue_cond);
+    pthread_mutex_unlock(&server.mutex);
+    for (i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    while (server.trees != NULL) {
+        resident = server.trees;
+        server.trees = resident->next;
+        free_tree(resident->tree);
+        free(resident->id);
+        free(resident);
+    }
+    pthread_cond_destroy(&server.queue_cond);
+    pthread_mutex_destroy(&server.mutex);
+    free(server.queue);
+    free(threads);
+    return exit_val;
+}
@@ -0,0 +1,44 @@
+#ifndef PASTML_SERVER_H
+#define PASTML_SERVER_H
+
+#include "pastml.h"
+
+/* The daemon mode of PASTML (PASTML --serve SOCKET): trees are parsed once and stay in memory, and the reconstructions
+ * on them are requested over a Unix domain socket, which is only accessible to the user running the daemon.
+ *
+ * A client connects, sends one request frame, reads one reply frame, and the connection is closed.
+ * A frame is its length in bytes (4 bytes, in network byte order) followed by its text: a command or a status line,
+ * then key=value lines, then, optionally, an empty line followed by a body.
+ *
+ *   TREE      path=TREE_FILE [id=ID]          parses a newick file (its first tree) or a tree snapshot, and keeps it
+ *                                             under the given id (the path by default), replacing any tree of that id;
+ *                                             answers id, tips and nodes
+ *   FORGET    id=ID                           frees a tree once the reconstructions on it are done
+ *   RUN       tree=ID [model=MODEL] [threads=THREADS] [huge_pages=1]
+ *             [annotation=ANNOTATION_FILE] [out_annotation=OUTPUT_ANNOTATION_FILE] [out_tree=OUTPUT_TREE_NWK]
+ *                                             reconstructs the ancestral states of the annotation file, or of the
+ *                                             annotation csv given as the body, as the command line tool would do;
+ *                                             answers the paths of the outputs (by default next to the annotation
+ *                                             file), or, for an annotation body and no output paths, the outputs
+ *                                             themselves: annotation_result=SIZE and tree_result=SIZE for each column,
+ *                                             their contents following in the body in the same order
+ *                                             (threads is capped at the number of workers of the daemon, and the paths
+ *                                             made from the given ones must fit in PATH_MAX, otherwise EINVAL)
+ *
+ * The reply starts with OK, or with ERROR and an error code (e.g. EINVAL, ENOENT), its reason being given as message.
+ * The requests are processed by a fixed number of workers, those that find all the workers busy wait in a queue
+ * of SERVER_QUEUE_PER_WORKER requests per worker, and once it is full the new ones are answered ERROR EBUSY
+ * right away (possibly before they are read). SIGINT or SIGTERM stops the daemon once the queued requests are done. */
+
+/* the queued requests per worker, before the next ones are refused */
+#define SERVER_QUEUE_PER_WORKER 16
+/* the frames longer than this are refused, which bounds the memory taken by a request */
+#define SERVER_MAX_FRAME (64 * 1024 * 1024)
+/* the maximal number of key=value lines of a request */
+#define SERVER_MAX_FIELDS 32
+/* seconds a client has to send its request, and to read the reply */
+#define SERVER_TIMEOUT 30
+
+int serve(const char *socket_path, char *tree_name, int workers, const AnalysisContext *defaults);
+
+#endif //PASTML_SERVER_H
@@ -17,9 +17,9 @@ except:
 pastml_module = Extension('pastml',
                           sources=['pastmlpymodule.c', 'runpastml.c', 'make_tree.c',
                                    'likelihood.c', 'marginal_likelihood.c', 'marginal_approximation.c',
-                                   'output_tree.c', 'output_states.c',
-                                   'scaling.c', 'param_minimization.c', 'logger.c'],
-                          libraries=['gsl', 'gslcblas']
+                                   'joint_likelihood.c', 'output_tree.c', 'output_states.c', 'output_simulation.c',
+                                   'models.c', 'eigen.c', 'scaling.c', 'param_minimization.c', 'logger.c', 'arena.c', 'traversal.c', 'kernels.c', 'parallel.c', 'name_index.c', 'tree_snapshot.c', 'clade_summary.c', 'libpastml.c'],
+                          libraries=['gsl', 'gslcblas', 'pthread']
                           )
 
 setup(
@@ -44,5 +44,7 @@ setup(
     headers=['pastml.h', 'runpastml.h', 'make_tree.h',
              'likelihood.h', 'marginal_likelihood.h', 'marginal_approximation.h',
              'output_tree.h', 'output_states.h',
-             'scaling.h', 'param_minimization.h', 'logger.h']
+             'scaling.h', 'param_minimization.h', 'logger.h', 'arena.h', 'traversal.h', 'kernels.h', 'parallel.h',
+             'joint_likelihood.h', 'output_simulation.h', 'models.h', 'eigen.h', 'name_index.h', 'tree_snapshot.h',
+             'clade_summary.h', 'libpastml.h']
 )
@@ -0,0 +1,95 @@
+#include <unistd.h>
+#include "../pastml.h"
+#include "../runpastml.h"
+
+/* Checks of the annotation csv reader on the line endings and quotings it accepts.
+ * Returns EXIT_FAILURE (after printing the mismatches) if any of them fails. */
+
+#define NB_COLUMNS 2
+
+typedef struct __AnnotationCase {
+    const char *name;
+    const char *csv;
+    size_t num_tips;
+    const char *tips[5];
+    const char *values[NB_COLUMNS][5]; /* the columns of the case, NULL past its last one */
+} AnnotationCase;
+
+static const AnnotationCase cases[] = {
+        {"LF", "a,A\nb,B\nc,\nd,B\n", 4, {"a", "b", "c", "d"}, {{"A", "B", "?", "B"}}},
+        {"CRLF", "a,A\r\nb,B\r\n\r\nc,A", 3, {"a", "b", "c"}, {{"A", "B", "A"}}},
+        {"CR", "a,A\rb,B\rc,A\rd,B\re,A\r", 5, {"a", "b", "c", "d", "e"}, {{"A", "B", "A", "B", "A"}}},
+        {"quoted comma", "\"a,1\",A,X\n\"b\"\"2\",\"B,C\",\n", 2, {"a,1", "b\"2"}, {{"A", "B,C"}, {"X", "?"}}},
+        {"quoted newline", "\"a\nb\",A\r\n\"c\rd\",\"B\r\nC\"\r\n", 2, {"a\nb", "c\rd"}, {{"A", "B\r\nC"}}},
+        /* the quotes only count at the start of a field, so that there are more rows than counted beforehand */
+        {"misplaced quote", "a\"b,A\nc,B\nd\"e,A\n", 3, {"a\"b", "c", "d\"e"}, {{"A", "B", "A"}}},
+};
+
+static int check_case(const AnnotationCase *test_case) {
+    /**
+     * Reads the csv of the case from a temporary file, and compares the tip names and values with the expected ones.
+     */
+    char path[] = "/tmp/pastml_annotationsXXXXXX";
+    char **tips, *strings, ***values;
+    size_t num_columns, num_tips, i, j, expected_columns;
+    int ok = TRUE;
+    int fd = mkstemp(path);
+
+    if (fd == -1) {
+        fprintf(stderr, "%s: could not create a temporary file.\n", test_case->name);
+        return FALSE;
+    }
+    if (write(fd, test_case->csv, strlen(test_case->csv)) != (ssize_t) strlen(test_case->csv)) {
+        fprintf(stderr, "%s: could not write the temporary file.\n", test_case->name);
+        close(fd);
+        unlink(path);
+        return FALSE;
+    }
+    close(fd);
+    values = read_annotations(path, &tips, &strings, &num_columns, &num_tips);
+    unlink(path);
+    if (values == NULL) {
+        fprintf(stderr, "%s: could not be read.\n", test_case->name);
+        return FALSE;
+    }
+
+    for (expected_columns = 0; expected_columns < NB_COLUMNS && test_case->values[expected_columns][0] != NULL;
+         expected_columns++);
+    if (num_tips != test_case->num_tips || num_columns != expected_columns) {
+        fprintf(stderr, "%s: %zd tips and %zd columns instead of %zd and %zd.\n", test_case->name, num_tips,
+                num_columns, test_case->num_tips, expected_columns);
+        ok = FALSE;
+    }
+    for (i = 0; ok && i < num_tips; i++) {
+        if (strcmp(tips[i], test_case->tips[i]) != 0) {
+            fprintf(stderr, "%s: tip %zd is \"%s\" instead of \"%s\".\n", test_case->name, i, tips[i],
+                    test_case->tips[i]);
+            ok = FALSE;
+        }
+        for (j = 0; j < num_columns; j++) {
+            if (strcmp(values[j][i], test_case->values[j][i]) != 0) {
+                fprintf(stderr, "%s: value %zd of tip %zd is \"%s\" instead of \"%s\".\n", test_case->name, j, i,
+                        values[j][i], test_case->values[j][i]);
+                ok = FALSE;
+            }
+        }
+    }
+
+    for (j = 0; j < num_columns; j++) {
+        free(values[j]);
+    }
+    free(values);
+    free(tips);
+    free(strings);
+    return ok;
+}
+
+int main(void) {
+    size_t i;
+    int ok = TRUE;
+
+    for (i = 0; i < sizeof(cases) / sizeof(AnnotationCase); i++) {
+        ok &= check_case(&cases[i]);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,191 @@
+#include "../pastml.h"
+#include "../make_tree.h"
+#include "../runpastml.h"
+#include "../arena.h"
+#include "../likelihood.h"
+#include "../models.h"
+
+/* Checks of the likelihood calculations against slower or numerical ones, on in-memory trees.
+ * Returns EXIT_FAILURE (after printing the mismatches) if any of them fails. */
+
+#define NB_STATES 3
+#define NB_HKY_STATES 4
+/* not a multiple of the vector width, so that the remaining lanes are checked too */
+#define NB_LANES 5
+/* the root, its tip children, a polytomy below it and its tips */
+#define NB_ROOT_TIPS 30
+#define NB_POLYTOMY_TIPS 10
+#define NB_NODES (1 + NB_ROOT_TIPS + 1 + NB_POLYTOMY_TIPS)
+
+static Tree *make_star_tree(const AnalysisContext *context) {
+    /**
+     * A star tree of NB_ROOT_TIPS tips and an inner node (the last child of the root),
+     * itself the root of a star of NB_POLYTOMY_TIPS tips, with various branch lengths.
+     */
+    int parents[NB_NODES];
+    double branch_lengths[NB_NODES];
+    int i, polytomy = NB_ROOT_TIPS + 1;
+
+    parents[0] = -1;
+    branch_lengths[0] = 0.0;
+    for (i = 1; i < NB_NODES; i++) {
+        parents[i] = (i <= polytomy) ? 0 : polytomy;
+        branch_lengths[i] = 0.05 + 0.3 * (double) ((i * 7) % 11) / 11.0;
+    }
+    return make_tree_from_parents(NB_NODES, parents, branch_lengths, NULL, context);
+}
+
+static Arena *set_up_arena(Tree *s_tree, size_t num_annotations, const AnalysisContext *context) {
+    /**
+     * Sets the tip states of a character, every fifth tip having missing data.
+     */
+    int id;
+    Arena *arena = allocate_arena((size_t) s_tree->nb_nodes, num_annotations, context);
+
+    if (arena == NULL) {
+        return NULL;
+    }
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        if (s_tree->nodes[id] != s_tree->root && s_tree->nodes[id]->nb_neigh == 1) {
+            set_tip_probabilities(arena, id,
+                                  (id % 5 == 0) ? num_annotations : (size_t) ((id * id) % num_annotations),
+                                  num_annotations);
+        }
+    }
+    mark_missing_data(s_tree, arena, num_annotations);
+    return arena;
+}
+
+static int check_close(const char *what, size_t i, double value, double expected, double tolerance) {
+    if (fabs(value - expected) > tolerance * MAX(1.0, fabs(expected))) {
+        fprintf(stderr, "%s %zd: %.12f instead of %.12f\n", what, i, value, expected);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int test_gradient(Tree *s_tree, Arena *arena) {
+    /**
+     * Compares the analytic gradient of the log likelihood with central finite differences.
+     */
+    double parameters[NB_STATES + 2] = {0.2, 0.3, 0.5, 1.0 / s_tree->avg_branch_len, s_tree->min_branch_len / 3.0};
+    double gradient[NB_STATES + 2];
+    double step, upper, lower, saved;
+    size_t i;
+    int ok = TRUE;
+
+    calculate_bottom_up_likelihood(s_tree, arena, NB_STATES, parameters);
+    calculate_log_likelihood_gradient(s_tree, arena, NB_STATES, parameters, gradient);
+    for (i = 0; i < NB_STATES + 2; i++) {
+        saved = parameters[i];
+        step = 1e-6 * saved;
+        parameters[i] = saved + step;
+        upper = calculate_bottom_up_likelihood(s_tree, arena, NB_STATES, parameters);
+        parameters[i] = saved - step;
+        lower = calculate_bottom_up_likelihood(s_tree, arena, NB_STATES, parameters);
+        parameters[i] = saved;
+        ok &= check_close("Gradient of parameter", i, gradient[i], (upper - lower) / (2.0 * step), 1e-5);
+    }
+    return ok;
+}
+
+static int test_lanes(Tree *s_tree, Arena *arena, size_t num_annotations, const double *frequencies) {
+    /**
+     * Compares the likelihood of each lane of the batched evaluation with its single-vector calculation,
+     * the lanes having various scaling factors and epsilons.
+     */
+    double lane_parameters[NB_LANES][num_annotations + 2];
+    double *lane_pointers[NB_LANES];
+    double log_likelihoods[NB_LANES];
+    size_t i, l;
+    int ok = TRUE;
+    AnalysisContext context;
+    LaneArena *lanes;
+
+    init_context(&context);
+    context.model = arena->model;
+    lanes = allocate_lane_arena((size_t) s_tree->nb_nodes, num_annotations, NB_LANES, &context);
+    if (lanes == NULL) {
+        return FALSE;
+    }
+    for (l = 0; l < NB_LANES; l++) {
+        for (i = 0; i < num_annotations; i++) {
+            lane_parameters[l][i] = frequencies[i];
+        }
+        lane_parameters[l][num_annotations] = (0.05 + (double) l) / s_tree->avg_branch_len;
+        lane_parameters[l][num_annotations + 1] = s_tree->min_branch_len / (double) (l + 2);
+        lane_pointers[l] = lane_parameters[l];
+    }
+    calculate_bottom_up_likelihoods(s_tree, arena, lanes, num_annotations, lane_pointers, log_likelihoods);
+    free_lane_arena(lanes);
+    for (l = 0; l < NB_LANES; l++) {
+        ok &= check_close("Log likelihood of lane", l, log_likelihoods[l],
+                          calculate_bottom_up_likelihood(s_tree, arena, num_annotations, lane_parameters[l]), 1e-10);
+    }
+    return ok;
+}
+
+static int test_all_missing(Tree *s_tree, const AnalysisContext *context) {
+    /**
+     * Checks that the likelihood of a character whose tips are all missing stays 1 over several evaluations.
+     */
+    double parameters[NB_STATES + 2] = {0.2, 0.3, 0.5, 1.0 / s_tree->avg_branch_len, s_tree->min_branch_len};
+    size_t i;
+    int id, ok = TRUE;
+    Arena *arena = allocate_arena((size_t) s_tree->nb_nodes, NB_STATES, context);
+
+    if (arena == NULL) {
+        return FALSE;
+    }
+    for (id = 0; id < s_tree->nb_nodes; id++) {
+        if (s_tree->nodes[id] != s_tree->root && s_tree->nodes[id]->nb_neigh == 1) {
+            set_tip_probabilities(arena, id, NB_STATES, NB_STATES);
+        }
+    }
+    mark_missing_data(s_tree, arena, NB_STATES);
+    for (i = 0; i < 3; i++) {
+        ok &= check_close("Log likelihood of missing data, evaluation", i,
+                          calculate_bottom_up_likelihood(s_tree, arena, NB_STATES, parameters), 0.0, 1e-12);
+    }
+    free_arena(arena);
+    return ok;
+}
+
+int main(void) {
+    AnalysisContext context;
+    Tree *s_tree;
+    Arena *arena;
+    double f81_frequencies[NB_STATES] = {0.2, 0.3, 0.5};
+    double hky_frequencies[NB_HKY_STATES];
+    int ok;
+
+    init_context(&context);
+    context.log = NULL;
+    context.model = MODEL_F81;
+    s_tree = make_star_tree(&context);
+    if (s_tree == NULL) {
+        return EXIT_FAILURE;
+    }
+    arena = set_up_arena(s_tree, NB_STATES, &context);
+    if (arena == NULL) {
+        free_tree(s_tree);
+        return EXIT_FAILURE;
+    }
+    ok = test_gradient(s_tree, arena);
+    ok &= test_lanes(s_tree, arena, NB_STATES, f81_frequencies);
+    free_arena(arena);
+    ok &= test_all_missing(s_tree, &context);
+
+    context.model = MODEL_HKY;
+    set_model_frequencies(MODEL_HKY, hky_frequencies);
+    arena = set_up_arena(s_tree, NB_HKY_STATES, &context);
+    if (arena == NULL) {
+        free_tree(s_tree);
+        return EXIT_FAILURE;
+    }
+    ok &= test_lanes(s_tree, arena, NB_HKY_STATES, hky_frequencies);
+    free_arena(arena);
+
+    free_tree(s_tree);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
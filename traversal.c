@@ -0,0 +1,103 @@
+#include "traversal.h"
+
+TraversalPlan *build_traversal_plan(const Tree *s_tree) {
+    /**
+     * Flattens the tree topology into arrays of node ids (parents, children, pre- and post-order),
+     * so that the likelihood passes can iterate over the tree instead of recursing into it.
+     * The children keep the order of the node neighbours.
+     */
+    int n = s_tree->nb_nodes;
+    int i, k, top, id, first_child_index;
+    Node *nd;
+    int *stack;
+    TraversalPlan *plan = malloc(sizeof(TraversalPlan));
+    if (plan == NULL) {
+        return NULL;
+    }
+    plan->nb_nodes = n;
+    plan->post_order = malloc(n * sizeof(int));
+    plan->pre_order = malloc(n * sizeof(int));
+    plan->parent = malloc(n * sizeof(int));
+    plan->child_offset = malloc((n + 1) * sizeof(int));
+    plan->children = malloc(n * sizeof(int));
+    plan->subtree_size = malloc(n * sizeof(int));
+    plan->post_order_index = malloc(n * sizeof(int));
+    stack = malloc(n * sizeof(int));
+    if (plan->post_order == NULL || plan->pre_order == NULL || plan->parent == NULL
+        || plan->child_offset == NULL || plan->children == NULL
+        || plan->subtree_size == NULL || plan->post_order_index == NULL || stack == NULL) {
+        free(stack);
+        free_traversal_plan(plan);
+        return NULL;
+    }
+
+    /* children and parents */
+    plan->child_offset[0] = 0;
+    for (id = 0; id < n; id++) {
+        nd = s_tree->nodes[id];
+        plan->child_offset[id + 1] = plan->child_offset[id];
+        if (nd == s_tree->root) {
+            plan->parent[id] = -1;
+            first_child_index = 0;
+        } else {
+            plan->parent[id] = nd->neigh[0]->id;
+            first_child_index = 1;
+        }
+        /* tips have only their parent as a neighbour */
+        if (nd->nb_neigh == 1 && nd != s_tree->root) {
+            continue;
+        }
+        for (k = first_child_index; k < nd->nb_neigh; k++) {
+            plan->children[plan->child_offset[id + 1]++] = nd->neigh[k]->id;
+        }
+    }
+
+    /* pre-order: the first child is popped first, as its siblings are pushed on top of the stack in reverse order */
+    top = 0;
+    i = 0;
+    stack[top++] = s_tree->root->id;
+    while (top > 0) {
+        id = stack[--top];
+        plan->pre_order[i++] = id;
+        for (k = plan->child_offset[id + 1] - 1; k >= plan->child_offset[id]; k--) {
+            stack[top++] = plan->children[k];
+        }
+    }
+
+    /* post-order: the reverse of the pre-order where the last child is visited first */
+    top = 0;
+    i = n;
+    stack[top++] = s_tree->root->id;
+    while (top > 0) {
+        id = stack[--top];
+        plan->post_order[--i] = id;
+        for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+            stack[top++] = plan->children[k];
+        }
+    }
+    free(stack);
+
+    /* subtree sizes: the subtree of a node occupies the post_order positions
+     * post_order_index[id] - subtree_size[id] + 1, ..., post_order_index[id] */
+    for (i = 0; i < n; i++) {
+        id = plan->post_order[i];
+        plan->post_order_index[id] = i;
+        plan->subtree_size[id] = 1;
+        for (k = plan->child_offset[id]; k < plan->child_offset[id + 1]; k++) {
+            plan->subtree_size[id] += plan->subtree_size[plan->children[k]];
+        }
+    }
+    return plan;
+}
+
+void free_traversal_plan(TraversalPlan *plan) {
+    if (plan == NULL) return;
+    free(plan->post_order);
+    free(plan->pre_order);
+    free(plan->parent);
+    free(plan->child_offset);
+    free(plan->children);
+    free(plan->subtree_size);
+    free(plan->post_order_index);
+    free(plan);
+}
@@ -0,0 +1,9 @@
+#ifndef PASTML_TRAVERSAL_H
+#define PASTML_TRAVERSAL_H
+
+#include "pastml.h"
+
+TraversalPlan *build_traversal_plan(const Tree *s_tree);
+void free_traversal_plan(TraversalPlan *plan);
+
+#endif //PASTML_TRAVERSAL_H
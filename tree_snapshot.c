@@ -0,0 +1,270 @@
+#include <stdint.h>
+#include <errno.h>
+#include "tree_snapshot.h"
+#include "make_tree.h"
+#include "traversal.h"
+
+/* A tree snapshot is the parsed tree, as written by write_tree_snapshot, in native byte order:
+ * the header, then, for nb_nodes nodes in id order (the root being 0):
+ *     double branch_len[nb_nodes];
+ *     uint64_t name_offset[nb_nodes];      offsets of the null-terminated node names into names
+ *     int32_t parent[nb_nodes];            -1 for the root
+ *     int32_t child_offset[nb_nodes + 1];  the children of node id are children[child_offset[id]..child_offset[id + 1]]
+ *     int32_t children[nb_nodes - 1];      in the order of the node neighbours
+ *     char names[names_length];
+ * The 8-byte arrays come first so that they are aligned in the mapped file. */
+typedef struct __TreeSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    /* 0x01020304 as written */
+    uint64_t nb_nodes;
+    uint64_t nb_edges;
+    uint64_t nb_taxa;
+    uint64_t names_length;
+    double avg_branch_len;
+    double min_branch_len;
+    double avg_tip_branch_len;
+} TreeSnapshotHeader;
+
+#define BYTE_ORDER_MARK 0x01020304U
+
+static int is_tree(size_t n, const int32_t *parent, const int32_t *child_offset, const int32_t *children) {
+    /* checks that the children (whose ids are within bounds) agree with the parents,
+       and that all the nodes descend from the root, each once (a node listed twice as a child is rejected,
+       even if its parent agrees, as it would take the place of a node that is never reached) */
+    size_t nb_visited = 1, i;
+    int32_t k;
+    int32_t *queue = malloc(n * sizeof(int32_t));
+    char *visited = calloc(n, sizeof(char));
+    int result = TRUE;
+    if (queue == NULL || visited == NULL) {
+        free(queue);
+        free(visited);
+        return FALSE;
+    }
+    queue[0] = 0;
+    visited[0] = TRUE;
+    for (i = 0; i < nb_visited && result; i++) {
+        for (k = child_offset[queue[i]]; k < child_offset[queue[i] + 1]; k++) {
+            if (parent[children[k]] != queue[i] || visited[children[k]] || nb_visited == n) {
+                result = FALSE;
+                break;
+            }
+            visited[children[k]] = TRUE;
+            queue[nb_visited++] = children[k];
+        }
+    }
+    free(queue);
+    free(visited);
+    return result && nb_visited == n;
+}
+
+static size_t get_snapshot_size(const TreeSnapshotHeader *header) {
+    size_t n = (size_t) header->nb_nodes;
+    return sizeof(TreeSnapshotHeader) + n * (sizeof(double) + sizeof(uint64_t))
+           + (3 * n) * sizeof(int32_t) + (size_t) header->names_length;
+}
+
+int write_tree_snapshot(const Tree *s_tree, const char *snapshot_path) {
+    /**
+     * Saves the parsed tree (its topology, branch lengths, names and statistics) into a file
+     * that load_tree_snapshot can then use as is, instead of parsing the newick tree again.
+     */
+    const TraversalPlan *plan = s_tree->plan;
+    TreeSnapshotHeader header;
+    size_t n = (size_t) s_tree->nb_nodes, i;
+    uint64_t offset = 0;
+    int32_t value;
+    int exit_val = EXIT_SUCCESS;
+
+    FILE *snapshot_file = fopen(snapshot_path, "wb");
+    if (snapshot_file == NULL) {
+        fprintf(stderr, "Tree snapshot %s could not be created: %s\n", snapshot_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    memset(&header, 0, sizeof(TreeSnapshotHeader));
+    memcpy(header.magic, TREE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = TREE_SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.nb_nodes = n;
+    header.nb_edges = (uint64_t) s_tree->nb_edges;
+    header.nb_taxa = s_tree->nb_taxa;
+    for (i = 0; i < n; i++) {
+        header.names_length += strlen(s_tree->nodes[i]->name) + 1;
+    }
+    header.avg_branch_len = s_tree->avg_branch_len;
+    header.min_branch_len = s_tree->min_branch_len;
+    header.avg_tip_branch_len = s_tree->avg_tip_branch_len;
+    fwrite(&header, sizeof(TreeSnapshotHeader), 1, snapshot_file);
+
+    for (i = 0; i < n; i++) {
+        fwrite(&s_tree->nodes[i]->branch_len, sizeof(double), 1, snapshot_file);
+    }
+    for (i = 0; i < n; i++) {
+        fwrite(&offset, sizeof(uint64_t), 1, snapshot_file);
+        offset += strlen(s_tree->nodes[i]->name) + 1;
+    }
+    for (i = 0; i < n; i++) {
+        value = (int32_t) plan->parent[i];
+        fwrite(&value, sizeof(int32_t), 1, snapshot_file);
+    }
+    for (i = 0; i <= n; i++) {
+        value = (int32_t) plan->child_offset[i];
+        fwrite(&value, sizeof(int32_t), 1, snapshot_file);
+    }
+    for (i = 0; i + 1 < n; i++) {
+        value = (int32_t) plan->children[i];
+        fwrite(&value, sizeof(int32_t), 1, snapshot_file);
+    }
+    for (i = 0; i < n; i++) {
+        fwrite(s_tree->nodes[i]->name, sizeof(char), strlen(s_tree->nodes[i]->name) + 1, snapshot_file);
+    }
+
+    if (ferror(snapshot_file)) {
+        fprintf(stderr, "Tree snapshot %s could not be written: %s\n", snapshot_path, strerror(errno));
+        exit_val = EXIT_FAILURE;
+    }
+    if (fclose(snapshot_file) != 0) {
+        exit_val = EXIT_FAILURE;
+    }
+    return exit_val;
+}
+
+int is_tree_snapshot(const void *data, size_t size) {
+    return size >= sizeof(TreeSnapshotHeader)
+           && memcmp(((const TreeSnapshotHeader *) data)->magic, TREE_SNAPSHOT_MAGIC, 8) == 0;
+}
+
+Tree *load_tree_snapshot(void *data, size_t size, const AnalysisContext *context) {
+    /**
+     * Makes the tree saved in the given (mapped) snapshot, which must stay mapped as long as the tree is used:
+     * the node names point into it, and free_tree unmaps it.
+     * Only the nodes, their neighbours and sim names, and the traversal plan are allocated:
+     * nothing is parsed, and the tree statistics are read from the snapshot.
+     */
+    const TreeSnapshotHeader *header = (const TreeSnapshotHeader *) data;
+    const double *branch_len;
+    const uint64_t *name_offset;
+    const int32_t *parent, *child_offset, *children;
+    const char *names;
+    Node **neigh;
+    char *sim_names;
+    Node *nd;
+    Tree *t;
+    size_t n, i, nb_inner = 0;
+    int32_t k, max_children = 0;
+
+    if (header->version != TREE_SNAPSHOT_VERSION || header->byte_order != BYTE_ORDER_MARK) {
+        fprintf(stderr, "Tree snapshot version %u is not supported (or was written on another platform),"
+                " please recreate it from the newick tree.\n", header->version);
+        return NULL;
+    }
+    n = (size_t) header->nb_nodes;
+    /* names_length is checked first, so that it cannot wrap the size around */
+    if (n == 0 || n > INT_MAX || header->names_length > size || size != get_snapshot_size(header)) {
+        fprintf(stderr, "Tree snapshot is truncated or corrupted.\n");
+        return NULL;
+    }
+    branch_len = (const double *) (header + 1);
+    name_offset = (const uint64_t *) (branch_len + n);
+    parent = (const int32_t *) (name_offset + n);
+    child_offset = parent + n;
+    children = child_offset + n + 1;
+    names = (const char *) (children + n - 1);
+
+    /* the indices are checked, as the tree is used without any other validation */
+    if (parent[0] != -1 || child_offset[0] != 0 || child_offset[n] != (int32_t) (n - 1)
+        || header->names_length == 0 || names[header->names_length - 1] != '\0') {
+        fprintf(stderr, "Tree snapshot is truncated or corrupted.\n");
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (child_offset[i + 1] < child_offset[i] || child_offset[i + 1] > (int32_t) (n - 1)
+            || name_offset[i] >= header->names_length || (i > 0 && (parent[i] < 0 || parent[i] >= (int32_t) n))) {
+            fprintf(stderr, "Tree snapshot is truncated or corrupted.\n");
+            return NULL;
+        }
+        if (child_offset[i + 1] > child_offset[i] && i > 0) {
+            nb_inner++;
+        }
+        max_children = MAX(max_children, child_offset[i + 1] - child_offset[i]);
+    }
+    for (i = 0; i + 1 < n; i++) {
+        if (children[i] <= 0 || children[i] >= (int32_t) n) {
+            fprintf(stderr, "Tree snapshot is truncated or corrupted.\n");
+            return NULL;
+        }
+    }
+    if (!is_tree(n, parent, child_offset, children)) {
+        fprintf(stderr, "Tree snapshot is truncated or corrupted.\n");
+        return NULL;
+    }
+
+    t = malloc(sizeof(Tree));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->nb_nodes = (int) n;
+    t->nb_edges = (int) header->nb_edges;
+    t->nb_taxa = (size_t) header->nb_taxa;
+    t->next_avail_node_id = (int) n;
+    t->avg_branch_len = header->avg_branch_len;
+    t->min_branch_len = header->min_branch_len;
+    t->avg_tip_branch_len = header->avg_tip_branch_len;
+    t->snapshot = data;
+    t->snapshot_size = size;
+    t->plan = NULL;
+    t->nodes = malloc(n * sizeof(Node *));
+    t->node_slab = calloc(n, sizeof(Node));
+    /* every node but the root is the neighbour of its parent and of its children */
+    t->snapshot_slab = malloc(2 * (n - 1) * sizeof(Node *) + nb_inner * GENERATED_NAME_LENGTH * sizeof(char));
+    if (t->nodes == NULL || t->node_slab == NULL || t->snapshot_slab == NULL) {
+        fprintf(stderr, "Not enough memory to load the tree snapshot.\n");
+        free(t->nodes);
+        free(t->node_slab);
+        free(t->snapshot_slab);
+        free(t);
+        return NULL;
+    }
+    neigh = (Node **) t->snapshot_slab;
+    sim_names = (char *) (neigh + 2 * (n - 1));
+    t->root = t->node_slab;
+
+    for (i = 0; i < n; i++) {
+        nd = t->node_slab + i;
+        t->nodes[i] = nd;
+        nd->id = (int) i;
+        nd->branch_len = branch_len[i];
+        nd->name = (char *) names + name_offset[i];
+        nd->nb_neigh = child_offset[i + 1] - child_offset[i] + (i > 0);
+        nd->neigh = neigh;
+        neigh += nd->nb_neigh;
+        if (i > 0) {
+            nd->neigh[0] = t->node_slab + parent[i];
+        }
+        for (k = child_offset[i]; k < child_offset[i + 1]; k++) {
+            nd->neigh[k - child_offset[i] + (i > 0)] = t->node_slab + children[k];
+        }
+        if (i > 0 && nd->nb_neigh > 1) {
+            nd->sim_name = sim_names;
+            sim_names += GENERATED_NAME_LENGTH;
+        }
+    }
+    t->root->name = "ROOT";
+    t->root->sim_name = "Node0";
+
+    log_tree_statistics(t, max_children, context);
+    t->plan = build_traversal_plan(t);
+    if (t->plan == NULL) {
+        fprintf(stderr, "Not enough memory to store the tree traversal.\n");
+        t->snapshot = NULL; /* still owned by the caller */
+        free(t->nodes);
+        free(t->node_slab);
+        free(t->snapshot_slab);
+        free(t);
+        return NULL;
+    }
+    name_simulation_nodes(t);
+    return t;
+}
@@ -0,0 +1,13 @@
+#ifndef PASTML_TREE_SNAPSHOT_H
+#define PASTML_TREE_SNAPSHOT_H
+
+#include "pastml.h"
+
+#define TREE_SNAPSHOT_MAGIC "PASTMLBT"
+#define TREE_SNAPSHOT_VERSION 1
+
+int write_tree_snapshot(const Tree *s_tree, const char *snapshot_path);
+int is_tree_snapshot(const void *data, size_t size);
+Tree *load_tree_snapshot(void *data, size_t size, const AnalysisContext *context);
+
+#endif //PASTML_TREE_SNAPSHOT_H